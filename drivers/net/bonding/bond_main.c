@@ -3370,8 +3370,9 @@ static int bond_xmit_hash_policy_l23(struct sk_buff *skb, int count)
 
 /*
  * Hash for the output device based upon layer 3 and layer 4 data. If
- * the packet is a frag or not TCP or UDP, just use layer 3 data.  If it is
- * altogether not IP, mimic bond_xmit_hash_policy_l2()
+ * the packet is a frag or not TCP or UDP, just use layer 3 data.  MPLS
+ * packets use their flow hash.  If it is altogether not IP, mimic
+ * bond_xmit_hash_policy_l2()
  */
 static int bond_xmit_hash_policy_l34(struct sk_buff *skb, int count)
 {
@@ -3391,6 +3392,10 @@ static int bond_xmit_hash_policy_l34(struct sk_buff *skb, int count)
 
 	}
 
+	/* labelled: the entropy label, else the flow below the stack */
+	if (skb->protocol == htons(ETH_P_MPLS_UC))
+		return skb_get_rxhash(skb) % count;
+
 	return (data->h_dest[5] ^ data->h_source[5]) % count;
 }
 
@@ -26,6 +26,7 @@
 
 #include <linux/socket.h>
 #include <linux/if.h>
+#include <linux/sockios.h>
 
 /**
 *MPLS DEBUGGING
@@ -54,10 +55,13 @@
 					   Pop label and send to IPv6 stack */
 #define MPLS_IMPLICIT_NULL  3       /* a LIB with this, signifies to pop
 					   the next label and use that */
+#define MPLS_ENTROPY_LABEL_IND  7   /* the next label is an entropy label
+					   (RFC 6790), not used to forward */
 
 #define MPLS_CHANGE_MTU		0x01
 #define MPLS_CHANGE_PROP_TTL	0x02
 #define MPLS_CHANGE_INSTR	0x04
+#define MPLS_CHANGE_BACKUP	0x08	/* NHLFE backup key in MPLS_ATTR_BACKUP */
 
 enum mpls_dir {
 	MPLS_IN = 0x10,
@@ -82,6 +86,12 @@ enum mpls_opcode_enum {
 	MPLS_OP_TC2EXP,
 	MPLS_OP_DS2EXP,
 	MPLS_OP_NF2EXP,
+	MPLS_OP_HASH_FWD,
+	MPLS_OP_SWAP,
+	MPLS_OP_VRF,
+	MPLS_OP_P2MP_FWD,
+	MPLS_OP_PUSH_EL,
+	MPLS_OP_POLICE,
 	MPLS_OP_MAX
 };
 
@@ -152,6 +162,30 @@ struct mpls_tunnel_req {
 	unsigned int mt_nhlfe_key;
 };
 
+/* How a tunnel device sends its traffic (mte_encap) */
+enum mpls_tunnel_encap {
+	MPLS_TUNNEL_ENCAP_NONE,	/* LSP head, applies mt_nhlfe_key */
+	MPLS_TUNNEL_ENCAP_UDP,	/* link, MPLS-in-UDP to mte_remote (RFC 7510) */
+	MPLS_TUNNEL_ENCAP_GRE,	/* link, MPLS-in-GRE to mte_remote (RFC 4023) */
+	MPLS_TUNNEL_ENCAP_MAX
+};
+
+#define MPLS_UDP_PORT 6635
+
+/*
+ * Encapsulating tunnels are added and read with their own ioctls, the
+ * SIOC*TUNNEL ones keep taking a struct mpls_tunnel_req.
+ */
+struct mpls_tunnel_encap_req {
+	struct mpls_tunnel_req mte_req;
+	unsigned int           mte_encap;
+	__be32                 mte_local;
+	__be32                 mte_remote;
+};
+
+#define SIOCGETMPLSENCAP (SIOCDEVPRIVATE + 12)
+#define SIOCADDMPLSENCAP (SIOCDEVPRIVATE + 13)
+
 #define MPLS_NFMARK_NUM 64
 
 struct mpls_nfmark_fwd {
@@ -173,12 +207,42 @@ struct mpls_tcindex_fwd {
 	unsigned short tc_mask;
 };
 
+#define MPLS_HASH_NUM 16
+
+/* weight 0 counts as 1 for a configured key */
+struct mpls_hash_fwd {
+	unsigned int  hf_key[MPLS_HASH_NUM];
+	unsigned char hf_weight[MPLS_HASH_NUM];
+};
+
+#define MPLS_P2MP_NUM 16
+
+/* every configured branch gets a copy of the packet */
+struct mpls_p2mp_fwd {
+	unsigned int  pf_key[MPLS_P2MP_NUM];
+};
+
 #define MPLS_EXP_NUM 8
 
 struct mpls_exp_fwd {
 	unsigned int ef_key[MPLS_EXP_NUM];
 };
 
+/* action on the packets out of the profile */
+enum mpls_police_action {
+	MPLS_POLICE_DROP,
+	MPLS_POLICE_REMARK,
+	MPLS_POLICE_ACTION_MAX
+};
+
+/* token bucket, rate in kbit/s, burst in bytes */
+struct mpls_police {
+	unsigned int  mp_rate;
+	unsigned int  mp_burst;
+	unsigned char mp_action;
+	unsigned char mp_exp;
+};
+
 struct mpls_exp2tcindex {
 	unsigned short e2t[MPLS_EXP_NUM];
 };
@@ -207,15 +271,20 @@ struct mpls_instr_elem {
 	unsigned char  mir_direction;
 	union {
 		struct mpls_label        push;
+		struct mpls_label        swap;
 		struct mpls_label        fwd;
 		struct mpls_nfmark_fwd   nf_fwd;
 		struct mpls_dsmark_fwd   ds_fwd;
 		struct mpls_exp_fwd      exp_fwd;
+		struct mpls_hash_fwd     hash_fwd;
+		struct mpls_p2mp_fwd     p2mp_fwd;
 		struct mpls_nexthop_info set;
 		unsigned int             set_rx;
+		unsigned int             vrf;
 		unsigned short           set_tc;
 		unsigned short           set_ds;
 		unsigned char            set_exp;
+		struct mpls_police       police;
 		struct mpls_exp2tcindex  exp2tc;
 		struct mpls_exp2dsmark   exp2ds;
 		struct mpls_tcindex2exp  tc2exp;
@@ -226,16 +295,21 @@ struct mpls_instr_elem {
 
 /* Standard shortcuts */
 #define mir_push       mir_data.push
+#define mir_swap       mir_data.swap
 #define mir_fwd        mir_data.fwd
 #define mir_nf_fwd     mir_data.nf_fwd
 #define mir_ds_fwd     mir_data.ds_fwd
 #define mir_exp_fwd    mir_data.exp_fwd
+#define mir_hash_fwd   mir_data.hash_fwd
+#define mir_p2mp_fwd   mir_data.p2mp_fwd
 #define mir_set        mir_data.set
 #define mir_set_rx     mir_data.set_rx
+#define mir_vrf        mir_data.vrf
 #define mir_set_tc     mir_data.set_tc
 #define mir_set_tx     mir_data.set_tx
 #define mir_set_ds     mir_data.set_ds
 #define mir_set_exp    mir_data.set_exp
+#define mir_police     mir_data.police
 #define mir_exp2tc     mir_data.exp2tc
 #define mir_exp2ds     mir_data.exp2ds
 #define mir_tc2exp     mir_data.tc2exp
@@ -248,6 +322,39 @@ struct mpls_instr_req {
 	struct mpls_instr_elem       mir_instr[0];
 };
 
+/* per ILM/NHLFE counters (MPLS_ATTR_STATS) */
+struct mpls_stats {
+	__u64 ms_packets;
+	__u64 ms_bytes;
+	__u64 ms_drops;
+};
+
+/* POLICE counters of an ILM/NHLFE (MPLS_ATTR_POLICE) */
+struct mpls_police_stats {
+	__u64 mps_conform_packets;
+	__u64 mps_conform_bytes;
+	__u64 mps_exceed_packets;
+	__u64 mps_exceed_bytes;
+};
+
+/* MPLS_CMD_BULK summary (MPLS_ATTR_BULK), number of objects programmed */
+struct mpls_bulk_req {
+	__u32 mb_nhlfe;
+	__u32 mb_ilm;
+	__u32 mb_xc;
+};
+
+/*
+ * Dump filter (MPLS_ATTR_FILTER in a GET dump request). An ILM matches on
+ * its labelspace, owner and the device of the NHLFE it forwards to, a
+ * NHLFE on its owner and output device.
+ */
+struct mpls_dump_filter {
+	int           mdf_labelspace; /* -1 for all */
+	unsigned int  mdf_ifindex;    /* 0 for all */
+	unsigned char mdf_owner;      /* RTPROT_UNSPEC for all */
+};
+
 /* genetlink interface */
 enum {
 	MPLS_CMD_UNSPEC,
@@ -262,6 +369,7 @@ enum {
 	MPLS_CMD_GETXC,
 	MPLS_CMD_SETLABELSPACE,
 	MPLS_CMD_GETLABELSPACE,
+	MPLS_CMD_BULK,
 	__MPLS_CMD_MAX,
 };
 
@@ -274,9 +382,30 @@ enum {
 	MPLS_ATTR_XC,
 	MPLS_ATTR_LABELSPACE,
 	MPLS_ATTR_INSTR,
+	MPLS_ATTR_STATS,
+	MPLS_ATTR_BULK,
+	MPLS_ATTR_BULK_NHLFE,
+	MPLS_ATTR_BULK_ILM,
+	MPLS_ATTR_BULK_XC,
+	MPLS_ATTR_FILTER,
+	MPLS_ATTR_BACKUP,
+	MPLS_ATTR_BACKUP_ACTIVE,
+	MPLS_ATTR_POLICE,
 	__MPLS_ATTR_MAX,
 };
 
 #define MPLS_ATTR_MAX (__MPLS_ATTR_MAX - 1)
 
+/*
+ * MPLS_CMD_BULK carries the lists MPLS_ATTR_BULK_NHLFE, MPLS_ATTR_BULK_ILM
+ * and MPLS_ATTR_BULK_XC. Each element of a list is a nested attribute
+ * holding what the single object command takes: MPLS_ATTR_NHLFE or
+ * MPLS_ATTR_ILM plus MPLS_ATTR_INSTR, or MPLS_ATTR_XC. NHLFEs and ILMs
+ * are created, they must not exist yet. The lists are applied in that
+ * order, so ILMs may FWD to NHLFEs of the same message. If an element
+ * fails, the NHLFEs and ILMs created by the message are withdrawn again.
+ * On success a single MPLS_CMD_BULK event with MPLS_ATTR_BULK is sent to
+ * the group of each table that changed, instead of one event per object.
+ */
+
 #endif
@@ -299,6 +299,9 @@ enum {
 	SKB_GSO_TCPV6 = 1 << 4,
 
 	SKB_GSO_FCOE = 1 << 5,
+
+	/* The payload is behind an MPLS label stack (skb->protocol). */
+	SKB_GSO_MPLS = 1 << 6,
 };
 
 #if BITS_PER_LONG > 32
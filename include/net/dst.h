@@ -54,6 +54,7 @@ struct dst_entry {
 #define DST_NOCACHE		0x0010
 #define DST_NOCOUNT		0x0020
 #define DST_NOPEER		0x0040
+#define DST_GSO_ENCAP		0x0080	/* header_len can go in front of GSO skbs */
 
 	short			error;
 	short			obsolete;
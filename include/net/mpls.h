@@ -31,6 +31,9 @@
 #include <linux/skbuff.h>
 #include <linux/rtnetlink.h>
 #include <linux/gen_stats.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/jump_label.h>
 #include <linux/sysctl.h>
 #include <net/net_namespace.h>
 #include <linux/module.h>
@@ -40,14 +43,18 @@
  */
 extern int sysctl_mpls_debug;
 extern int sysctl_mpls_default_ttl;
+extern int sysctl_mpls_icmp_ratelimit;
 extern struct shim mpls_uc_shim;
 
+/* enabled while sysctl_mpls_debug is set, see sysctl_net_mpls.c */
+extern struct jump_label_key mpls_debug_key;
+
 /*
 Debugging macros
 */
 #define MPLS_DEBUG(f, a...) \
 { \
-	if (sysctl_mpls_debug) {\
+	if (static_branch(&mpls_debug_key)) {\
 		printk(KERN_DEBUG "MPLS DEBUG %s:%d:%s: ", \
 			__FILE__, __LINE__, __func__); \
 		printk(f, ##a); \
@@ -56,7 +63,7 @@ Debugging macros
 
 #define MPLS_DEBUG_CALL(f) \
 { \
-	if (sysctl_mpls_debug) {\
+	if (static_branch(&mpls_debug_key)) {\
 		f; \
 	} \
 }
@@ -120,6 +127,8 @@ struct mpls_skb_cb {
 	unsigned char flag;
 	unsigned char popped_bos;
 	unsigned char recursion;
+	/* set by mpls_input(), which looks the next label up itself */
+	unsigned char relookup;
 	unsigned char *top_of_stack;
 };
 
@@ -144,19 +153,78 @@ struct mpls_skb_cb {
 #define MPLS_RESULT_DLV		3
 #define MPLS_RESULT_FWD		4
 
+/*
+ * Why a labelled packet was dropped, reported by the mpls_drop
+ * tracepoint (include/trace/events/mpls.h).
+ */
+enum mpls_drop_reason {
+	MPLS_DROP_OTHERHOST,	/* not for us at L2 */
+	MPLS_DROP_NOMEM,	/* unshare/pull/cow failed */
+	MPLS_DROP_HDR,		/* malformed label stack */
+	MPLS_DROP_NO_LABELSPACE,/* interface not enabled for MPLS */
+	MPLS_DROP_NO_ILM,	/* label lookup failure */
+	MPLS_DROP_BAD_OPCODE,	/* opcode not valid in this direction */
+	MPLS_DROP_OPCODE,	/* an opcode returned MPLS_RESULT_DROP */
+	MPLS_DROP_NO_FWD,	/* program ended without FWD/SET */
+	MPLS_DROP_DLV,		/* delivery to the L3 protocol failed */
+	MPLS_DROP_TTL,		/* TTL expired */
+	MPLS_DROP_MTU,		/* MTU exceeded */
+	MPLS_DROP_LOOP,		/* too many chained NHLFEs */
+};
+
+/* mpls_switch() gives the skb back, its next label must be looked up */
+#define MPLS_RX_RELOOKUP	0x100
+
+/* Max number of NHLFEs an output opcode may chain to (cf. HASH_FWD),
+ * and of nested P2MP_FWD replications */
+#define MPLS_FWD_MAX_DEPTH	4
+
+
+/**
+ * mpls_push_tmpl - Precompiled run of PUSH opcodes (cf. mpls_instrs_compile)
+ * @pt_hash:   Entry in the table of templates, NHLFEs pushing the same
+ *             stack share one.
+ * @pt_refcnt: Number of instructions using it, under the table lock.
+ * @pt_label:  Label of the last pushed shim (top of stack).
+ * @pt_count:  Number of shims.
+ * @pt_el:     Index of the entropy label in @pt_shim (PUSH_EL), -1 if none.
+ * @pt_exp:    Index of the shim that takes an EXP remarked before the push
+ *             (cb->set_exp, e.g. by a POLICE of the ILM), -1 if none.
+ * @pt_shim:   Encoded shims, top of stack first, with TTL and S bit cleared.
+ **/
+struct mpls_push_tmpl {
+	struct hlist_node   pt_hash;
+	unsigned int        pt_refcnt;
+	unsigned int        pt_label;
+	unsigned int        pt_count;
+	int                 pt_el;
+	int                 pt_exp;
+	__be32              pt_shim[0];
+};
 
 /**
  * mpls_instr - Struct to hold one instruction
- * @mi_opcode: Opcode. MPLS_OP_POP,etc...
- * @mi_data:   Opcode data.
- * @mi_next:   Next Instruction to execute.
+ * @mi_opcode:   Opcode. MPLS_OP_POP,etc...
+ * @mi_data:     Opcode data.
+ * @mi_next:     Next Instruction to execute.
+ * @mi_tmpl:     Precompiled PUSH run starting at this instruction, if any.
+ * @mi_tmpl_set: SET instruction ending that run.
+ * @mi_inline:   Storage for the opcode data that fits (label, EXP), see
+ *               MPLS_BUILD_OPCODE_PROTOTYPE. Within the cache line the
+ *               slab gives the instruction anyway.
  **/
 struct mpls_instr {
 	struct mpls_instr  *mi_next;
-	unsigned short      mi_opcode;
-	enum mpls_dir       mi_dir;
 	void               *mi_data;
 	void               *mi_parent;
+	struct mpls_push_tmpl *mi_tmpl;
+	struct mpls_instr  *mi_tmpl_set;
+	unsigned short      mi_opcode;
+	enum mpls_dir       mi_dir;
+	union {
+		struct mpls_label ml;
+		unsigned char     exp;
+	} mi_inline;
 };
 
 #define for_each_instr(_instr, _mi)	\
@@ -182,6 +250,55 @@ struct mpls_exp_fwd_info {
 	struct mpls_nhlfe *efi_nhlfe[MPLS_EXP_NUM];
 };
 
+struct mpls_hash_fwd_info {
+	struct mpls_nhlfe *hfi_nhlfe[MPLS_HASH_NUM];
+	unsigned char      hfi_weight[MPLS_HASH_NUM];
+	unsigned int       hfi_count;
+	unsigned int       hfi_total;
+	/* header room added to the parent NHLFE */
+	unsigned int       hfi_header_len;
+};
+
+struct mpls_p2mp_fwd_info {
+	struct mpls_nhlfe *pfi_nhlfe[MPLS_P2MP_NUM];
+	unsigned int       pfi_count;
+	/* header room added to the parent NHLFE */
+	unsigned int       pfi_header_len;
+};
+
+/* cost of a byte, in ns << MPLS_POLICE_SHIFT */
+#define MPLS_POLICE_SHIFT	20
+
+/* per cpu part of a POLICE, credit is in ns of the shared bucket */
+struct mpls_police_counters {
+	s64			credit;
+	u64			conform_packets;
+	u64			conform_bytes;
+	u64			exceed_packets;
+	u64			exceed_bytes;
+	struct u64_stats_sync	syncp;
+};
+
+/**
+ * mpls_police_info - state of a POLICE opcode.
+ * @pi_tat:      Theoretical arrival time of the next packet (GCRA), in ns.
+ *               The only shared state, advanced with cmpxchg.
+ * @pi_mult:     Cost of a byte at the configured rate.
+ * @pi_burst_ns: How far ahead of the clock pi_tat may be, the burst.
+ * @pi_batch_ns: Credit a cpu takes from pi_tat on top of what a packet
+ *               costs, so that pi_tat isn't written for every packet.
+ * @pi_conf:     What the user configured.
+ * @pi_stats:    Credit and conform/exceed counters, per cpu.
+ **/
+struct mpls_police_info {
+	atomic64_t                  pi_tat;
+	u64                         pi_mult;
+	u64                         pi_burst_ns;
+	u64                         pi_batch_ns;
+	struct mpls_police          pi_conf;
+	struct mpls_police_counters __percpu *pi_stats;
+};
+
 struct mpls_exp2dsmark_info {
 	unsigned char e2d[MPLS_EXP_NUM];
 };
@@ -211,11 +328,17 @@ struct mpls_nfmark2exp_info {
  ****************************************************************************/
 
 void mpls_instrs_free(struct mpls_instr *list);
-int  mpls_instrs_build(struct mpls_instr_elem *mie,
+int  __mpls_instrs_build(struct mpls_instr_elem *mie,
 				struct mpls_instr **instr, int length,
 				enum mpls_dir dir, void *parent);
 void mpls_instrs_unbuild(struct mpls_instr *instr,
 				struct mpls_instr_req *req);
+void mpls_instrs_graft(struct mpls_instr *instr, void *shadow,
+				void *parent);
+void mpls_instrs_retire(struct mpls_instr *list,
+				struct neighbour *neigh,
+				struct net_device *dev,
+				struct mpls_prot_driver *proto);
 
 /****************************************************************************
  * Layer 3 protocol driver
@@ -232,6 +355,8 @@ struct mpls_prot_driver {
 	char name[MPLSPROTONAMSIZ + 1];
 
 	void (*cache_flush)(struct net *net);
+	/* the cached routes dst_check() their NHLFE, no flush is needed */
+	unsigned char nhlfe_check;
 	void (*set_ttl)(struct sk_buff *skb, int ttl);
 	int  (*get_ttl)(struct sk_buff *skb);
 	void (*change_dsfield)(struct sk_buff *skb, int ds);
@@ -257,6 +382,10 @@ int                      mpls_proto_remove(struct mpls_prot_driver *);
 struct mpls_prot_driver *mpls_proto_find_by_family(unsigned short);
 struct mpls_prot_driver *mpls_proto_find_by_ethertype(unsigned short);
 void                     mpls_proto_cache_flush_all(struct net *);
+void                     mpls_proto_cache_flush_nhlfe(struct net *,
+	struct mpls_nhlfe *nhlfe);
+int                      mpls_proto_deliver(struct sk_buff *skb,
+				unsigned short ethertype);
 
 static inline void mpls_proto_release(struct mpls_prot_driver *prot)
 {
@@ -267,6 +396,42 @@ static inline void mpls_proto_release(struct mpls_prot_driver *prot)
 	prot = NULL;
 }
 
+/****************************************************************************
+ * Per ILM/NHLFE counters, one copy per cpu. Updated with BH disabled.
+ ****************************************************************************/
+
+struct mpls_lsp_stats {
+	u64			packets;
+	u64			bytes;
+	u64			drops;
+	struct u64_stats_sync	syncp;
+};
+
+static inline void mpls_lsp_stats_add(struct mpls_lsp_stats __percpu *stats,
+		unsigned int len)
+{
+	struct mpls_lsp_stats *s = this_cpu_ptr(stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->packets++;
+	s->bytes += len;
+	u64_stats_update_end(&s->syncp);
+}
+
+static inline void mpls_lsp_stats_drop(struct mpls_lsp_stats __percpu *stats)
+{
+	struct mpls_lsp_stats *s = this_cpu_ptr(stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->drops++;
+	u64_stats_update_end(&s->syncp);
+}
+
+void mpls_lsp_stats_fold(struct mpls_stats *ms,
+		struct mpls_lsp_stats __percpu *stats);
+int  mpls_police_stats_fold(struct mpls_police_stats *ps,
+		struct mpls_instr *instr);
+
 /****************************************************************************
  * MPLS INPUT INFO (ILM) OBJECT MANAGEMENT
  * net/mpls/mpls_ilm.c
@@ -275,7 +440,13 @@ static inline void mpls_proto_release(struct mpls_prot_driver *prot)
 struct mpls_ilm {
 	atomic_t				refcnt;
 	struct kmem_cache		*kmem_cachep;
+	/* The object is freed after a RCU-bh grace period */
+	struct rcu_head			rcu;
 	struct list_head		global;
+#ifdef CONFIG_NET_NS
+	/* Namespace whose tables hold this ILM */
+	struct net			*ilm_net;
+#endif
 	/* To appear as an entry in the device ILM list */
 	struct list_head		dev_entry;
 
@@ -293,9 +464,14 @@ struct mpls_ilm {
 	unsigned short           ilm_labelspace;
 	/* Routing protocol */
 	unsigned char            ilm_owner;
+	/* Packets switched by this ILM */
+	struct mpls_lsp_stats __percpu *ilm_stats;
 };
 
-extern struct list_head mpls_ilm_list;
+static inline struct net *mpls_ilm_net(const struct mpls_ilm *ilm)
+{
+	return read_pnet(&ilm->ilm_net);
+}
 
 /****************************************************************************
  * Input Radix Tree Management
@@ -303,10 +479,14 @@ extern struct list_head mpls_ilm_list;
 
 int               mpls_ilm_init(void);
 void              mpls_ilm_exit(void);
-struct mpls_ilm *mpls_get_ilm(unsigned int key);
-struct mpls_ilm *mpls_get_ilm_by_label(struct mpls_label *label,
+void              mpls_ilm_init_net(struct net *net);
+void              mpls_ilm_exit_net(struct net *net);
+struct mpls_ilm *mpls_get_ilm(struct net *net, unsigned int key);
+struct mpls_ilm *mpls_get_ilm_by_label(struct net *net,
+				struct mpls_label *label,
 				int labelspace, char bos);
-extern struct mpls_ilm *mpls_ilm_alloc(unsigned int key,
+void             mpls_ilm_free_rcu(struct rcu_head *head);
+extern struct mpls_ilm *mpls_ilm_alloc(struct net *net, unsigned int key,
 				struct mpls_label *ml,
 				int instr_len);
 
@@ -326,9 +506,11 @@ struct mpls_nhlfe {
 	struct dst_entry	dst;
 
 	struct list_head	global;
+#ifdef CONFIG_NET_NS
+	/* Namespace whose tables hold this NHLFE */
+	struct net		*nhlfe_net;
+#endif
 
-	/* List of notif*/
-	struct notifier_block	*nhlfe_notifier_list;
 	/* List of ILM that are linked to this NHLFE*/
 	struct list_head        list_in;
 	/* To be added into a device list_out if the NHLFE uses (SET) the dev */
@@ -337,14 +519,14 @@ struct mpls_nhlfe {
 	struct mpls_instr      *nhlfe_instr;
 	/* Key used to store/lookup a given NHLFE in the tree*/
 	unsigned int            nhlfe_key;
-	/* Age in jiffies*/
-	unsigned int            nhlfe_age;
 	/* MTU Limit (e.g. from device MTU + number of pushes*/
 	unsigned short			nhlfe_mtu_limit;
 	unsigned char           nhlfe_propagate_ttl;
 
 	/* Routing protocol */
 	unsigned char           nhlfe_owner;
+	/* Output device failed, packets go to nhlfe_backup */
+	unsigned char           nhlfe_frr;
 
 	union {
 		struct sockaddr			common;
@@ -352,14 +534,27 @@ struct mpls_nhlfe {
 		struct sockaddr_in6		ipv6;
 	} nhlfe_nexthop;
 
+	/* Pre-installed bypass/detour, used while nhlfe_frr is set */
+	struct mpls_nhlfe __rcu *nhlfe_backup;
+	/* NHLFEs protected by this one, and our entry on the backup's list */
+	struct list_head        list_protected;
+	struct list_head        backup_entry;
+
 	/* L3 protocol driver for packets that use this NHLFE */
 	struct mpls_prot_driver *nhlfe_proto;
+	/* Bumped when the routes stacked on it have to re-resolve */
+	atomic_t                nhlfe_genid;
+	/* Packets sent/delivered through this NHLFE */
+	struct mpls_lsp_stats __percpu *nhlfe_stats;
 };
 #define nhlfe_nh nhlfe_nexthop.common
 
 #define MPLS_INVALID_MTU 0xFFFF
 
-extern struct list_head mpls_nhlfe_list;
+static inline struct net *mpls_nhlfe_net(const struct mpls_nhlfe *nhlfe)
+{
+	return read_pnet(&nhlfe->nhlfe_net);
+}
 
 struct mpls_fwd_block {
 	struct notifier_block notifier_block;
@@ -373,8 +568,29 @@ struct mpls_fwd_block {
 
 int                 mpls_nhlfe_init(void);
 void                mpls_nhlfe_exit(void);
-struct mpls_nhlfe	*mpls_get_nhlfe(unsigned int);
+void                mpls_nhlfe_init_net(struct net *net);
+void                mpls_nhlfe_exit_net(struct net *net);
+struct mpls_nhlfe	*mpls_get_nhlfe(struct net *net, unsigned int key);
+
+
+/****************************************************************************
+ * Netlink dump cursor
+ ****************************************************************************/
+
+/* Label table of a labelspace (0..MPLS_LABELSPACE_MAX), then radix tree */
+#define MPLS_DUMP_TREE	(MPLS_LABELSPACE_MAX + 1)
+#define MPLS_DUMP_END	(MPLS_LABELSPACE_MAX + 2)
+
+struct mpls_dump_pos {
+	unsigned int table;
+	/* label in a label table, key in the radix tree */
+	unsigned int key;
+};
 
+struct mpls_ilm   *mpls_ilm_dump_next(struct net *net,
+			struct mpls_dump_pos *pos, int labelspace);
+struct mpls_nhlfe *mpls_nhlfe_dump_next(struct net *net,
+			struct mpls_dump_pos *pos);
 
 /****************************************************************************
  * Helper Functions
@@ -382,6 +598,32 @@ struct mpls_nhlfe	*mpls_get_nhlfe(unsigned int);
 
 char                mpls_find_payload(struct sk_buff *skb);
 unsigned int        mpls_label2key(const int, const struct mpls_label*);
+int                 mpls_key2gen(unsigned int key, unsigned int *index,
+			unsigned int *gen);
+bool                mpls_icmp_xrlim_allow(const struct sk_buff *skb,
+			u32 key);
+
+/* RFC 4950 ICMP extension: the label stack of the offending packet */
+struct mpls_icmp_common {
+#if defined(__LITTLE_ENDIAN_BITFIELD)
+	__u8    res1:4, version:4;
+#elif defined (__BIG_ENDIAN_BITFIELD)
+	__u8    version:4, res1:4;
+#else
+#error  "Please fix <asm/byteorder.h>"
+#endif
+	__u8	res2;
+	__sum16	check;
+};
+
+struct mpls_icmp_object {
+	__be16	length;
+	__u8	class;
+	__u8	type;
+};
+
+/* RFC 4884: the original datagram is padded to 128 bytes before them */
+#define MPLS_ICMP_ORIG_LEN	128
 
 
 /****************************************************************************
@@ -392,6 +634,9 @@ unsigned int        mpls_label2key(const int, const struct mpls_label*);
 int  mpls_skb_recv(struct sk_buff *skb,
 	struct net_device *dev, struct packet_type *ptype,
 	struct net_device *orig);
+struct sk_buff **mpls_gro_receive(struct sk_buff **head,
+	struct sk_buff *skb);
+int  mpls_gro_complete(struct sk_buff *skb);
 
 
 /****************************************************************************
@@ -402,6 +647,10 @@ int  mpls_skb_recv(struct sk_buff *skb,
 int  mpls_set_nexthop2(struct mpls_nhlfe *nhlfe, struct dst_entry *dst);
 int  mpls_output(struct sk_buff *skb);
 int  mpls_switch(struct sk_buff *skb);
+int  mpls_output_branch(struct sk_buff *skb, struct mpls_nhlfe *nhlfe);
+struct sk_buff *mpls_gso_segment(struct sk_buff *skb,
+	netdev_features_t features);
+int  mpls_gso_send_check(struct sk_buff *skb);
 
 /****************************************************************************
  * INPUT/OUTPUT INSTRUCTION OPCODES
@@ -423,7 +672,9 @@ int (NAME) (struct sk_buff **pskb, struct mpls_ilm *ilm, \
  * instr:     Instruction array.
  * direction: MPLS_IN (ILM) or MPLS_OUT(NHLFE)
  * parent:    ILM/NHLFE parent object for opcode.
- * data:      opcode dependant data. [OUT]
+ * data:      opcode dependant data. [OUT] Points to the mi_inline storage
+ *            of the instruction on entry: data that fits is kept there,
+ *            and the opcode has no cleanup to free it.
  * last_able: Nonzero if this can be the last opcode. [OUT]
  */
 #define MPLS_BUILD_OPCODE_PROTOTYPE(NAME) \
@@ -485,6 +736,20 @@ static inline void mpls_label_entry_peek(struct sk_buff *skb)
 	cb->label = __MPLS_SHIM_LABEL(shim);
 }
 
+/**
+ * mpls_entropy_label - Entropy label (RFC 6790) for the flow of a packet.
+ * @skb: packet, before the caller pushes the label.
+ *
+ * The flow hash is spread over 16..2^20-1, the reserved labels are never
+ * used. Returns the shim with EXP, S bit and TTL (0 for an EL) cleared.
+ **/
+static inline __be32 mpls_entropy_label(struct sk_buff *skb)
+{
+	u32 el = 16 + (((u64)skb_get_rxhash(skb) * (0x100000 - 16)) >> 32);
+
+	return htonl(el << 12);
+}
+
 static inline void mpls_nhlfe_update_mtu(
 	struct mpls_nhlfe *nhlfe, unsigned short mtu)
 {
@@ -494,38 +759,78 @@ static inline void mpls_nhlfe_update_mtu(
 }
 
 /* Query/Update Incoming Labels */
-struct mpls_ilm *mpls_add_in_label(const struct mpls_in_label_req *in);
-struct mpls_ilm *mpls_get_ilm_label(const struct mpls_in_label_req *in);
-int  mpls_del_in_label(struct mpls_in_label_req *in,
+struct mpls_ilm *mpls_add_in_label(struct net *net,
+	const struct mpls_in_label_req *in);
+struct mpls_ilm *mpls_get_ilm_label(struct net *net,
+	const struct mpls_in_label_req *in);
+int  mpls_del_in_label(struct net *net, struct mpls_in_label_req *in,
 	int seq, int pid);
 int  mpls_add_reserved_label(int label, struct mpls_ilm *ilm);
 struct mpls_ilm *mpls_del_reserved_label(int label);
-int mpls_ilm_set_instrs(struct mpls_in_label_req *mil,
+int mpls_ilm_set_instrs(struct net *net, struct mpls_in_label_req *mil,
 	struct mpls_instr_elem *mie, int length);
 int _mpls_ilm_set_instrs(struct mpls_ilm *ilm,
 	struct mpls_instr_elem *mie, int length);
 int mpls_del_ilm(struct mpls_ilm *ilm,
 	int seq, int pid);
 
+/* Batched programming of Incoming Labels */
+struct mpls_ilm *mpls_ilm_build(struct net *net,
+	const struct mpls_in_label_req *in,
+	struct mpls_instr_elem *mie, int length);
+int  mpls_insert_ilms(struct net *net, struct mpls_ilm **ilm, int count);
+void mpls_del_ilms(struct net *net, struct mpls_ilm **ilm, int count);
+
 /* Query/Update Outgoing Labels */
-struct mpls_nhlfe *mpls_add_out_label(struct mpls_out_label_req *out);
-struct mpls_nhlfe *mpls_get_nhlfe_label(struct mpls_out_label_req *out);
-int mpls_del_out_label(struct mpls_out_label_req *out,
+struct mpls_nhlfe *mpls_add_out_label(struct net *net,
+	struct mpls_out_label_req *out);
+struct mpls_nhlfe *mpls_get_nhlfe_label(struct net *net,
+	struct mpls_out_label_req *out);
+int mpls_del_out_label(struct net *net, struct mpls_out_label_req *out,
 	int seq, int pid);
-int mpls_set_out_label_mtu(struct mpls_out_label_req *out);
-int mpls_nhlfe_set_instrs(struct mpls_out_label_req *mol,
+int mpls_set_out_label_mtu(struct net *net, struct mpls_out_label_req *out);
+int mpls_nhlfe_set_instrs(struct net *net, struct mpls_out_label_req *mol,
 	struct mpls_instr_elem *mie, int length);
 int mpls_del_nhlfe(struct mpls_nhlfe *nhlfe,
 	int seq, int pid);
 
+int mpls_set_out_label_backup(struct net *net,
+	struct mpls_out_label_req *mol, unsigned int backup_key);
+void mpls_nhlfe_set_backup(struct mpls_nhlfe *nhlfe,
+	struct mpls_nhlfe *backup);
+int  mpls_nhlfe_frr_activate(struct mpls_nhlfe *nhlfe);
+void mpls_nhlfe_frr_revert(struct mpls_nhlfe *nhlfe);
+
+/* Batched programming of Outgoing Labels */
+struct mpls_nhlfe *mpls_nhlfe_build(struct net *net,
+	struct mpls_out_label_req *out,
+	struct mpls_instr_elem *mie, int length);
+int  mpls_insert_nhlfes(struct net *net, struct mpls_nhlfe **nhlfe,
+	int count);
+void mpls_del_nhlfes(struct net *net, struct mpls_nhlfe **nhlfe, int count);
+
 /* Query/Update Crossconnects */
-int mpls_attach_in2out(struct mpls_xconnect_req *req,
+
+/* What a crossconnect replaced, so that a failed batch can put it back */
+struct mpls_xc_undo {
+	unsigned int	xu_ilm_key;
+	/* last opcode of the ILM before, MPLS_OP_MAX if left unchanged */
+	unsigned short	xu_opcode;
+	/* NHLFE it forwarded to, if xu_opcode is MPLS_OP_FWD */
+	unsigned int	xu_nhlfe_key;
+};
+
+int mpls_attach_in2out(struct net *net, struct mpls_xconnect_req *req,
 	int seq, int pid);
-int mpls_detach_in2out(struct mpls_xconnect_req *req,
+int __mpls_attach_in2out(struct net *net, struct mpls_xconnect_req *req,
+	int seq, int pid, int notify, struct mpls_xc_undo *undo);
+void mpls_xc_revert(struct net *net, struct mpls_xc_undo *undo);
+int mpls_detach_in2out(struct net *net, struct mpls_xconnect_req *req,
 	int seq, int pid);
 
 /* Instruction Management */
-int mpls_set_out_label_propagate_ttl(struct mpls_out_label_req *mol);
+int mpls_set_out_label_propagate_ttl(struct net *net,
+	struct mpls_out_label_req *mol);
 
 void mpls_destroy_nhlfe_instrs(struct mpls_nhlfe *nhlfe);
 void mpls_destroy_ilm_instrs(struct mpls_ilm  *ilm);
@@ -560,7 +865,7 @@ static inline int __mpls_get_labelspace(struct net_device *dev)
 	return mif ? mif->labelspace : -1;
 }
 
-int mpls_set_labelspace(struct mpls_labelspace_req *req,
+int mpls_set_labelspace(struct net *net, struct mpls_labelspace_req *req,
 	int seq, int pid);
 
 /* Netlink event notification */
@@ -587,12 +892,13 @@ static inline struct mpls_ilm *mpls_ilm_hold(struct mpls_ilm *ilm)
 }
 
 
-/* Release */
+/* Release: packets being switched don't hold a reference, so the memory
+ * is given back only after a RCU-bh grace period */
 static inline void mpls_ilm_release(struct mpls_ilm *ilm)
 {
 	BUG_ON(!ilm);
 	if (atomic_dec_and_test(&ilm->refcnt))
-		kmem_cache_free(ilm->kmem_cachep, ilm);
+		call_rcu_bh(&ilm->rcu, mpls_ilm_free_rcu);
 }
 
 
@@ -625,6 +931,16 @@ static inline void mpls_nhlfe_drop(struct mpls_nhlfe *nhlfe)
 	call_rcu_bh(&nhlfe->dst.rcu_head, dst_rcu_free);
 }
 
+/*
+ * The routes stacked on the NHLFE fail nhlfe_dst_check() from now on.
+ * The change they have to pick up is made before.
+ */
+static inline void mpls_nhlfe_invalidate(struct mpls_nhlfe *nhlfe)
+{
+	smp_wmb();
+	atomic_inc(&nhlfe->nhlfe_genid);
+}
+
 /****************************************************************************
  * sysctl Implementation
  * net/mpls/sysctl_net_mpls.c
@@ -663,15 +979,28 @@ void mpls_shim_exit(void);
  * net/mpls/mpls_tunnel.c
  ****************************************************************************/
 
+struct mpls_tunnel_stats {
+	u64			rx_packets;
+	u64			rx_bytes;
+	u64			tx_packets;
+	u64			tx_bytes;
+	struct u64_stats_sync	syncp;
+};
+
 struct mpls_tunnel_private {
 	/* NHLFE Object to apply to this tunnel traffic */
 	struct mpls_nhlfe             *mtp_nhlfe;
 	/* Netdevice for this tunnel                  */
 	struct net_device             *mtp_dev;
-	/* Next tunnel in list                        */
-	struct mpls_tunnel_private    *next;
-	/* Netdevice (this tunnel) traffic stats      */
-	struct net_device_stats        stat;
+	/* Per cpu traffic counters, errors in ->stats */
+	struct mpls_tunnel_stats __percpu *mtp_stats;
+	/* Encapsulation (MPLS_TUNNEL_ENCAP_*)        */
+	unsigned int                   mtp_encap;
+	/* IPv4 endpoints of an encapsulating tunnel  */
+	__be32                         mtp_local;
+	__be32                         mtp_remote;
+	/* Entry in the hash of encapsulating tunnels */
+	struct hlist_node              mtp_encap_node;
 };
 
 
@@ -689,6 +1018,16 @@ void               mpls_tunnel_destroy(struct mpls_tunnel_req *mt);
 #define _mpls_as_dfi(PTR)   ((struct mpls_dsmark_fwd_info *)(PTR))
 #define _mpls_as_nfi(PTR)   ((struct mpls_nfmark_fwd_info *)(PTR))
 #define _mpls_as_efi(PTR)   ((struct mpls_exp_fwd_info *)(PTR))
+#define _mpls_as_hfi(PTR)   ((struct mpls_hash_fwd_info *)(PTR))
+#define _mpls_as_pfi(PTR)   ((struct mpls_p2mp_fwd_info *)(PTR))
+#define _mpls_as_pi(PTR)    ((struct mpls_police_info *)(PTR))
 #define _mpls_as_netdev(PTR)((struct net_device *)(PTR))
 
+/* Namespace of the ILM/NHLFE an instruction set is built for */
+static inline struct net *mpls_parent_net(void *parent, enum mpls_dir dir)
+{
+	return dir == MPLS_IN ? mpls_ilm_net(_mpls_as_ilm(parent)) :
+		mpls_nhlfe_net(_mpls_as_nhlfe(parent));
+}
+
 #endif
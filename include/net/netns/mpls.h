@@ -0,0 +1,29 @@
+/*
+ * MPLS network namespace
+ */
+#ifndef __NETNS_MPLS_H__
+#define __NETNS_MPLS_H__
+
+#include <linux/list.h>
+#include <linux/radix-tree.h>
+#include <linux/spinlock.h>
+#include <linux/mpls.h>
+
+struct mpls_ilm_table;
+
+struct netns_mpls {
+	/* ILMs: labels that are not in a label table, and every ILM */
+	struct radix_tree_root	ilm_tree;
+	spinlock_t		ilm_lock;
+	struct list_head	ilm_list;
+#ifdef CONFIG_MPLS_ILM_TABLE
+	/* generic labels of labelspaces 0..MPLS_LABELSPACE_MAX */
+	struct mpls_ilm_table __rcu *ilm_table[MPLS_LABELSPACE_MAX + 1];
+#endif
+	/* NHLFEs, protected by nhlfe_lock */
+	struct radix_tree_root	nhlfe_tree;
+	spinlock_t		nhlfe_lock;
+	struct list_head	nhlfe_list;
+};
+
+#endif /* __NETNS_MPLS_H__ */
@@ -69,6 +69,9 @@ struct rtable {
 	u32			rt_peer_genid;
 	struct inet_peer	*peer; /* long-living peer info */
 	struct fib_info		*fi; /* for client ref to shared metrics */
+#if IS_ENABLED(CONFIG_IP_MPLS)
+	u32			rt_child_cookie; /* dst_check() of dst.child */
+#endif
 };
 
 static inline bool rt_is_input_route(const struct rtable *rt)
@@ -21,8 +21,14 @@
 
 struct shim_blk;
 
+/*
+ * build() stacks the dst on the one the shim blk names (dst->child). The
+ * cookie, if asked for, is what dst_check() of the child must be given
+ * later on to tell whether the child changed since.
+ */
 struct shim {
-	int			(*build)(struct shim_blk *, struct dst_entry *);
+	int			(*build)(struct shim_blk *, struct dst_entry *,
+					 u32 *cookie);
 	char		name[SHIMNAMSIZ + 1];
 };
 
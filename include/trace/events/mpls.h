@@ -0,0 +1,206 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mpls
+
+#if !defined(_TRACE_MPLS_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_MPLS_H
+
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+#include <net/mpls.h>
+
+#define show_mpls_dir(dir)						\
+	__print_symbolic(dir,						\
+		{ MPLS_IN,		"in" },				\
+		{ MPLS_OUT,		"out" })
+
+#define show_mpls_opcode(op)						\
+	__print_symbolic(op,						\
+		{ MPLS_OP_DROP,		"DROP" },			\
+		{ MPLS_OP_POP,		"POP" },			\
+		{ MPLS_OP_PEEK,		"PEEK" },			\
+		{ MPLS_OP_PUSH,		"PUSH" },			\
+		{ MPLS_OP_FWD,		"FWD" },			\
+		{ MPLS_OP_NF_FWD,	"NF_FWD" },			\
+		{ MPLS_OP_DS_FWD,	"DS_FWD" },			\
+		{ MPLS_OP_EXP_FWD,	"EXP_FWD" },			\
+		{ MPLS_OP_SET,		"SET" },			\
+		{ MPLS_OP_SET_TC,	"SET_TC" },			\
+		{ MPLS_OP_SET_DS,	"SET_DS" },			\
+		{ MPLS_OP_SET_EXP,	"SET_EXP" },			\
+		{ MPLS_OP_EXP2TC,	"EXP2TC" },			\
+		{ MPLS_OP_EXP2DS,	"EXP2DS" },			\
+		{ MPLS_OP_TC2EXP,	"TC2EXP" },			\
+		{ MPLS_OP_DS2EXP,	"DS2EXP" },			\
+		{ MPLS_OP_NF2EXP,	"NF2EXP" },			\
+		{ MPLS_OP_HASH_FWD,	"HASH_FWD" },			\
+		{ MPLS_OP_SWAP,		"SWAP" },			\
+		{ MPLS_OP_VRF,		"VRF" },			\
+		{ MPLS_OP_P2MP_FWD,	"P2MP_FWD" },			\
+		{ MPLS_OP_PUSH_EL,	"PUSH_EL" },			\
+		{ MPLS_OP_POLICE,	"POLICE" })
+
+#define show_mpls_result(res)						\
+	__print_symbolic(res,						\
+		{ MPLS_RESULT_SUCCESS,	"SUCCESS" },			\
+		{ MPLS_RESULT_RECURSE,	"RECURSE" },			\
+		{ MPLS_RESULT_DROP,	"DROP" },			\
+		{ MPLS_RESULT_DLV,	"DLV" },			\
+		{ MPLS_RESULT_FWD,	"FWD" })
+
+#define show_mpls_drop_reason(reason)					\
+	__print_symbolic(reason,					\
+		{ MPLS_DROP_OTHERHOST,		"otherhost" },		\
+		{ MPLS_DROP_NOMEM,		"nomem" },		\
+		{ MPLS_DROP_HDR,		"header" },		\
+		{ MPLS_DROP_NO_LABELSPACE,	"no_labelspace" },	\
+		{ MPLS_DROP_NO_ILM,		"no_ilm" },		\
+		{ MPLS_DROP_BAD_OPCODE,		"bad_opcode" },		\
+		{ MPLS_DROP_OPCODE,		"opcode" },		\
+		{ MPLS_DROP_NO_FWD,		"no_fwd" },		\
+		{ MPLS_DROP_DLV,		"dlv" },		\
+		{ MPLS_DROP_TTL,		"ttl" },		\
+		{ MPLS_DROP_MTU,		"mtu" },		\
+		{ MPLS_DROP_LOOP,		"loop" })
+
+/* A labelled packet entering the stack, mpls_skb_recv() */
+TRACE_EVENT(mpls_recv,
+
+	TP_PROTO(struct sk_buff *skb, struct net_device *dev, int labelspace),
+
+	TP_ARGS(skb, dev, labelspace),
+
+	TP_STRUCT__entry(
+		__field(	const void *,	skbaddr		)
+		__field(	unsigned int,	len		)
+		__field(	u32,		label		)
+		__field(	int,		labelspace	)
+		__string(	dev_name,	dev->name	)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->len = skb->len;
+		__entry->label = MPLSCB(skb)->label;
+		__entry->labelspace = labelspace;
+		__assign_str(dev_name, dev->name);
+	),
+
+	TP_printk("dev=%s skbaddr=%p len=%u label=%u labelspace=%d",
+		__get_str(dev_name), __entry->skbaddr, __entry->len,
+		__entry->label, __entry->labelspace)
+);
+
+/* ILM lookup of every label of the stack, mpls_input() */
+TRACE_EVENT(mpls_input,
+
+	TP_PROTO(struct sk_buff *skb, int labelspace),
+
+	TP_ARGS(skb, labelspace),
+
+	TP_STRUCT__entry(
+		__field(	const void *,	skbaddr		)
+		__field(	u32,		label		)
+		__field(	int,		labelspace	)
+		__field(	u8,		exp		)
+		__field(	u8,		bos		)
+		__field(	u8,		ttl		)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->label = MPLSCB(skb)->label;
+		__entry->labelspace = labelspace;
+		__entry->exp = MPLSCB(skb)->exp;
+		__entry->bos = MPLSCB(skb)->bos;
+		__entry->ttl = MPLSCB(skb)->ttl;
+	),
+
+	TP_printk("skbaddr=%p label=%u labelspace=%d exp=%u bos=%u ttl=%u",
+		__entry->skbaddr, __entry->label, __entry->labelspace,
+		__entry->exp, __entry->bos, __entry->ttl)
+);
+
+/*
+ * Result of one opcode of an ILM (@key is the incoming label) or NHLFE
+ * (@key is the NHLFE key) program.
+ */
+TRACE_EVENT(mpls_opcode,
+
+	TP_PROTO(int dir, u32 key, int opcode, int result),
+
+	TP_ARGS(dir, key, opcode, result),
+
+	TP_STRUCT__entry(
+		__field(	int,		dir		)
+		__field(	u32,		key		)
+		__field(	int,		opcode		)
+		__field(	int,		result		)
+	),
+
+	TP_fast_assign(
+		__entry->dir = dir;
+		__entry->key = key;
+		__entry->opcode = opcode;
+		__entry->result = result;
+	),
+
+	TP_printk("dir=%s key=%#x opcode=%s result=%s",
+		show_mpls_dir(__entry->dir), __entry->key,
+		show_mpls_opcode(__entry->opcode),
+		show_mpls_result(__entry->result))
+);
+
+/* Every NHLFE the packet goes through, mpls_finish_output() */
+TRACE_EVENT(mpls_output,
+
+	TP_PROTO(struct sk_buff *skb, struct mpls_nhlfe *nhlfe),
+
+	TP_ARGS(skb, nhlfe),
+
+	TP_STRUCT__entry(
+		__field(	const void *,	skbaddr		)
+		__field(	unsigned int,	len		)
+		__field(	u32,		key		)
+		__string(	dev_name,	nhlfe->dst.dev->name	)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->len = skb->len;
+		__entry->key = nhlfe->nhlfe_key;
+		__assign_str(dev_name, nhlfe->dst.dev->name);
+	),
+
+	TP_printk("dev=%s skbaddr=%p len=%u key=%#x",
+		__get_str(dev_name), __entry->skbaddr, __entry->len,
+		__entry->key)
+);
+
+TRACE_EVENT(mpls_drop,
+
+	TP_PROTO(struct sk_buff *skb, int dir, int reason),
+
+	TP_ARGS(skb, dir, reason),
+
+	TP_STRUCT__entry(
+		__field(	const void *,	skbaddr		)
+		__field(	int,		dir		)
+		__field(	int,		reason		)
+	),
+
+	TP_fast_assign(
+		__entry->skbaddr = skb;
+		__entry->dir = dir;
+		__entry->reason = reason;
+	),
+
+	TP_printk("skbaddr=%p dir=%s reason=%s",
+		__entry->skbaddr, show_mpls_dir(__entry->dir),
+		show_mpls_drop_reason(__entry->reason))
+);
+
+#endif /* _TRACE_MPLS_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
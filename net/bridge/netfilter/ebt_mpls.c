@@ -71,7 +71,7 @@ checkentry(const struct xt_tgchk_param *par)
 	struct xt_MPLS_target_info *mplsinfo = par->targinfo;
 
 	MPLS_ENTER;
-	mplsinfo->nhlfe = mpls_get_nhlfe(mplsinfo->key);
+	mplsinfo->nhlfe = mpls_get_nhlfe(par->net, mplsinfo->key);
 	if (!mplsinfo->nhlfe) {
 		printk(KERN_WARNING "mpls: unable to find NHLFE with key %x\n",
 				mplsinfo->key);
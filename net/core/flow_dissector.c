@@ -6,8 +6,12 @@
 #include <linux/if_tunnel.h>
 #include <linux/if_pppox.h>
 #include <linux/ppp_defs.h>
+#include <linux/mpls.h>
 #include <net/flow_keys.h>
 
+/* Labels looked at before giving up on finding the bottom of the stack */
+#define MPLS_DISSECT_MAX_DEPTH	8
+
 /* copy saddr & daddr, possibly using 64bit load/store
  * Equivalent to :	flow->src = iph->saddr;
  *			flow->dst = iph->daddr;
@@ -71,6 +75,57 @@ ipv6:
 		nhoff += sizeof(*vlan);
 		goto again;
 	}
+	case __constant_htons(ETH_P_MPLS_UC):
+	case __constant_htons(ETH_P_MPLS_MC): {
+		const __be32 *hdr;
+		__be32 _hdr;
+		const u8 *ver;
+		u8 _ver;
+		u32 shim = 0;
+		int depth;
+
+		/*
+		 * The flow is the entropy label if there is one, else the
+		 * 5-tuple of the IPv4/IPv6 payload, else the bottom label.
+		 */
+		for (depth = 0; depth < MPLS_DISSECT_MAX_DEPTH; depth++) {
+			hdr = skb_header_pointer(skb, nhoff, sizeof(_hdr),
+						 &_hdr);
+			if (!hdr)
+				return false;
+			nhoff += sizeof(_hdr);
+
+			if ((ntohl(*hdr) >> 12) == MPLS_ENTROPY_LABEL_IND &&
+			    !(ntohl(*hdr) & 0x100)) {
+				hdr = skb_header_pointer(skb, nhoff,
+						sizeof(_hdr), &_hdr);
+				if (!hdr)
+					return false;
+				flow->src = htonl(ntohl(*hdr) >> 12);
+				return true;
+			}
+
+			shim = ntohl(*hdr);
+			if (shim & 0x100)
+				break;
+		}
+		flow->src = htonl(shim >> 12);
+		if (!(shim & 0x100))
+			return true;
+
+		ver = skb_header_pointer(skb, nhoff, sizeof(_ver), &_ver);
+		if (!ver)
+			return true;
+		switch (*ver >> 4) {
+		case 4:
+			proto = htons(ETH_P_IP);
+			goto again;
+		case 6:
+			proto = htons(ETH_P_IPV6);
+			goto again;
+		}
+		return true;
+	}
 	case __constant_htons(ETH_P_PPP_SES): {
 		struct {
 			struct pppoe_hdr hdr;
@@ -450,3 +450,4 @@ drop:
 out:
 	return NET_RX_DROP;
 }
+EXPORT_SYMBOL_GPL(ip_rcv);
@@ -68,98 +68,150 @@ static inline int mpls4_get_dsfield(struct sk_buff *skb)
 	return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
 }
 
-struct mpls_icmp_common {
-#if defined(__LITTLE_ENDIAN_BITFIELD)
-	__u8    res1:4, version:4;
-#elif defined (__BIG_ENDIAN_BITFIELD)
-	__u8    version:4, res1:4;
-#else
-#error  "Please fix <asm/byteorder.h>"
-#endif
-	__u8	res2;
-	__u16	check;
-};
-
-struct mpls_icmp_object {
-	__u16	length;
-	__u8	class;
-	__u8	type;
-};
+/**
+ *	mpls4_icmp_header - the IPv4 header an ICMP error may be sent about.
+ *	@skb: offending packet, skb->data in the label stack.
+ *	@pull: offset of the payload, under the label stack.
+ *
+ *	Same rules as icmp_send(): no errors about fragments but the first,
+ *	about ICMP errors, or from/to addresses that aren't unicast.
+ *	Returns NULL if no error is to be sent.
+ **/
 
-/* we can probably used a modified ip_append_data to build this */
-//should be fixed
-static struct sk_buff *mpls4_build_icmp(struct sk_buff *skb, int type, unsigned int icmp_data,	int mpls)
+static const struct iphdr *mpls4_icmp_header(struct sk_buff *skb, int pull)
 {
-	unsigned char buf[576]; /* JBO: too much use on stack? */
+	const struct iphdr *iph;
+
+	if (!pskb_may_pull(skb, pull + sizeof(struct iphdr)))
+		return NULL;
+	iph = (const struct iphdr *)(skb->data + pull);
+
+	if (iph->version != 4 || iph->ihl < 5)
+		return NULL;
+
+	if (iph->frag_off & htons(IP_OFFSET))
+		return NULL;
+
+	if (ipv4_is_zeronet(iph->saddr) || ipv4_is_loopback(iph->saddr) ||
+	    ipv4_is_multicast(iph->saddr) || ipv4_is_lbcast(iph->saddr) ||
+	    ipv4_is_multicast(iph->daddr) || ipv4_is_lbcast(iph->daddr))
+		return NULL;
+
+	if (iph->protocol == IPPROTO_ICMP) {
+		const struct icmphdr *icmph;
+
+		if (!pskb_may_pull(skb,
+				pull + iph->ihl * 4 + sizeof(struct icmphdr)))
+			return NULL;
+		iph = (const struct iphdr *)(skb->data + pull);
+		icmph = (const struct icmphdr *)
+			((const u8 *)iph + iph->ihl * 4);
+
+		if (icmph->type > NR_ICMP_TYPES ||
+		    (icmph->type != ICMP_ECHOREPLY &&
+		     icmph->type != ICMP_ECHO &&
+		     icmph->type != ICMP_TIMESTAMP &&
+		     icmph->type != ICMP_TIMESTAMPREPLY &&
+		     icmph->type != ICMP_INFO_REQUEST &&
+		     icmph->type != ICMP_INFO_REPLY &&
+		     icmph->type != ICMP_ADDRESS &&
+		     icmph->type != ICMP_ADDRESSREPLY))
+			return NULL;
+	}
+	return iph;
+}
 
+/**
+ *	mpls4_build_icmp - build the ICMP error about a labelled IPv4 packet.
+ *	@skb: offending packet, skb->data in the label stack.
+ *	@type: ICMP_TIME_EXCEEDED or ICMP_DEST_UNREACH (fragmentation needed).
+ *	@icmp_data: second word of the ICMP header.
+ *	@mpls: append the received label stack (RFC 4950).
+ *
+ *	The rate limit is checked first, then the reply is written in place
+ *	into the only skb allocated, sized for it: at most 576 bytes, or the
+ *	first 128 bytes of the original datagram and the label stack object.
+ *	The source address is the one the route back to the sender picks.
+ **/
+
+static struct sk_buff *mpls4_build_icmp(struct sk_buff *skb, int type,
+		unsigned int icmp_data, int mpls)
+{
+	struct mpls_icmp_common *common;
+	struct mpls_icmp_object *object;
+	const struct iphdr *oiph;
 	struct icmphdr *icmph;
 	struct sk_buff *nskb;
-	unsigned char *data;
+	struct flowi4 fl4;
 	struct rtable *rt;
 	struct iphdr *iph;
-
-	unsigned int icmp_start = 0;
-	unsigned int len = 0;
-	unsigned int real;
-	unsigned int max;
-	unsigned int height;
+	unsigned int stack = 0;
+	unsigned int height = 0;
+	unsigned int orig;
+	unsigned int len;
+	u8 *data;
 	int pull;
+
 	MPLS_ENTER;
 	/* find the distance to the bottom of the MPLS stack */
 	pull = mpls_find_payload(skb);
 	if (pull < 0)
-		goto error_0;
-
-	if (!skb_pull(skb, pull))
-		goto error_0;
-
-	height = skb->data - MPLSCB(skb)->top_of_stack;
+		goto error;
 
-	/* now where at the payload, for now we're
-	 * assuming this is IPv4
-	 */
-	skb_reset_network_header(skb);
+	/* offsets, the head may move */
+	if (mpls) {
+		stack = MPLSCB(skb)->top_of_stack - skb->head;
+		height = skb->data + pull - MPLSCB(skb)->top_of_stack;
+	}
 
-	/* build a new skb, that will be big enough to hold
-	 * a maximum of 576 bytes (RFC792)
-	 */
-	if ((skb->len + skb_tailroom(skb)) < 576) {
-		nskb = skb_copy_expand(skb, skb_headroom(skb),
-			(576 + 16) - skb->len, GFP_ATOMIC);
+	oiph = mpls4_icmp_header(skb, pull);
+	if (!oiph)
+		goto error;
+
+	if (!mpls_icmp_xrlim_allow(skb, (__force u32)oiph->saddr))
+		goto error;
+
+	memset(&fl4, 0, sizeof(fl4));
+	fl4.daddr = oiph->saddr;
+	fl4.flowi4_tos = RT_TOS(oiph->tos);
+	fl4.flowi4_proto = IPPROTO_ICMP;
+	rt = ip_route_output_key(dev_net(skb->dev), &fl4);
+	if (IS_ERR(rt))
+		goto error;
+
+	len = sizeof(struct iphdr) + sizeof(struct icmphdr);
+	if (mpls) {
+		orig = min_t(unsigned int, skb->len - pull, MPLS_ICMP_ORIG_LEN);
+		len += MPLS_ICMP_ORIG_LEN + sizeof(struct mpls_icmp_common) +
+			sizeof(struct mpls_icmp_object) + height;
 	} else {
-		nskb = skb_copy(skb, GFP_ATOMIC);
+		orig = min_t(unsigned int, skb->len - pull, 576 - len);
+		len += orig;
 	}
 
-	if (!nskb)
-		goto error_0;
-
-	/* I don't handle IP options */
-	if (ip_hdr(nskb)->ihl > 5) {
-		printk(KERN_ERR "IP options!!!!\n");
-		goto error_1;
+	nskb = alloc_skb(LL_RESERVED_SPACE(rt->dst.dev) + len, GFP_ATOMIC);
+	if (!nskb) {
+		ip_rt_put(rt);
+		goto error;
 	}
+	skb_reserve(nskb, LL_RESERVED_SPACE(rt->dst.dev));
+	skb_reset_network_header(nskb);
+	skb_put(nskb, len);
+	skb_dst_set(nskb, &rt->dst);
 
-	memset(buf, 0, sizeof(buf));
-
-	/* point to the buf, we'll build our ICMP message there
-	 * then copy to nskb when we're done
-	 */
-	iph = (struct iphdr*)&buf[len];
+	iph = ip_hdr(nskb);
 	iph->version = 4;
 	iph->ihl = 5;
-	iph->tos = ip_hdr(nskb)->tos;
-	iph->tot_len = 0;
-	iph->id = 0;
+	iph->tos = oiph->tos;
+	iph->tot_len = htons(len);
 	iph->frag_off = 0;
 	iph->ttl = sysctl_mpls_default_ttl;
 	iph->protocol = IPPROTO_ICMP;
-	iph->check = 0;
-	iph->saddr = ip_hdr(nskb)->daddr;
-	iph->daddr = ip_hdr(nskb)->saddr;
-	len += sizeof(struct iphdr);
+	iph->saddr = fl4.saddr;
+	iph->daddr = fl4.daddr;
+	ip_select_ident(iph, &rt->dst, NULL);
 
-	icmp_start = len;
-	icmph = (struct icmphdr*)&buf[len];
+	icmph = (struct icmphdr *)(iph + 1);
 	icmph->checksum = 0;
 	icmph->un.gateway = icmp_data;
 
@@ -176,90 +228,41 @@ static struct sk_buff *mpls4_build_icmp(struct sk_buff *skb, int type, unsigned
 		BUG_ON(1);
 		break;
 	}
-	len += sizeof(struct icmphdr);
-
-	data = &buf[len];
-	if (mpls)
-		max = 128;
-	else
-		max = 576 - len;
-	//ako je ovo ovakvo ovde ,koja je poenta upsivanja svih onih podataka iznad?
-	real = (nskb->len > max) ? max : skb->len;
-	memcpy(data, nskb->data, real);
-
-	if (!mpls) {
-		len += real;
-	} else {
-		struct mpls_icmp_common *common;
-		struct mpls_icmp_object *object;
-		unsigned char *mpls_data = NULL;
-		unsigned int obj_start = 0;
-		unsigned int mpls_start = 0;
 
-		len += 128;
+	data = (u8 *)(icmph + 1);
+	if (skb_copy_bits(skb, pull, data, orig))
+		BUG();
+
+	if (mpls) {
+		/* length of the original datagram, in 32 bit words */
+		icmph->un.gateway |= htonl((MPLS_ICMP_ORIG_LEN / 4) << 16);
+		memset(data + orig, 0, MPLS_ICMP_ORIG_LEN - orig);
 
-		mpls_start = len;
-		common = (struct mpls_icmp_common*)&buf[len];
+		common = (struct mpls_icmp_common *)
+			(data + MPLS_ICMP_ORIG_LEN);
 		common->version = 2;
 		common->res1 = 0;
 		common->res2 = 0;
 		common->check = 0;
-		len += sizeof(struct mpls_icmp_common);
 
-		obj_start = len;
-		object = (struct mpls_icmp_object*)&buf[len];
-		object->length = 0;
+		object = (struct mpls_icmp_object *)(common + 1);
+		object->length = htons(sizeof(*object) + height);
 		object->class = 1;
 		object->type = 1;
-		len += sizeof(struct mpls_icmp_object);
+		memcpy(object + 1, skb->head + stack, height);
 
-		mpls_data = &buf[len];
-		memcpy(mpls_data, MPLSCB(skb)->top_of_stack, height);
-		len += height;
-
-		object->length = htons(len - obj_start);
-		common->check = csum_fold (csum_partial ((char*)common,
-				len - mpls_start, 0));
+		common->check = csum_fold(csum_partial(common,
+				sizeof(*common) + sizeof(*object) + height, 0));
 	}
 
-	iph->tot_len = htons(len);
-	ip_send_check(iph);
-	icmph->checksum = csum_fold (csum_partial ((char*)icmph,
-			len - icmp_start, 0));
-	//TODO check this
-	kfree_skb(nskb);
-	nskb = alloc_skb(len, GFP_ATOMIC);
-	memcpy(skb_put(nskb,len),buf, len);
-	/*
-	nskb->len = len;
-	memcpy(nskb->data, buf, nskb->len);
-	nskb->tail = nskb->data + nskb->len;
-	*/
+	icmph->checksum = csum_fold(csum_partial(icmph,
+			len - sizeof(struct iphdr), 0));
 	nskb->ip_summed = CHECKSUM_NONE;
-	nskb->csum = 0;
-
-	{
-		struct flowi4 fl4 = {
-			.daddr = iph->daddr,
-			.saddr = iph->saddr,
-			.flowi4_tos = RT_TOS(iph->tos),
-			.flowi4_proto = IPPROTO_ICMP,
-		};
-
-		rt = ip_route_output_key(&init_net, &fl4);
-		if (IS_ERR(rt))
-			goto error_1;
-	}
 
-	skb_dst_drop(nskb);
-
-	skb_dst_set(nskb, &rt->dst);
 	MPLS_EXIT;
 	return nskb;
 
-error_1:
-	kfree_skb(nskb);
-error_0:
+error:
 	MPLS_EXIT;
 	return NULL;
 }
@@ -288,9 +291,9 @@ static int mpls4_ttl_expired(struct sk_buff **skb)
 {
 	struct sk_buff *nskb;
 	MPLS_ENTER;
-	if ((nskb = mpls4_build_icmp(*skb, ICMP_TIME_EXCEEDED, 0, 1)))
-		if (dst_output(nskb))
-			kfree_skb(nskb);
+	nskb = mpls4_build_icmp(*skb, ICMP_TIME_EXCEEDED, 0, 1);
+	if (nskb)
+		ip_local_out(nskb);
 
 	/* make sure the MPLS stack frees the original skb! */
 	MPLS_EXIT;
@@ -301,22 +304,26 @@ static int mpls4_mtu_exceeded(struct sk_buff **skb, int mtu)
 {
 	struct sk_buff *nskb;
 	MPLS_ENTER;
-	if ((nskb = mpls4_build_icmp(*skb, ICMP_DEST_UNREACH, htonl(mtu), 0)))
-		if (dst_output(nskb))
-			kfree_skb(nskb);
+	nskb = mpls4_build_icmp(*skb, ICMP_DEST_UNREACH, htonl(mtu), 0);
+	if (nskb)
+		ip_local_out(nskb);
 
 	/* make sure the MPLS stack frees the original skb! */
 	MPLS_EXIT;
 	return MPLS_RESULT_DROP;
 }
 
+/*
+ * The packet already went through the receive path with its labels:
+ * hand it straight to IPv4, not to the taps and ptype lists again.
+ */
 static int mpls4_local_deliver(struct sk_buff *skb)
 {
 	MPLS_ENTER;
 	skb->protocol = htons(ETH_P_IP);
 	memset(skb->cb, 0, sizeof(skb->cb));
 	skb_dst_drop(skb);
-	netif_receive_skb(skb);
+	ip_rcv(skb, skb->dev, NULL, skb->dev);
 	MPLS_EXIT;
 	return 0;
 }
@@ -358,6 +365,8 @@ static struct mpls_prot_driver mpls4_driver = {
 	.family                 =       AF_INET,
 	.ethertype              =       htons(ETH_P_IP),
 	.cache_flush            =       mpls4_cache_flush,
+	/* rt_is_expired() checks dst.child */
+	.nhlfe_check            =       1,
 	.set_ttl                =       mpls4_set_ttl,
 	.get_ttl                =       mpls4_get_ttl,
 	.change_dsfield         =       mpls4_change_dsfield,
@@ -751,9 +751,25 @@ static inline int compare_netns(struct rtable *rt1, struct rtable *rt2)
 	return net_eq(dev_net(rt1->dst.dev), dev_net(rt2->dst.dev));
 }
 
+/*
+ * A route bound to a MPLS NHLFE by RTA_SHIM copied its MTU and header
+ * length: it goes stale with it, without the whole cache being flushed.
+ */
+static inline int rt_child_is_expired(struct rtable *rth)
+{
+#if IS_ENABLED(CONFIG_IP_MPLS)
+	struct dst_entry *child = rth->dst.child;
+
+	return child && !child->ops->check(child, rth->rt_child_cookie);
+#else
+	return 0;
+#endif
+}
+
 static inline int rt_is_expired(struct rtable *rth)
 {
-	return rth->rt_genid != rt_genid(dev_net(rth->dst.dev));
+	return rth->rt_genid != rt_genid(dev_net(rth->dst.dev)) ||
+	       rt_child_is_expired(rth);
 }
 
 /*
@@ -1997,7 +2013,7 @@ static void rt_set_nexthop(struct rtable *rt, const struct flowi4 *fl4,
 #if IS_ENABLED(CONFIG_IP_MPLS)
 		sblk = FIB_RES_SHIM(*res);
 		if (sblk && sblk->shim->build)
-			sblk->shim->build(sblk, dst);
+			sblk->shim->build(sblk, dst, &rt->rt_child_cookie);
 #endif
 #ifdef CONFIG_IP_ROUTE_CLASSID
 		dst->tclassid = FIB_RES_NH(*res).nh_tclassid;
@@ -160,6 +160,7 @@ drop:
 	kfree_skb(skb);
 	return NET_RX_DROP;
 }
+EXPORT_SYMBOL_GPL(ipv6_rcv);
 
 /*
  *	Deliver the packet to the host
@@ -26,8 +26,10 @@
 #include <net/neighbour.h>
 #include <net/ipv6.h>
 #include <net/ip6_route.h>
+#include <net/addrconf.h>
 #include <net/dst.h>
 #include <net/mpls.h>
+#include <linux/icmpv6.h>
 
 MODULE_LICENSE("GPL");
 
@@ -57,6 +59,183 @@ static inline int mpls6_get_dsfield(struct sk_buff *skb)
 	return ipv6_get_dsfield(ipv6_hdr(skb));
 }
 
+/**
+ *	mpls6_icmp_header - the IPv6 header an ICMPv6 error may be sent about.
+ *	@skb: offending packet, skb->data in the label stack.
+ *	@pull: offset of the payload, under the label stack.
+ *	@type: ICMPv6 type of the error.
+ *
+ *	Same rules as icmp6_send(): no errors about ICMPv6 errors, from
+ *	unspecified or multicast sources, or to multicast destinations but
+ *	Packet Too Big. Returns NULL if no error is to be sent.
+ **/
+
+static const struct ipv6hdr *mpls6_icmp_header(struct sk_buff *skb,
+		int pull, u8 type)
+{
+	const struct ipv6hdr *hdr;
+	u8 nexthdr;
+	__be16 frag_off;
+	int ptr;
+
+	if (!pskb_may_pull(skb, pull + sizeof(struct ipv6hdr)))
+		return NULL;
+	hdr = (const struct ipv6hdr *)(skb->data + pull);
+
+	if (hdr->version != 6)
+		return NULL;
+
+	if (ipv6_addr_any(&hdr->saddr) ||
+	    ipv6_addr_type(&hdr->saddr) & IPV6_ADDR_MULTICAST)
+		return NULL;
+
+	if (type != ICMPV6_PKT_TOOBIG &&
+	    ipv6_addr_type(&hdr->daddr) & IPV6_ADDR_MULTICAST)
+		return NULL;
+
+	nexthdr = hdr->nexthdr;
+	ptr = ipv6_skip_exthdr(skb, pull + sizeof(struct ipv6hdr),
+			&nexthdr, &frag_off);
+	if (ptr >= 0 && nexthdr == IPPROTO_ICMPV6) {
+		u8 _type, *tp;
+
+		tp = skb_header_pointer(skb,
+			ptr + offsetof(struct icmp6hdr, icmp6_type),
+			sizeof(_type), &_type);
+		if (!tp || !(*tp & ICMPV6_INFOMSG_MASK))
+			return NULL;
+	}
+	return hdr;
+}
+
+/**
+ *	mpls6_build_icmp - build the ICMPv6 error about a labelled IPv6 packet.
+ *	@skb: offending packet, skb->data in the label stack.
+ *	@type: ICMPV6_TIME_EXCEED or ICMPV6_PKT_TOOBIG.
+ *	@info: MTU of a Packet Too Big.
+ *	@mpls: append the received label stack (RFC 4950).
+ *
+ *	cf. mpls4_build_icmp: rate limited before anything is done, a
+ *	single skb of the size of the reply, at most IPV6_MIN_MTU.
+ **/
+
+static struct sk_buff *mpls6_build_icmp(struct sk_buff *skb, u8 type,
+		__u32 info, int mpls)
+{
+	struct mpls_icmp_common *common;
+	struct mpls_icmp_object *object;
+	const struct ipv6hdr *ohdr;
+	struct dst_entry *dst;
+	struct icmp6hdr *icmp6h;
+	struct ipv6hdr *hdr;
+	struct sk_buff *nskb;
+	struct flowi6 fl6;
+	struct net *net = dev_net(skb->dev);
+	unsigned int stack = 0;
+	unsigned int height = 0;
+	unsigned int orig;
+	unsigned int len;
+	u8 *data;
+	int pull;
+
+	pull = mpls_find_payload(skb);
+	if (pull < 0)
+		return NULL;
+
+	/* offsets, the head may move */
+	if (mpls) {
+		stack = MPLSCB(skb)->top_of_stack - skb->head;
+		height = skb->data + pull - MPLSCB(skb)->top_of_stack;
+	}
+
+	ohdr = mpls6_icmp_header(skb, pull, type);
+	if (!ohdr)
+		return NULL;
+
+	if (!mpls_icmp_xrlim_allow(skb, (__force u32)(ohdr->saddr.s6_addr32[0] ^
+			ohdr->saddr.s6_addr32[1] ^ ohdr->saddr.s6_addr32[2] ^
+			ohdr->saddr.s6_addr32[3])))
+		return NULL;
+
+	memset(&fl6, 0, sizeof(fl6));
+	fl6.daddr = ohdr->saddr;
+	fl6.flowi6_proto = IPPROTO_ICMPV6;
+	dst = ip6_route_output(net, NULL, &fl6);
+	if (dst->error ||
+	    ipv6_dev_get_saddr(net, dst->dev, &fl6.daddr, 0, &fl6.saddr)) {
+		dst_release(dst);
+		return NULL;
+	}
+
+	len = sizeof(struct icmp6hdr);
+	if (mpls) {
+		orig = min_t(unsigned int, skb->len - pull, MPLS_ICMP_ORIG_LEN);
+		len += MPLS_ICMP_ORIG_LEN + sizeof(struct mpls_icmp_common) +
+			sizeof(struct mpls_icmp_object) + height;
+	} else {
+		orig = min_t(unsigned int, skb->len - pull,
+			IPV6_MIN_MTU - sizeof(struct ipv6hdr) - len);
+		len += orig;
+	}
+
+	nskb = alloc_skb(LL_RESERVED_SPACE(dst->dev) +
+			sizeof(struct ipv6hdr) + len, GFP_ATOMIC);
+	if (!nskb) {
+		dst_release(dst);
+		return NULL;
+	}
+	skb_reserve(nskb, LL_RESERVED_SPACE(dst->dev));
+	skb_reset_network_header(nskb);
+	skb_put(nskb, sizeof(struct ipv6hdr) + len);
+	skb_dst_set(nskb, dst);
+	nskb->protocol = htons(ETH_P_IPV6);
+
+	hdr = ipv6_hdr(nskb);
+	*(__be32 *)hdr = htonl(0x60000000);
+	hdr->payload_len = htons(len);
+	hdr->nexthdr = IPPROTO_ICMPV6;
+	hdr->hop_limit = sysctl_mpls_default_ttl;
+	hdr->saddr = fl6.saddr;
+	hdr->daddr = fl6.daddr;
+
+	icmp6h = (struct icmp6hdr *)(hdr + 1);
+	icmp6h->icmp6_type = type;
+	icmp6h->icmp6_code = 0;
+	icmp6h->icmp6_cksum = 0;
+	icmp6h->icmp6_dataun.un_data32[0] = htonl(info);
+
+	data = (u8 *)(icmp6h + 1);
+	if (skb_copy_bits(skb, pull, data, orig))
+		BUG();
+
+	if (mpls) {
+		/* length of the original datagram, in 64 bit words */
+		icmp6h->icmp6_dataun.un_data8[0] = MPLS_ICMP_ORIG_LEN / 8;
+		memset(data + orig, 0, MPLS_ICMP_ORIG_LEN - orig);
+
+		common = (struct mpls_icmp_common *)
+			(data + MPLS_ICMP_ORIG_LEN);
+		common->version = 2;
+		common->res1 = 0;
+		common->res2 = 0;
+		common->check = 0;
+
+		object = (struct mpls_icmp_object *)(common + 1);
+		object->length = htons(sizeof(*object) + height);
+		object->class = 1;
+		object->type = 1;
+		memcpy(object + 1, skb->head + stack, height);
+
+		common->check = csum_fold(csum_partial(common,
+				sizeof(*common) + sizeof(*object) + height, 0));
+	}
+
+	icmp6h->icmp6_cksum = csum_ipv6_magic(&hdr->saddr, &hdr->daddr, len,
+			IPPROTO_ICMPV6, csum_partial(icmp6h, len, 0));
+	nskb->ip_summed = CHECKSUM_NONE;
+	return nskb;
+}
+
 /* Policy decision, several options:
  *
  * 1) Silently discard
@@ -77,24 +256,37 @@ static inline int mpls6_get_dsfield(struct sk_buff *skb)
  * never responds to ICMP with ICMP.  It is deliberate
  * assumption made about upper-layer protocol.
  */
- //should send ICMP here
 static int mpls6_ttl_expired(struct sk_buff **skb)
 {
+	struct sk_buff *nskb;
+
+	nskb = mpls6_build_icmp(*skb, ICMPV6_TIME_EXCEED, 0, 1);
+	if (nskb)
+		ip6_local_out(nskb);
+
+	/* make sure the MPLS stack frees the original skb! */
 	return NET_RX_DROP;
 }
 
- //should send ICMP here
 static int mpls6_mtu_exceeded(struct sk_buff **skb, int mtu)
 {
+	struct sk_buff *nskb;
+
+	nskb = mpls6_build_icmp(*skb, ICMPV6_PKT_TOOBIG, mtu, 0);
+	if (nskb)
+		ip6_local_out(nskb);
+
+	/* make sure the MPLS stack frees the original skb! */
 	return MPLS_RESULT_DROP;
 }
 
+/* cf. mpls4_local_deliver */
 static int mpls6_local_deliver(struct sk_buff *skb)
 {
 	skb->protocol = htons(ETH_P_IPV6);
 	memset(skb->cb, 0, sizeof(skb->cb));
 	skb_dst_drop(skb);
-	netif_receive_skb(skb);
+	ipv6_rcv(skb, skb->dev, NULL, skb->dev);
 	return 0;
 }
 
@@ -111,7 +303,7 @@ static inline int mpls6_nexthop_resolve(struct dst_entry *dst, struct sockaddr *
 	if (addr->sin6_family != AF_INET6)
 		return -EINVAL;
 
-	ndst = ip6_route_output(&init_net, NULL, &fl6);
+	ndst = ip6_route_output(dev_net(dev), NULL, &fl6);
 
 	err = 0;
 	if (ndst->error)
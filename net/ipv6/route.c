@@ -1439,7 +1439,7 @@ install_route:
 				err = -EINVAL;
 				goto out;
 			}
-		rt->rt6i_shim->shim->build(rt->rt6i_shim, &rt->dst);
+		rt->rt6i_shim->shim->build(rt->rt6i_shim, &rt->dst, NULL);
 	}
 #endif
 	
@@ -108,6 +108,7 @@ static int __mpls_set_labelspace(struct net_device *dev,
 
 /**
  *	mpls_set_labelspace - Set a label space for the interface.
+ *	@net: namespace of the interface
  *	@req: mpls_labelspace_req struct with the update data. In particular,
  *	     contains the interface index in req->mls_ifindex, and the new
  *	     labelspace in req->mls_labelspace.
@@ -119,11 +120,11 @@ static int __mpls_set_labelspace(struct net_device *dev,
  *	Returns 0 on success.
  **/
 
-int mpls_set_labelspace(struct mpls_labelspace_req *req, int seq, int pid)
+int mpls_set_labelspace(struct net *net, struct mpls_labelspace_req *req,
+		int seq, int pid)
 {
 	int result = -1;
-	struct net_device *dev =
-		dev_get_by_index(&init_net, req->mls_ifindex);
+	struct net_device *dev = dev_get_by_index(net, req->mls_ifindex);
 
 	MPLS_ENTER;
 	if (dev) {
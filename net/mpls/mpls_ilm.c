@@ -26,18 +26,177 @@
 #include <net/route.h>
 #include <net/mpls.h>
 #include <linux/genetlink.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
 #include <net/net_namespace.h>
 
 /*
- * MPLS info radix tree and corresponding lock
+ * The ILM radix tree, label tables, list and lock of a namespace live in
+ * net->mpls (cf. mpls_ilm_init_net)
  */
-RADIX_TREE(mpls_ilm_tree, GFP_ATOMIC);
+static struct kmem_cache *ilm_cachep;
 
-DEFINE_SPINLOCK(mpls_ilm_lock);
+#ifdef CONFIG_MPLS_ILM_TABLE
+/*
+ * Generic labels of labelspaces 0..MPLS_LABELSPACE_MAX are not kept in the
+ * radix tree but in a flat array per labelspace, indexed by the label value.
+ * The array covers the highest label in use, it only grows: a bigger one is
+ * built and published under the ILM lock of the namespace, and the old one is
+ * freed after a grace period. Readers only need rcu_read_lock_bh() (softirq
+ * context).
+ */
+#define MPLS_ILM_TABLE_MIN	1024
+/* one slot per 20 bit label value */
+#define MPLS_ILM_TABLE_MAX	(1 << 20)
 
-LIST_HEAD(mpls_ilm_list);
+struct mpls_ilm_table {
+	unsigned int            size;
+	struct mpls_ilm __rcu  *ilm[0];
+};
 
-static struct kmem_cache *ilm_cachep;
+static struct mpls_ilm_table *mpls_ilm_table_alloc(unsigned int size)
+{
+	struct mpls_ilm_table *t;
+	size_t len = sizeof(*t) + size * sizeof(struct mpls_ilm *);
+
+	if (len <= PAGE_SIZE)
+		t = kzalloc(len, GFP_KERNEL);
+	else
+		t = vzalloc(len);
+
+	if (likely(t))
+		t->size = size;
+	return t;
+}
+
+static void mpls_ilm_table_free(struct mpls_ilm_table *t)
+{
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
+
+/**
+ *	mpls_ilm_table_grow - Make sure the table of a labelspace can hold a
+ *	label.
+ *	@net:   namespace
+ *	@index: labelspace
+ *	@gen:   generic label value
+ *
+ *	Returns 0 on success, -EINVAL if @gen is not a label value or
+ *	-ENOMEM. Process context only, may sleep.
+ **/
+
+static int mpls_ilm_table_grow(struct net *net, unsigned int index,
+		unsigned int gen)
+{
+	struct mpls_ilm_table *old, *new;
+	unsigned int size, i;
+
+	rcu_read_lock_bh();
+	old = rcu_dereference_bh(net->mpls.ilm_table[index]);
+	size = old ? old->size : 0;
+	rcu_read_unlock_bh();
+	if (gen < size)
+		return 0;
+	if (unlikely(gen >= MPLS_ILM_TABLE_MAX))
+		return -EINVAL;
+
+	size = clamp_t(unsigned int, roundup_pow_of_two(gen + 1),
+			MPLS_ILM_TABLE_MIN, MPLS_ILM_TABLE_MAX);
+	new = mpls_ilm_table_alloc(size);
+	if (unlikely(!new))
+		return -ENOMEM;
+
+	spin_lock_bh(&net->mpls.ilm_lock);
+	old = rcu_dereference_protected(net->mpls.ilm_table[index],
+			lockdep_is_held(&net->mpls.ilm_lock));
+	if (old && old->size >= size) {
+		/* somebody else grew it in the meantime */
+		spin_unlock_bh(&net->mpls.ilm_lock);
+		mpls_ilm_table_free(new);
+		return 0;
+	}
+	for (i = 0; old && i < old->size; i++)
+		RCU_INIT_POINTER(new->ilm[i],
+			rcu_dereference_protected(old->ilm[i], 1));
+	rcu_assign_pointer(net->mpls.ilm_table[index], new);
+	spin_unlock_bh(&net->mpls.ilm_lock);
+
+	if (old) {
+		synchronize_rcu_bh();
+		mpls_ilm_table_free(old);
+	}
+	return 0;
+}
+
+static inline struct mpls_ilm *mpls_ilm_table_lookup(struct net *net,
+		unsigned int index, unsigned int gen)
+{
+	struct mpls_ilm_table *t =
+		rcu_dereference_bh(net->mpls.ilm_table[index]);
+
+	if (unlikely(!t || gen >= t->size))
+		return NULL;
+	return rcu_dereference_bh(t->ilm[gen]);
+}
+
+/*
+ * Returns 1 and fills index/gen if the key is served by the label table.
+ */
+static inline int mpls_ilm_key_in_table(unsigned int key,
+		unsigned int *index, unsigned int *gen)
+{
+	return mpls_key2gen(key, index, gen) && *index <= MPLS_LABELSPACE_MAX;
+}
+#endif
+
+/*
+ * Lookup the ILM for a key, caller holds rcu_read_lock_bh
+ */
+static inline struct mpls_ilm *__mpls_lookup_ilm(struct net *net,
+		unsigned int key)
+{
+#ifdef CONFIG_MPLS_ILM_TABLE
+	unsigned int index, gen;
+
+	if (mpls_ilm_key_in_table(key, &index, &gen))
+		return mpls_ilm_table_lookup(net, index, gen);
+#endif
+	return radix_tree_lookup(&net->mpls.ilm_tree, key);
+}
+
+/**
+ *	mpls_ilm_free_rcu - give the ILM memory back once no packet can see it.
+ *	@head: rcu head of the ILM
+ **/
+
+void mpls_ilm_free_rcu(struct rcu_head *head)
+{
+	struct mpls_ilm *ilm = container_of(head, struct mpls_ilm, rcu);
+
+	free_percpu(ilm->ilm_stats);
+	kmem_cache_free(ilm->kmem_cachep, ilm);
+}
+EXPORT_SYMBOL(mpls_ilm_free_rcu);
+
+/**
+ *	mpls_ilm_destroy_rcu - tear down a withdrawn ILM.
+ *	@head: rcu head of the ILM
+ *
+ *	Runs once no packet can be switched by the ILM anymore. It was
+ *	unlinked from its NHLFE when withdrawn, the instructions only drop
+ *	their references here, then the reference of the tables goes.
+ **/
+
+static void mpls_ilm_destroy_rcu(struct rcu_head *head)
+{
+	struct mpls_ilm *ilm = container_of(head, struct mpls_ilm, rcu);
+
+	mpls_destroy_ilm_instrs(ilm);
+	mpls_ilm_release(ilm);
+}
 
 /**
  *	mpls_destroy_ilm_instrs - Destroy ILM opcodes.
@@ -61,18 +220,21 @@ void mpls_destroy_ilm_instrs(struct mpls_ilm *ilm)
 
 /**
  *	mpls_ilm_set_instrs - Set Instruction list for this ILM.
- *	@ilm:   The ILM object ('this')
+ *	@net:   namespace of the ILM
+ *	@mil:   label of the ILM
  *	@mie:   Array of instruction elements set by user
  *	@lenth: Array lenght. Number of valid entries
  *
- *	Return 0 on success.
+ *	Return 0 on success. The new program is built off to the side and
+ *	published with a single pointer swap, packets never see a partial
+ *	one. The old program is kept if the new one can't be built.
  *
  *	Called in process context only and may sleep
  **/
-int mpls_ilm_set_instrs(struct mpls_in_label_req *mil,
+int mpls_ilm_set_instrs(struct net *net, struct mpls_in_label_req *mil,
 		struct mpls_instr_elem *mie, int length)
 {
-	struct mpls_ilm *ilm = mpls_get_ilm_label(mil);
+	struct mpls_ilm *ilm = mpls_get_ilm_label(net, mil);
 	int retval;
 	MPLS_ENTER;
 	MPLS_EXIT;
@@ -84,47 +246,45 @@ int mpls_ilm_set_instrs(struct mpls_in_label_req *mil,
 int _mpls_ilm_set_instrs(struct mpls_ilm *ilm,
 		struct mpls_instr_elem *mie, int length)
 {
-	/* To store (tmp) the linked list of instr. */
 	struct mpls_instr *instr_list = NULL;
-	struct mpls_instr_req *instr = NULL;
-	int no_instr = 0;
-	int retval = 0;
+	struct mpls_instr *old;
+	struct mpls_ilm *shadow;
 	MPLS_ENTER;
 	BUG_ON(!ilm);
 
-
-	/* Commit the new ones */
-	if (ilm->ilm_instr) {
-		no_instr = mpls_no_instrs(ilm->ilm_instr);
-		instr = kmalloc(sizeof(*instr) +
-			no_instr*sizeof(struct mpls_instr_elem), GFP_ATOMIC);
-
-		if (unlikely(!instr)) {
-			MPLS_EXIT;
-			return -1;
-		}
-
-		mpls_instrs_unbuild(ilm->ilm_instr, instr);
-
-		mpls_instrs_free(ilm->ilm_instr);
+	/*
+	 * Build the new program off to the side, packets keep running the
+	 * old one until it is complete
+	 */
+	shadow = mpls_ilm_alloc(mpls_ilm_net(ilm), ilm->ilm_key,
+			&ilm->ilm_label, 0);
+	if (unlikely(!shadow)) {
+		MPLS_EXIT;
+		return -ENOMEM;
 	}
 
-	/* Build temporary opcode set from mie */
-	if (!mpls_instrs_build(mie, &instr_list, length, MPLS_IN, ilm)) {
-		/*replace with old instructions */
-		if (instr)
-			mpls_instrs_build(instr->mir_instr, &instr_list,
-					instr->mir_instr_length, MPLS_IN, ilm);
-
+	if (!__mpls_instrs_build(mie, &instr_list, length, MPLS_IN, shadow)) {
+		mpls_ilm_release(shadow);
 		MPLS_DEBUG("Return -1\n");
-		retval = -1;
+		MPLS_EXIT;
+		return -1;
 	}
 
+	/* Take over the NHLFE linkage of the shadow and publish */
+	mpls_instrs_graft(instr_list, shadow, ilm);
+	list_del_init(&ilm->nhlfe_entry);
+	if (!list_empty(&shadow->nhlfe_entry))
+		list_replace_init(&shadow->nhlfe_entry, &ilm->nhlfe_entry);
+	mpls_ilm_release(shadow);
+
+	old = ilm->ilm_instr;
+	rcu_assign_pointer(ilm->ilm_instr, instr_list);
+
+	/* Packets being switched don't hold a reference */
+	mpls_instrs_retire(old, NULL, NULL, NULL);
 
-	ilm->ilm_instr = instr_list;
-	kfree(instr);
 	MPLS_EXIT;
-	return retval;
+	return 0;
 }
 
 /**
@@ -132,13 +292,14 @@ int _mpls_ilm_set_instrs(struct mpls_ilm *ilm,
  *
  **/
 
-struct mpls_ilm *mpls_ilm_alloc(unsigned int key, struct mpls_label *ml,
+struct mpls_ilm *mpls_ilm_alloc(struct net *net, unsigned int key,
+		struct mpls_label *ml,
 		/*struct mpls_instr_elem *instr,*/ int instr_len)
 {
 	struct mpls_ilm *ilm;
 
 	MPLS_ENTER;
-	ilm = kmem_cache_alloc(ilm_cachep, GFP_ATOMIC);
+	ilm = kmem_cache_alloc(ilm_cachep, GFP_KERNEL);
 
 	if (unlikely(!ilm)) {
 		MPLS_EXIT;
@@ -147,11 +308,19 @@ struct mpls_ilm *mpls_ilm_alloc(unsigned int key, struct mpls_label *ml,
 
 	ilm->kmem_cachep = ilm_cachep;
 
+	ilm->ilm_stats = alloc_percpu(struct mpls_lsp_stats);
+	if (unlikely(!ilm->ilm_stats)) {
+		kmem_cache_free(ilm_cachep, ilm);
+		MPLS_EXIT;
+		return NULL;
+	}
+
 	atomic_set(&ilm->refcnt, 1);
 	memcpy(&ilm->ilm_label, ml, sizeof(struct mpls_label));
 	INIT_LIST_HEAD(&ilm->dev_entry);
 	INIT_LIST_HEAD(&ilm->nhlfe_entry);
 	INIT_LIST_HEAD(&ilm->global);
+	write_pnet(&ilm->ilm_net, net);
 
 	ilm->ilm_instr = NULL;
 	ilm->ilm_key = key;
@@ -204,32 +373,157 @@ static struct mpls_reserved_labels {
 	{ NULL,                "RESERVED",           0 }
 };
 
+/*
+ * Insert an ILM, caller holds the ILM lock and has grown the label table
+ */
+static int __mpls_insert_ilm(struct net *net, unsigned int key,
+		struct mpls_ilm *ilm)
+{
+	int retval;
+#ifdef CONFIG_MPLS_ILM_TABLE
+	struct mpls_ilm_table *t;
+	unsigned int index, gen;
+
+	if (mpls_ilm_key_in_table(key, &index, &gen)) {
+		t = rcu_dereference_protected(net->mpls.ilm_table[index],
+				lockdep_is_held(&net->mpls.ilm_lock));
+		if (unlikely(rcu_dereference_protected(t->ilm[gen], 1))) {
+			MPLS_DEBUG("ILM key %u already in label table\n", key);
+			return -EEXIST;
+		}
+		rcu_assign_pointer(t->ilm[gen], ilm);
+		goto out_list;
+	}
+#endif
+	retval = radix_tree_insert(&net->mpls.ilm_tree, key, ilm);
+	if (unlikely(retval)) {
+		MPLS_DEBUG("Error create node with key "
+				"%u in radix tree\n", key);
+		return retval;
+	}
+
+#ifdef CONFIG_MPLS_ILM_TABLE
+out_list:
+#endif
+	list_add_rcu(&ilm->global, &net->mpls.ilm_list);
+	return 0;
+}
+
+/*
+ * Remove an ILM, caller holds the ILM lock
+ */
+static struct mpls_ilm *__mpls_remove_ilm(struct net *net, unsigned int key)
+{
+	struct mpls_ilm *ilm = NULL;
+#ifdef CONFIG_MPLS_ILM_TABLE
+	struct mpls_ilm_table *t;
+	unsigned int index, gen;
+
+	if (mpls_ilm_key_in_table(key, &index, &gen)) {
+		t = rcu_dereference_protected(net->mpls.ilm_table[index],
+				lockdep_is_held(&net->mpls.ilm_lock));
+		if (t && gen < t->size) {
+			ilm = rcu_dereference_protected(t->ilm[gen], 1);
+			RCU_INIT_POINTER(t->ilm[gen], NULL);
+		}
+	} else
+#endif
+		ilm = radix_tree_delete(&net->mpls.ilm_tree, key);
+	if (!ilm) {
+		MPLS_DEBUG("ILM key %u not found.\n", key);
+		return NULL;
+	}
+
+	list_del_rcu(&ilm->global);
+	return ilm;
+}
+
+/*
+ * Make sure the label table can take the key, may sleep
+ */
+static inline int mpls_ilm_prepare_key(struct net *net, unsigned int key)
+{
+#ifdef CONFIG_MPLS_ILM_TABLE
+	unsigned int index, gen;
+
+	if (mpls_ilm_key_in_table(key, &index, &gen))
+		return mpls_ilm_table_grow(net, index, gen);
+#endif
+	return 0;
+}
+
 /**
  *	mpls_insert_ilm - Inserts the given ILM object in the MPLS Input
- *	Information Radix Tree using the given key.
+ *	Information Radix Tree (or label table) of its namespace using the
+ *	given key.
  *	@key: key to use
  *	@ilm: ilm object.
  *
  *	Returns 0 on success, or:
  *		-ENOMEM : unable to allocate node in the radix tree.
+ *		-EEXIST : label table slot already used.
+ *		-EINVAL : label value out of the label table.
+ *	Process context only, may sleep when the label table has to grow.
  **/
 
 int mpls_insert_ilm(unsigned int key, struct mpls_ilm *ilm)
+{
+	struct net *net = mpls_ilm_net(ilm);
+	int retval;
+	MPLS_ENTER;
+	if (unlikely(mpls_ilm_prepare_key(net, key))) {
+		MPLS_EXIT;
+		return -ENOMEM;
+	}
+
+	spin_lock_bh(&net->mpls.ilm_lock);
+	retval = __mpls_insert_ilm(net, key, ilm);
+	spin_unlock_bh(&net->mpls.ilm_lock);
+	MPLS_EXIT;
+	return retval;
+}
+
+/**
+ *	mpls_insert_ilms - Publish a batch of ILM objects.
+ *	@net:   namespace all the ILMs were built for
+ *	@ilm:   ILM objects, instructions already built
+ *	@count: number of objects
+ *
+ *	The label tables are grown first, then all the ILMs are inserted
+ *	with a single acquisition of the ILM lock. On error the ones
+ *	already inserted are taken out again and the caller still owns
+ *	every ILM of the batch. Process context only, may sleep.
+ **/
+
+int mpls_insert_ilms(struct net *net, struct mpls_ilm **ilm, int count)
 {
 	int retval = 0;
+	int i, inserted;
+
 	MPLS_ENTER;
-	spin_lock_bh(&mpls_ilm_lock);
-	retval = radix_tree_insert(&mpls_ilm_tree, key, ilm);
+	for (i = 0; i < count; i++) {
+		if (unlikely(mpls_ilm_prepare_key(net, ilm[i]->ilm_key))) {
+			MPLS_EXIT;
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_bh(&net->mpls.ilm_lock);
+	for (i = 0; i < count; i++) {
+		retval = __mpls_insert_ilm(net, ilm[i]->ilm_key, ilm[i]);
+		if (unlikely(retval))
+			break;
+	}
+	inserted = i;
 	if (unlikely(retval)) {
-		MPLS_DEBUG("Error create node with key "
-				"%u in radix tree\n", key);
-		retval = -ENOMEM;
-		goto out;
+		while (--i >= 0)
+			__mpls_remove_ilm(net, ilm[i]->ilm_key);
 	}
+	spin_unlock_bh(&net->mpls.ilm_lock);
 
-	list_add_rcu(&ilm->global, &mpls_ilm_list);
-out:
-	spin_unlock_bh(&mpls_ilm_lock);
+	/* the withdrawn ones may have been seen by packets */
+	if (unlikely(retval) && inserted)
+		synchronize_rcu_bh();
 	MPLS_EXIT;
 	return retval;
 }
@@ -237,6 +531,7 @@ out:
 /**
  *	mpls_remove_ilm - Remove the node given the key from the MPLS Input
  *	Information Radix Tree.
+ *	@net : namespace
  *	@key : key to use
  *
  *	This function deletes the ILM object from the Radix Tree, but please
@@ -244,28 +539,50 @@ out:
  *	responsible for	decreasing the refcount if necessary.
  **/
 
-void mpls_remove_ilm(unsigned int key)
+void mpls_remove_ilm(struct net *net, unsigned int key)
 {
-	struct mpls_ilm *ilm = NULL;
 	MPLS_ENTER;
+	spin_lock_bh(&net->mpls.ilm_lock);
+	__mpls_remove_ilm(net, key);
+	spin_unlock_bh(&net->mpls.ilm_lock);
+	MPLS_EXIT;
+}
 
-	spin_lock_bh(&mpls_ilm_lock);
+/**
+ *	mpls_del_ilms - Withdraw and free a batch of ILM objects.
+ *	@net:   namespace of the ILMs
+ *	@ilm:   ILM objects published by mpls_insert_ilms()
+ *	@count: number of objects
+ *
+ *	Undoes a batch without notifying userland, the ILMs were never
+ *	announced. One grace period covers the whole batch.
+ **/
 
-	ilm = radix_tree_delete(&mpls_ilm_tree, key);
-	if (!ilm) {
-		MPLS_DEBUG("ILM key %u not found.\n", key);
-		goto out;
-	}
+void mpls_del_ilms(struct net *net, struct mpls_ilm **ilm, int count)
+{
+	int i;
 
-	list_del_rcu(&ilm->global);
+	if (!count)
+		return;
 
-out:
-	spin_unlock_bh(&mpls_ilm_lock);
+	MPLS_ENTER;
+	spin_lock_bh(&net->mpls.ilm_lock);
+	for (i = 0; i < count; i++)
+		__mpls_remove_ilm(net, ilm[i]->ilm_key);
+	spin_unlock_bh(&net->mpls.ilm_lock);
+
+	synchronize_rcu_bh();
+
+	for (i = 0; i < count; i++) {
+		mpls_destroy_ilm_instrs(ilm[i]);
+		mpls_ilm_release(ilm[i]);
+	}
 	MPLS_EXIT;
 }
 
 /**
  *	mpls_get_ilm - Get a reference to a ILM object.
+ *	@net : namespace whose tables are searched.
  *	@key : key to look for in the ILM Radix Tree.
  *
  *	This function can be used to get a reference to a ILM object given a
@@ -277,39 +594,99 @@ out:
  *	"mpls_ilm_release").
  **/
 
-inline struct mpls_ilm *mpls_get_ilm(unsigned int key)
+inline struct mpls_ilm *mpls_get_ilm(struct net *net, unsigned int key)
 {
 	struct mpls_ilm *ilm = NULL;
 	MPLS_ENTER;
-	rcu_read_lock();
-	ilm = radix_tree_lookup(&mpls_ilm_tree, key);
+	rcu_read_lock_bh();
+	ilm = __mpls_lookup_ilm(net, key);
 	smp_read_barrier_depends();
 	if (likely(ilm))
 		mpls_ilm_hold(ilm);
 
-	rcu_read_unlock();
+	rcu_read_unlock_bh();
 	MPLS_EXIT;
 	return ilm;
 }
 
 /**
- *	mpls_get_ilm_by_label - Get a reference to a ILM given an incoming
- *	   label/labelspace.
+ *	mpls_ilm_dump_next - Find the next ILM of a dump.
+ *	@net:        namespace being dumped
+ *	@pos:        where to resume, moved past the returned ILM [IN/OUT]
+ *	@labelspace: only visit this labelspace, -1 for all
+ *
+ *	The label tables are walked in labelspace/label order, then the
+ *	radix tree in key order, so a dump resumes where it stopped instead
+ *	of skipping the entries already sent. Returns NULL at the end.
+ *	Caller holds rcu_read_lock_bh.
+ **/
+
+struct mpls_ilm *mpls_ilm_dump_next(struct net *net, struct mpls_dump_pos *pos,
+		int labelspace)
+{
+	struct mpls_ilm *ilm = NULL;
+#ifdef CONFIG_MPLS_ILM_TABLE
+	struct mpls_ilm_table *t;
+
+	/* labelspaces above MPLS_LABELSPACE_MAX only live in the tree */
+	if (labelspace >= 0 && pos->table < MPLS_DUMP_TREE &&
+	    pos->table < (unsigned int)labelspace) {
+		pos->table = min_t(unsigned int, labelspace, MPLS_DUMP_TREE);
+		pos->key = 0;
+	}
+	for (; pos->table <= MPLS_LABELSPACE_MAX; pos->table++, pos->key = 0) {
+		if (labelspace >= 0 && pos->table != (unsigned int)labelspace) {
+			pos->table = MPLS_DUMP_TREE;
+			pos->key = 0;
+			break;
+		}
+		t = rcu_dereference_bh(net->mpls.ilm_table[pos->table]);
+		for (; t && pos->key < t->size; pos->key++) {
+			ilm = rcu_dereference_bh(t->ilm[pos->key]);
+			if (ilm) {
+				pos->key++;
+				return ilm;
+			}
+		}
+	}
+#else
+	if (pos->table < MPLS_DUMP_TREE) {
+		pos->table = MPLS_DUMP_TREE;
+		pos->key = 0;
+	}
+#endif
+	while (pos->table == MPLS_DUMP_TREE) {
+		if (!radix_tree_gang_lookup(&net->mpls.ilm_tree, (void **)&ilm,
+				pos->key, 1)) {
+			pos->table = MPLS_DUMP_END;
+			break;
+		}
+		pos->key = ilm->ilm_key + 1;
+		if (!pos->key)
+			pos->table = MPLS_DUMP_END;
+		if (labelspace < 0 || ilm->ilm_labelspace == labelspace)
+			return ilm;
+	}
+	return NULL;
+}
+
+/**
+ *	mpls_get_ilm_by_label - Get the ILM given an incoming label/labelspace.
+ *	@net:        Namespace of the incoming interface.
  *	@label:      Incoming label from network core.
  *	@labelspace: Labelspace of the incoming interface.
  *	@bos:        Status of BOS for the current label being processed
  *
- *	Allows the caller to get a reference to the ILM object given the
- *	label value, and incoming interface/labelspace.
+ *	Allows the caller to get the ILM object given the label value, and
+ *	incoming interface/labelspace.
  *	Returns a pointer to the ILM object, NULL on error.
- *	Remark1: This function increases the refcount of the ILM object, since
- *		it calls "mpls_ilm_hold". Caller must release the object
- *		when it is no longer needed.
- *	Remark2: uses the function above.
+ *	Remark: This is the forwarding fast path, no reference is taken. The
+ *		caller must run with BH disabled (rcu_read_lock_bh) and must
+ *		not use the ILM once it leaves that section.
  **/
 
-inline struct mpls_ilm *mpls_get_ilm_by_label(struct mpls_label *label,
-		int labelspace, char bos)
+inline struct mpls_ilm *mpls_get_ilm_by_label(struct net *net,
+		struct mpls_label *label, int labelspace, char bos)
 {
 	struct mpls_ilm *ilm = NULL;
 	MPLS_ENTER;
@@ -323,16 +700,22 @@ inline struct mpls_ilm *mpls_get_ilm_by_label(struct mpls_label *label,
 			MPLS_EXIT;
 			return NULL;
 		}
-		mpls_ilm_hold(ilm);
 		if (want_bos != bos) {
-			mpls_ilm_release(ilm);
 			MPLS_DEBUG("invalid incoming labelstack, dropping\n");
 			MPLS_EXIT;
 			return NULL;
 		}
 	} else {
 		/* not reserved label */
-		ilm = mpls_get_ilm(mpls_label2key(labelspace, label));
+#ifdef CONFIG_MPLS_ILM_TABLE
+		if (label->ml_type == MPLS_LABEL_GEN &&
+		    (unsigned int)labelspace <= MPLS_LABELSPACE_MAX)
+			ilm = mpls_ilm_table_lookup(net, labelspace,
+					label->u.ml_gen);
+		else
+#endif
+			ilm = __mpls_lookup_ilm(net,
+					mpls_label2key(labelspace, label));
 		if (unlikely(!ilm)) {
 			MPLS_DEBUG("unknown incoming label, dropping\n");
 			MPLS_EXIT;
@@ -346,11 +729,12 @@ inline struct mpls_ilm *mpls_get_ilm_by_label(struct mpls_label *label,
 /*
  * mpls_get_ilm - returns existing ilm, if there is no ilm returns NULL
  */
-struct mpls_ilm *mpls_get_ilm_label(const struct mpls_in_label_req *mil)
+struct mpls_ilm *mpls_get_ilm_label(struct net *net,
+		const struct mpls_in_label_req *mil)
 {
 	unsigned int key = mpls_label2key(mil->mil_label.ml_labelspace,
 		&mil->mil_label);
-	struct mpls_ilm *ilm = mpls_get_ilm(key);
+	struct mpls_ilm *ilm = mpls_get_ilm(net, key);
 	MPLS_ENTER;
 	MPLS_EXIT;
 	return ilm;
@@ -378,35 +762,21 @@ static inline int mpls_is_reserved_label(const struct mpls_label *label)
 
 
 
-/**
- *	mpls_add_in_label - Add a label to the incoming tree.
- *	@in : mpls_in_label_req
- *
- *	Process context entry point to add an entry (ILM) in the incoming label
- *	map database. It adds new corresponding node to the Incoming Radix Tree.
- *	It sets the ILM object reference count to 1, the ilm age to jiffies,
- *	the default instruction set (POP,PEEK) and initializes
- *	both the dev_entry and nhlfe_entry lists. The node's key is set to the
- *	mapped	key from the label/labelspace in the request.
- *
- *	Returns added ilm entry on success, or err pointer.
- **/
-
-struct mpls_ilm *mpls_add_in_label(const struct mpls_in_label_req *in)
+/*
+ * Allocate a new ILM for a request, it is not inserted yet.
+ */
+static struct mpls_ilm *__mpls_alloc_in_label(struct net *net,
+		const struct mpls_in_label_req *in)
 {
 	struct mpls_ilm *ilm     = NULL; /* New ILM to insert */
 	struct mpls_label *ml    = NULL; /* Requested Label */
 	unsigned int key         = 0;    /* Key to use */
-	/*struct mpls_instr_elem instr[2];*/
-
-	MPLS_ENTER;
 
 	BUG_ON(!in);
 	ml = (struct mpls_label *)&in->mil_label;
 
 	if (mpls_is_reserved_label(ml)) {
 		MPLS_DEBUG("Unable to add reserved label to ILM\n");
-		MPLS_EXIT;
 		return ERR_PTR(-EINVAL);
 	}
 
@@ -414,33 +784,53 @@ struct mpls_ilm *mpls_add_in_label(const struct mpls_in_label_req *in)
 	key = mpls_label2key(ml->ml_labelspace, ml);
 
 	/* Check if the node already exists */
-	ilm = mpls_get_ilm(key);
+	ilm = mpls_get_ilm(net, key);
 	if (unlikely(ilm)) {
 		printk(KERN_INFO "MPLS: node %u already exists\n", key);
 		mpls_ilm_release(ilm);
-		MPLS_EXIT;
 		return ERR_PTR(-EEXIST);
 	}
 
 	/*
 	 * Allocate a new input Information/Label,
 	 */
+	ilm = mpls_ilm_alloc(net, key, ml, 2);
+	if (unlikely(!ilm))
+		return ERR_PTR(-ENOMEM);
 
-	/*instr[0].mir_direction = MPLS_IN;
-	instr[0].mir_opcode    = MPLS_OP_POP;
-	instr[1].mir_direction = MPLS_IN;
-	instr[1].mir_opcode    = MPLS_OP_PEEK;*/
+	ilm->ilm_owner = in->mil_owner;
+	return ilm;
+}
 
-	ilm = mpls_ilm_alloc(key, ml, /*instr,*/ 2);
-	if (unlikely(!ilm)) {
+/**
+ *	mpls_add_in_label - Add a label to the incoming tree.
+ *	@net: namespace
+ *	@in : mpls_in_label_req
+ *
+ *	Process context entry point to add an entry (ILM) in the incoming label
+ *	map database. It adds new corresponding node to the Incoming Radix Tree.
+ *	It sets the ILM object reference count to 1, the ilm age to jiffies,
+ *	the default instruction set (POP,PEEK) and initializes
+ *	both the dev_entry and nhlfe_entry lists. The node's key is set to the
+ *	mapped	key from the label/labelspace in the request.
+ *
+ *	Returns added ilm entry on success, or err pointer.
+ **/
+
+struct mpls_ilm *mpls_add_in_label(struct net *net,
+		const struct mpls_in_label_req *in)
+{
+	struct mpls_ilm *ilm;
+
+	MPLS_ENTER;
+	ilm = __mpls_alloc_in_label(net, in);
+	if (IS_ERR(ilm)) {
 		MPLS_EXIT;
-		return ERR_PTR(-ENOMEM);
+		return ilm;
 	}
 
-	ilm->ilm_owner = in->mil_owner;
-
 	/* Insert into ILM tree */
-	if (unlikely(mpls_insert_ilm(key, ilm))) {
+	if (unlikely(mpls_insert_ilm(ilm->ilm_key, ilm))) {
 		mpls_ilm_release(ilm);
 		MPLS_EXIT;
 		return ERR_PTR(-ENOMEM);
@@ -449,8 +839,43 @@ struct mpls_ilm *mpls_add_in_label(const struct mpls_in_label_req *in)
 	return ilm;
 }
 
+/**
+ *	mpls_ilm_build - Build an ILM and its instructions, unpublished.
+ *	@net:    namespace
+ *	@in:     mpls_in_label_req
+ *	@mie:    Array of instruction elements set by user
+ *	@length: Array length
+ *
+ *	Used to program labels in batches (cf. mpls_insert_ilms). The label
+ *	cache of the layer 3 protocols is not flushed. On failure nothing is
+ *	left behind. Returns the ILM or an err pointer.
+ **/
+
+struct mpls_ilm *mpls_ilm_build(struct net *net,
+		const struct mpls_in_label_req *in,
+		struct mpls_instr_elem *mie, int length)
+{
+	struct mpls_ilm *ilm;
+
+	MPLS_ENTER;
+	ilm = __mpls_alloc_in_label(net, in);
+	if (IS_ERR(ilm)) {
+		MPLS_EXIT;
+		return ilm;
+	}
+
+	if (!__mpls_instrs_build(mie, &ilm->ilm_instr, length, MPLS_IN, ilm)) {
+		mpls_ilm_release(ilm);
+		MPLS_EXIT;
+		return ERR_PTR(-EINVAL);
+	}
+	MPLS_EXIT;
+	return ilm;
+}
+
 /**
  *	mpls_del_in_label - Del a label from the incoming tree (ILM)
+ *	@net: namespace
  *	@in : mpls_in_label_req
  *
  *	User context entry point.
@@ -464,7 +889,8 @@ struct mpls_ilm *mpls_add_in_label(const struct mpls_in_label_req *in)
  *	then finally schedules the ILM for freeing.
  **/
 
-int mpls_del_in_label(struct mpls_in_label_req *in, int seq, int pid)
+int mpls_del_in_label(struct net *net, struct mpls_in_label_req *in,
+		int seq, int pid)
 {
 	struct mpls_ilm   *ilm = NULL;
 	struct mpls_label *ml  = NULL;
@@ -475,29 +901,28 @@ int mpls_del_in_label(struct mpls_in_label_req *in, int seq, int pid)
 	ml  = &in->mil_label;
 	key = mpls_label2key(ml->ml_labelspace, ml);
 
-	ilm = mpls_get_ilm(key);
+	ilm = mpls_get_ilm(net, key);
 	if (unlikely(!ilm)) {
 		MPLS_DEBUG("Node %u was not in tree\n", key);
 		MPLS_EXIT;
 		return  -ESRCH;
 	}
 
-	/* Remove an ILM from the tree */
-	mpls_remove_ilm(key);
+	/* Remove an ILM from the tree, and from the NHLFE it forwards to */
+	mpls_remove_ilm(net, key);
+	list_del_init(&ilm->nhlfe_entry);
 
 	/* Release the refcnt taken on mpls_get_ilm() */
 	mpls_ilm_release(ilm);
 
-	/* we're still holding a ref to the ILM, so it is safe to
+	/* the tables still hold a ref to the ILM, so it is safe to
 	 * call mpls_ilm_event */
 	mpls_ilm_event(MPLS_GRP_ILM_NAME,
 			MPLS_CMD_DELILM, ilm, seq, pid);
-	/* remove the instructions from the ILM to release
-	 * our references to NHLFE's */
-	mpls_destroy_ilm_instrs(ilm);
 
-	/*this release are going to drop ilm*/
-	mpls_ilm_release(ilm);
+	/* Packets being switched don't hold a reference: the instructions
+	 * (and our references to NHLFE's) go after a grace period */
+	call_rcu_bh(&ilm->rcu, mpls_ilm_destroy_rcu);
 	MPLS_EXIT;
 	return 0;
 }
@@ -522,23 +947,19 @@ int mpls_del_ilm(struct mpls_ilm *ilm, int seq, int pid)
 	MPLS_ENTER;
 	BUG_ON(!ilm);
 
-	/* Remove an ILM from the tree */
-	mpls_remove_ilm(ilm->ilm_key);
-
-	/* remove the instructions from the ILM to release
-	 * our references to NHLFE's */
-	mpls_destroy_ilm_instrs(ilm);
+	/* Remove an ILM from the tree, and from the NHLFE it forwards to */
+	mpls_remove_ilm(mpls_ilm_net(ilm), ilm->ilm_key);
+	list_del_init(&ilm->nhlfe_entry);
 
 	/* we're still holding a ref to the ILM, so it is safe to
 	 * call mpls_ilm_event */
 	mpls_ilm_event(MPLS_GRP_ILM_NAME,
 			MPLS_CMD_DELILM, ilm, seq, pid);
 
-	/* Release the refcnt taken on mpls_get_ilm()
-	 * this release is going to drop nhlfe
-	 */
+	/* The last reference goes with the instructions, once the
+	 * packets being switched with this ILM are done */
 	WARN_ON(atomic_read(&ilm->refcnt) != 1);
-	mpls_ilm_release(ilm);
+	call_rcu_bh(&ilm->rcu, mpls_ilm_destroy_rcu);
 
 	MPLS_EXIT;
 	return 0;
@@ -546,6 +967,7 @@ int mpls_del_ilm(struct mpls_ilm *ilm, int seq, int pid)
 
 /**
  *	mpls_attach_in2out - Establish a xconnect between a ILM and a NHLFE.
+ *	@net : namespace of the ILM and the NHLFE.
  *	@req : crossconnect request.
  *
  *	Establishes a "cross-connect", a forwarding entry. The incoming label
@@ -562,8 +984,19 @@ int mpls_del_ilm(struct mpls_ilm *ilm, int seq, int pid)
  *	      the xconnect in order to release the NHLFE)
  **/
 
-int mpls_attach_in2out(struct mpls_xconnect_req *req,
+int mpls_attach_in2out(struct net *net, struct mpls_xconnect_req *req,
 		int seq, int pid)
+{
+	return __mpls_attach_in2out(net, req, seq, pid, 1, NULL);
+}
+
+/*
+ * Same as mpls_attach_in2out, the xconnect events are only sent when
+ * notify is set (batches send a summary instead). When undo is given it
+ * records what mpls_xc_revert() needs to revert the crossconnect.
+ */
+int __mpls_attach_in2out(struct net *net, struct mpls_xconnect_req *req,
+		int seq, int pid, int notify, struct mpls_xc_undo *undo)
 {
 	struct mpls_instr  *mi  = NULL;
 	struct mpls_nhlfe  *nhlfe = NULL;
@@ -575,7 +1008,7 @@ int mpls_attach_in2out(struct mpls_xconnect_req *req,
 
 	/* Hold a ref to the ILM */
 	key = mpls_label2key(labelspace, &req->mx_in);
-	ilm = mpls_get_ilm(key);
+	ilm = mpls_get_ilm(net, key);
 	if (unlikely(!ilm))  {
 		MPLS_DEBUG("ILM %u does not exist "
 					"in radix tree\n", key);
@@ -592,7 +1025,7 @@ int mpls_attach_in2out(struct mpls_xconnect_req *req,
 
 	/* Hold a ref to the NHLFE */
 	key = mpls_label2key(0, &req->mx_out);
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(net, key);
 	if (unlikely(!nhlfe)) {
 		MPLS_DEBUG("Node %u does not exist "
 					"in radix tree\n", key);
@@ -610,21 +1043,41 @@ int mpls_attach_in2out(struct mpls_xconnect_req *req,
 	/* Lookup the last instr */
 	mi = mpls_instr_getlast(ilm->ilm_instr);
 
+	if (undo) {
+		undo->xu_ilm_key = ilm->ilm_key;
+		undo->xu_opcode = MPLS_OP_MAX;
+		undo->xu_nhlfe_key = 0;
+	}
+
 	switch (mi->mi_opcode) {
 	case MPLS_OP_PEEK:
 	case MPLS_OP_DROP:
+		if (undo)
+			undo->xu_opcode = mi->mi_opcode;
 		mi->mi_opcode = MPLS_OP_FWD;
 		mi->mi_data   = (void *)nhlfe;
+		list_add(&ilm->nhlfe_entry, &nhlfe->list_in);
 		break;
 	case MPLS_OP_FWD:
-		mpls_xc_event(MPLS_GRP_XC_NAME, MPLS_CMD_DELXC, ilm,
-				_mpls_as_nhlfe(mi->mi_data), 0, 0);
+		if (undo) {
+			undo->xu_opcode = MPLS_OP_FWD;
+			undo->xu_nhlfe_key =
+				_mpls_as_nhlfe(mi->mi_data)->nhlfe_key;
+		}
+		if (notify)
+			mpls_xc_event(MPLS_GRP_XC_NAME, MPLS_CMD_DELXC, ilm,
+					_mpls_as_nhlfe(mi->mi_data), 0, 0);
+		/* so that deleting the NHLFE finds this ILM */
+		list_del_init(&ilm->nhlfe_entry);
 		mpls_nhlfe_release(_mpls_as_nhlfe(mi->mi_data));
 		mi->mi_data   = (void *)nhlfe;
+		list_add(&ilm->nhlfe_entry, &nhlfe->list_in);
 		break;
 	}
-	ret = mpls_xc_event(MPLS_GRP_XC_NAME,
-		MPLS_CMD_NEWXC, ilm, nhlfe, seq, pid);
+	ret = 0;
+	if (notify)
+		ret = mpls_xc_event(MPLS_GRP_XC_NAME,
+			MPLS_CMD_NEWXC, ilm, nhlfe, seq, pid);
 out_release:
 	mpls_ilm_release(ilm);
 out:
@@ -635,8 +1088,58 @@ out:
 
 
 
+/**
+ *	mpls_xc_revert - Revert a crossconnect made by __mpls_attach_in2out().
+ *	@net :  namespace of the ILM.
+ *	@undo : record filled by __mpls_attach_in2out().
+ *
+ *	The last instruction of the ILM gets back the opcode, and NHLFE, it
+ *	had before. Crossconnects of a batch are reverted in the reverse
+ *	order they were made. No event is sent. Process context only.
+ **/
+
+void mpls_xc_revert(struct net *net, struct mpls_xc_undo *undo)
+{
+	struct mpls_nhlfe *old = NULL;
+	struct mpls_instr *mi;
+	struct mpls_ilm *ilm;
+
+	MPLS_ENTER;
+	if (undo->xu_opcode == MPLS_OP_MAX)
+		goto out;
+
+	ilm = mpls_get_ilm(net, undo->xu_ilm_key);
+	if (unlikely(!ilm))
+		goto out;
+
+	mi = mpls_instr_getlast(ilm->ilm_instr);
+	if (unlikely(mi->mi_opcode != MPLS_OP_FWD))
+		goto out_release;
+
+	/* the reference of the lookup is the one the opcode holds */
+	if (undo->xu_opcode == MPLS_OP_FWD)
+		old = mpls_get_nhlfe(net, undo->xu_nhlfe_key);
+
+	list_del_init(&ilm->nhlfe_entry);
+	mpls_nhlfe_release(_mpls_as_nhlfe(mi->mi_data));
+	if (old) {
+		mi->mi_data = (void *)old;
+		list_add(&ilm->nhlfe_entry, &old->list_in);
+	} else {
+		/* the previous NHLFE is gone, drop like a detach would */
+		mi->mi_opcode = undo->xu_opcode == MPLS_OP_FWD ?
+			MPLS_OP_DROP : undo->xu_opcode;
+		mi->mi_data = NULL;
+	}
+out_release:
+	mpls_ilm_release(ilm);
+out:
+	MPLS_EXIT;
+}
+
 /**
  *	mpls_dettach_in2out - Dettach a xconnect between a ILM and a NHLFE.
+ *	@net : namespace of the ILM.
  *	@req : crossconnect request.
  *
  *	Dettaches a "cross-connect", a forwarding entry. Checks if the latest
@@ -646,7 +1149,7 @@ out:
  *	Returns 0 on success. Process context only.
  **/
 
-int mpls_detach_in2out(struct mpls_xconnect_req *req,
+int mpls_detach_in2out(struct net *net, struct mpls_xconnect_req *req,
 		int seq, int pid)
 {
 	struct mpls_instr  *mi  = NULL;
@@ -662,7 +1165,7 @@ int mpls_detach_in2out(struct mpls_xconnect_req *req,
 	/* Hold a ref to the ILM, The 'in' segment */
 	labelspace = req->mx_in.ml_labelspace;
 	key = mpls_label2key(labelspace, &(req->mx_in));
-	ilm = mpls_get_ilm(key);
+	ilm = mpls_get_ilm(net, key);
 	if (unlikely(!ilm)) {
 		MPLS_DEBUG("ILM %u does not exist in radix tree\n", key);
 		ret = -ESRCH;
@@ -702,6 +1205,7 @@ int mpls_detach_in2out(struct mpls_xconnect_req *req,
 	mi->mi_opcode = MPLS_OP_DROP;
 	/* With no data */
 	mi->mi_data = NULL;
+	list_del_init(&ilm->nhlfe_entry);
 
 	/* Release the NHLFE held by the Opcode (cf. mpls_attach_in2out) */
 
@@ -781,8 +1285,75 @@ int __init mpls_ilm_init(void)
 void mpls_ilm_exit(void)
 {
 	MPLS_ENTER;
+	/* wait for the pending mpls_ilm_free_rcu() */
+	rcu_barrier_bh();
 	if (ilm_cachep)
 		kmem_cache_destroy(ilm_cachep);
 
 	MPLS_EXIT;
 }
+
+/**
+ *	mpls_ilm_init_net - Set up the ILM tables of a namespace.
+ *	@net: new namespace
+ *
+ *	The label tables are allocated by the first ILM of a labelspace.
+ **/
+
+void __net_init mpls_ilm_init_net(struct net *net)
+{
+	MPLS_ENTER;
+	INIT_RADIX_TREE(&net->mpls.ilm_tree, GFP_ATOMIC);
+	spin_lock_init(&net->mpls.ilm_lock);
+	INIT_LIST_HEAD(&net->mpls.ilm_list);
+	MPLS_EXIT;
+}
+
+/**
+ *	mpls_ilm_exit_net - Flush the ILM tables of a namespace.
+ *	@net: namespace going away
+ *
+ *	Every ILM is unlinked with a single acquisition of the ILM lock, one
+ *	grace period covers all of them, then their instructions (and the
+ *	NHLFE references of the FWD opcodes) are released and the label
+ *	tables freed. Userland is not notified, its sockets are gone.
+ **/
+
+void __net_exit mpls_ilm_exit_net(struct net *net)
+{
+	struct mpls_ilm *ilm, *tmp;
+	LIST_HEAD(dead);
+#ifdef CONFIG_MPLS_ILM_TABLE
+	struct mpls_ilm_table *t;
+	int i;
+#endif
+
+	MPLS_ENTER;
+	/* nobody walks the ILM list of a dying namespace, reuse the entries */
+	spin_lock_bh(&net->mpls.ilm_lock);
+	while (!list_empty(&net->mpls.ilm_list)) {
+		ilm = list_first_entry(&net->mpls.ilm_list, struct mpls_ilm,
+				global);
+		__mpls_remove_ilm(net, ilm->ilm_key);
+		list_add(&ilm->global, &dead);
+	}
+	spin_unlock_bh(&net->mpls.ilm_lock);
+
+	synchronize_rcu_bh();
+
+	list_for_each_entry_safe(ilm, tmp, &dead, global) {
+		list_del_init(&ilm->global);
+		mpls_destroy_ilm_instrs(ilm);
+		mpls_ilm_release(ilm);
+	}
+
+#ifdef CONFIG_MPLS_ILM_TABLE
+	for (i = 0; i <= MPLS_LABELSPACE_MAX; i++) {
+		t = rcu_dereference_protected(net->mpls.ilm_table[i], 1);
+		RCU_INIT_POINTER(net->mpls.ilm_table[i], NULL);
+		if (t)
+			mpls_ilm_table_free(t);
+	}
+#endif
+	MPLS_EXIT;
+}
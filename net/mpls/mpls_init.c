@@ -26,6 +26,9 @@
 #include <net/mpls.h>
 #include <net/ip.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/mpls.h>
+
 /**
  * variables controled via sysctl
  **/
@@ -38,9 +41,17 @@
 int sysctl_mpls_debug = MPLS_DEBUG_SYS;
 EXPORT_SYMBOL(sysctl_mpls_debug);
 
+/* MPLS_DEBUG() is patched out of the data path while this is off */
+struct jump_label_key mpls_debug_key = JUMP_LABEL_INIT;
+EXPORT_SYMBOL(mpls_debug_key);
+
 int sysctl_mpls_default_ttl = 255;
 EXPORT_SYMBOL(sysctl_mpls_default_ttl);
 
+/* jiffies between two ICMP errors to the same source, 0 is unlimited */
+int sysctl_mpls_icmp_ratelimit = HZ;
+EXPORT_SYMBOL(sysctl_mpls_icmp_ratelimit);
+
 /**
  * MODULE Information and attributes
  **/
@@ -57,23 +68,32 @@ MODULE_LICENSE("GPL");
 static struct packet_type mpls_uc_packet_type = {
 	.type = cpu_to_be16(ETH_P_MPLS_UC), /* MPLS Unicast PID */
 	.func = mpls_skb_recv,
+	.gro_receive = mpls_gro_receive,
+	.gro_complete = mpls_gro_complete,
+	.gso_segment = mpls_gso_segment,
+	.gso_send_check = mpls_gso_send_check,
 };
 
 /**
  *	mpls_release_netdev_in_nhlfe - Release the held device if it goes down.
  *	@dev: network device (for which the notification is sent).
+ *	@event: NETDEV_DOWN or NETDEV_UNREGISTER
  *
  *	NHLFE objects hold a reference to the used outgoing device in the SET op
  *	data. When the MPLS subsystem is notified that a device is going down
- *	or unregistered, this function destroys the instructions for those NHLFE
+ *	or unregistered, this function destroys the instructions for those NHLFE.
+ *	On NETDEV_DOWN the NHLFEs with a usable backup are kept, switched over
+ *	to the backup.
  **/
 
-static int mpls_release_netdev_in_nhlfe(struct net_device *dev)
+static int mpls_release_netdev_in_nhlfe(struct net_device *dev,
+		unsigned long event)
 {
 	struct mpls_interface *mif = dev->mpls_ptr;
 	struct list_head *pos = NULL;
 	struct list_head *tmp = NULL;
 	struct mpls_nhlfe *holder;
+	int deleted = 0;
 	MPLS_ENTER;
 	/* Iterate all NHLFE objects present in the list_out of the interface.*/
 	list_for_each_safe(pos, tmp, &mif->list_out) {
@@ -81,17 +101,49 @@ static int mpls_release_netdev_in_nhlfe(struct net_device *dev)
 		/* Get the holder / owner NHLFE */
 		holder = list_entry(pos, struct mpls_nhlfe , dev_entry);
 
-		/* Destroy the nhlfe entry */
+		if (event == NETDEV_DOWN && mpls_nhlfe_frr_activate(holder))
+			continue;
+
+		/* Destroy the nhlfe entry, it leaves the list */
 		mpls_del_nhlfe(holder, 0, 0);
-		list_del(pos);
+		deleted++;
 	}
 
+	/* one invalidation of the L3 caches for all of them */
+	if (deleted)
+		mpls_proto_cache_flush_all(dev_net(dev));
+
 	MPLS_EXIT;
 	return NOTIFY_DONE;
 }
 
 
 
+/**
+ *	mpls_frr_netdev_nhlfe - Carrier change on a device
+ *	@dev: network device (for which the notification is sent).
+ *
+ *	The NHLFEs using the device are switched over to their backup when
+ *	the carrier is lost, and back to the device when it recovers.
+ **/
+
+static int mpls_frr_netdev_nhlfe(struct net_device *dev)
+{
+	struct mpls_interface *mif = dev->mpls_ptr;
+	int failed = !netif_running(dev) || !netif_carrier_ok(dev);
+	struct mpls_nhlfe *holder;
+	MPLS_ENTER;
+	list_for_each_entry(holder, &mif->list_out, dev_entry) {
+		if (failed)
+			mpls_nhlfe_frr_activate(holder);
+		else
+			mpls_nhlfe_frr_revert(holder);
+	}
+
+	MPLS_EXIT;
+	return NOTIFY_DONE;
+}
+
 /**
  *	mpls_change_mtu_nhlfe - Changes nhlfe's mtu dev's changed mtu
  *	@dev: network device (for which the notification is sent).
@@ -152,13 +204,14 @@ static int mpls_netdev_event(struct notifier_block *this,
 	switch (event) {
 	case NETDEV_UNREGISTER:
 	case NETDEV_DOWN:
-		mpls_release_netdev_in_nhlfe(dev);
+		mpls_release_netdev_in_nhlfe(dev, event);
 		break;
 	case NETDEV_CHANGEMTU:
 		mpls_change_mtu_nhlfe(dev);
 		break;
 	case NETDEV_UP:
 	case NETDEV_CHANGE:
+		mpls_frr_netdev_nhlfe(dev);
 		break;
 	}
 	MPLS_EXIT;
@@ -201,6 +254,30 @@ static struct pernet_operations __net_initdata mpls_mib_ops = {
 	.exit = mpls_mib_exit_net,
 };
 
+static int __net_init mpls_init_net(struct net *net)
+{
+	mpls_ilm_init_net(net);
+	mpls_nhlfe_init_net(net);
+	return 0;
+}
+
+static void __net_exit mpls_exit_net(struct net *net)
+{
+	/* the FWD opcodes of the ILMs hold the NHLFEs */
+	mpls_ilm_exit_net(net);
+	mpls_nhlfe_exit_net(net);
+}
+
+/*
+ * Registered as a device subsystem: the tables of a dying namespace are
+ * flushed before its devices (loopback included) are unregistered, the
+ * NHLFEs hold references to them.
+ */
+static struct pernet_operations mpls_net_ops = {
+	.init = mpls_init_net,
+	.exit = mpls_exit_net,
+};
+
 static int __init init_mpls_mibs(void)
 {
 	return register_pernet_subsys(&mpls_mib_ops);
@@ -218,6 +295,10 @@ static void exit_mpls_mibs(void)
 static int __init mpls_init_module(void)
 {
 	int err;
+
+	if (sysctl_mpls_debug)
+		jump_label_inc(&mpls_debug_key);
+
 	MPLS_ENTER;
 	printk(KERN_INFO "MPLS: version %d.%d%d%d\n",
 		(MPLS_LINUX_VERSION >> 24) & 0xFF,
@@ -241,10 +322,15 @@ static int __init mpls_init_module(void)
 	if (err)
 		goto cleanup_ilm;
 
+	/* ILM/NHLFE tables of every namespace */
+	err = register_pernet_device(&mpls_net_ops);
+	if (err)
+		goto cleanup_nhlfe;
+
 #ifdef CONFIG_SYSCTL
 	err = mpls_sysctl_init();
 	if (err)
-		goto cleanup_nhlfe;
+		goto cleanup_net;
 
 #endif
 	/* Netlink configuration interface */
@@ -273,7 +359,9 @@ cleanup_mib:
 cleanup_sysctl:
 #ifdef CONFIG_SYSCTL
 	mpls_sysctl_exit();
+cleanup_net:
 #endif
+	unregister_pernet_device(&mpls_net_ops);
 cleanup_nhlfe:
 	mpls_nhlfe_exit();
 cleanup_ilm:
@@ -302,6 +390,7 @@ static void __exit mpls_exit_module(void)
 #ifdef CONFIG_SYSCTL
 	mpls_sysctl_exit();
 #endif
+	unregister_pernet_device(&mpls_net_ops);
 	mpls_nhlfe_exit();
 	mpls_ilm_exit();
 	mpls_instr_exit();
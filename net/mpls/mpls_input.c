@@ -32,6 +32,7 @@
 #include <net/ipv6.h>
 #endif
 #include <net/mpls.h>
+#include <trace/events/mpls.h>
 
 
 /**
@@ -40,6 +41,11 @@
  *	@dev:        device that receives the packet.
  *	@label:      label value + metadata (type)
  *	@labelspace: incoming labelspace.
+ *
+ *	The whole switching path runs under rcu_read_lock_bh: neither the ILM
+ *	nor the NHLFE are refcounted per packet, the NHLFE is attached to the
+ *	skb as a noref dst (it is forced to a real reference if the skb gets
+ *	queued).
  **/
 
 static int mpls_input(struct sk_buff *skb, struct net_device *dev,
@@ -49,11 +55,12 @@ static int mpls_input(struct sk_buff *skb, struct net_device *dev,
 	MPLS_IN_OPCODE_PROTOTYPE(*func);  /* Function Pointer for Opcodes */
 	struct mpls_prot_driver *prot;
 	struct mpls_nhlfe *nhlfe = NULL;  /* Current NHLFE */
-	struct mpls_ilm  *ilm;            /* Current ILM */
+	struct mpls_ilm  *ilm = NULL;     /* Current ILM */
 	struct mpls_instr    *mi;
 	void *data = NULL;                 /* current data for opcode */
 	int  opcode = 0;                   /* Current opcode to execute */
 	char *msg = NULL;                  /* Human readable desc. opcode */
+	int reason;                        /* Why it is dropped */
 	int retval, packet_length = skb->len;
 
 	MPLS_ENTER;
@@ -61,17 +68,56 @@ static int mpls_input(struct sk_buff *skb, struct net_device *dev,
 	MPLS_DEBUG("labelspace=%d,label=%d,exp=%01x,B.O.S=%d,TTL=%d\n",
 			labelspace, cb->label, cb->exp, cb->bos, cb->ttl);
 
-	/* GET a reference to the ilm given this label value/labelspace*/
-	ilm = mpls_get_ilm_by_label(label, labelspace, cb->bos);
+	rcu_read_lock_bh();
+
+relookup:
+	if (unlikely(cb->label == MPLS_ENTROPY_LABEL_IND)) {
+		/*
+		 * RFC 6790: the LSP the entropy was pushed for ends here,
+		 * the ELI/EL pair goes away with it.
+		 */
+		if (cb->bos || !pskb_may_pull(skb, 3 * MPLS_HDR_LEN)) {
+			MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INERRORS);
+			reason = MPLS_DROP_HDR;
+			goto mpls_input_drop;
+		}
+		__skb_pull(skb, MPLS_HDR_LEN);
+		skb_reset_network_header(skb);
+		mpls_label_entry_peek(skb);
+		__skb_pull(skb, MPLS_HDR_LEN);
+		skb_reset_network_header(skb);
+		if (cb->bos) {
+			/* nothing but the payload below the EL */
+			switch (ip_hdr(skb)->version) {
+			case 4:
+				skb->protocol = htons(ETH_P_IP);
+				goto mpls_input_dlv;
+			case 6:
+				skb->protocol = htons(ETH_P_IPV6);
+				goto mpls_input_dlv;
+			}
+			MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INERRORS);
+			reason = MPLS_DROP_HDR;
+			goto mpls_input_drop;
+		}
+		mpls_label_entry_peek(skb);
+		label->u.ml_gen = cb->label;
+	}
+
+	trace_mpls_input(skb, labelspace);
+
+	/* GET the ilm given this label value/labelspace*/
+	ilm = mpls_get_ilm_by_label(dev_net(dev), label, labelspace, cb->bos);
 	if (unlikely(!ilm)) {
 		MPLS_DEBUG("unknown incoming label, dropping\n");
 		MPLS_INC_STATS_BH(dev_net(dev),
 			MPLS_MIB_IFINLABELLOOKUPFAILURES);
+		reason = MPLS_DROP_NO_ILM;
 		goto mpls_input_drop;
 	}
 
 	/* Iterate all the opcodes for this ILM */
-	for_each_instr(ilm->ilm_instr, mi) {
+	for_each_instr(rcu_dereference_bh(ilm->ilm_instr), mi) {
 		data   = mi->mi_data;
 		opcode = mi->mi_opcode;
 		msg    = mpls_ops[opcode].msg;
@@ -81,46 +127,62 @@ static int mpls_input(struct sk_buff *skb, struct net_device *dev,
 		if (!func) {
 			MPLS_DEBUG("invalid opcode for input: %s\n", msg);
 			MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INDISCARDS);
+			reason = MPLS_DROP_BAD_OPCODE;
 			goto mpls_input_drop;
 		}
 
-		switch (func(&skb, ilm, &nhlfe, data)) {
+		retval = func(&skb, ilm, &nhlfe, data);
+		trace_mpls_opcode(MPLS_IN, label->u.ml_gen, opcode, retval);
+		switch (retval) {
 		case MPLS_RESULT_FWD:
 			goto mpls_input_fwd;
-		case MPLS_RESULT_DROP:
 		case MPLS_RESULT_DLV:
+			goto mpls_input_dlv;
+		case MPLS_RESULT_DROP:
 		case MPLS_RESULT_RECURSE:
 			MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INERRORS);
+			reason = MPLS_DROP_OPCODE;
 			goto mpls_input_drop;
 		case MPLS_RESULT_SUCCESS:
 			break;
 		}
 	}
 	MPLS_DEBUG("finished executing in label program without FWD\n");
+	reason = MPLS_DROP_NO_FWD;
 
 	/* fall through to drop */
 
 mpls_input_drop:
+	trace_mpls_drop(skb, MPLS_IN, reason);
 	if (ilm)
-		mpls_ilm_release(ilm);
-
+		mpls_lsp_stats_drop(ilm->ilm_stats);
+	rcu_read_unlock_bh();
 	kfree_skb(skb);
 	MPLS_DEBUG("dropped\n");
 	MPLS_EXIT;
 	return NET_RX_DROP;
 
-mpls_input_fwd:
-	/* We are about to mangle packet. Copy it! */
-	if (skb_cow(skb, 
-			LL_RESERVED_SPACE(nhlfe->dst.dev) +	nhlfe->dst.header_len)) {
-		printk_ratelimited(KERN_ERR "MPLS: unable to cow skb\n");
+mpls_input_dlv:
+	/* The opcode popped the last label and set the L3 context (VRF) */
+	if (mpls_proto_deliver(skb, skb->protocol)) {
 		MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INDISCARDS);
+		reason = MPLS_DROP_DLV;
 		goto mpls_input_drop;
 	}
+	MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INPACKETS);
+	MPLS_ADD_STATS_BH(dev_net(dev),
+		MPLS_MIB_INOCTETS, packet_length);
+	if (ilm)
+		mpls_lsp_stats_add(ilm->ilm_stats, packet_length);
+	rcu_read_unlock_bh();
+	MPLS_EXIT;
+	return NET_RX_SUCCESS;
 
+mpls_input_fwd:
 	cb = MPLSCB(skb);
 	prot = cb->prot = nhlfe->nhlfe_proto;
 
+	/* before the cow: cb->top_of_stack points in the current head */
 	if (cb->ttl <= 1) {
 		MPLS_DEBUG("TTL exceeded\n");
 
@@ -128,6 +190,7 @@ mpls_input_fwd:
 
 		if (retval) {
 			MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INERRORS);
+			reason = MPLS_DROP_TTL;
 			goto mpls_input_drop;
 		}
 		/* otherwise prot->ttl_expired() must have modified the
@@ -135,6 +198,18 @@ mpls_input_fwd:
 		 */
 	}
 
+	/*
+	 * We are about to mangle the label stack: make room for the
+	 * pushes, and unshare the header (only) if the skb is a clone.
+	 */
+	if (skb_cow_head(skb,
+			LL_RESERVED_SPACE(nhlfe->dst.dev) + nhlfe->dst.header_len)) {
+		printk_ratelimited(KERN_ERR "MPLS: unable to cow skb\n");
+		MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INDISCARDS);
+		reason = MPLS_DROP_NOMEM;
+		goto mpls_input_drop;
+	}
+
 	/*cb->label = 0;
 	cb->exp = 0;
 	cb->flag = 0;
@@ -150,19 +225,36 @@ mpls_input_fwd:
 	MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INPACKETS);
 	MPLS_ADD_STATS_BH(dev_net(dev),
 		MPLS_MIB_INOCTETS, packet_length);
-
-	/* hold nhlfe before releasing ilm */
-	mpls_nhlfe_hold(nhlfe);
-
-	mpls_ilm_release(ilm);
+	mpls_lsp_stats_add(ilm->ilm_stats, packet_length);
 
 	(cb->ttl)--;
 
-	skb_dst_set(skb, &nhlfe->dst);
+	skb_dst_drop(skb);
+	skb_dst_set_noref(skb, &nhlfe->dst);
 
 	MPLS_DEBUG("switching\n");
+	cb->relookup = 1;
+	retval = dst_input(skb);
+	if (retval == MPLS_RX_RELOOKUP) {
+		/*
+		 * A POP/PEEK NHLFE left more labels: the popped one is the
+		 * labelspace of the next, same as mpls_skb_recv() does for
+		 * a new packet but without going through the RX path again.
+		 */
+		labelspace = cb->context_labelspace;
+		dev = skb->dev;
+		packet_length = skb->len;
+		memset(cb, 0, sizeof(struct mpls_skb_cb));
+		cb->top_of_stack = skb->data;
+		mpls_label_entry_peek(skb);
+		label->u.ml_gen = cb->label;
+		nhlfe = NULL;
+		MPLS_DEBUG("relookup\n");
+		goto relookup;
+	}
+	rcu_read_unlock_bh();
 	MPLS_EXIT;
-	return dst_input(skb);
+	return retval;
 }
 
 /**
@@ -180,20 +272,27 @@ int mpls_skb_recv(struct sk_buff *skb,
 	int labelspace;
 	struct mpls_label label;
 	struct mpls_interface *mip = dev->mpls_ptr;
+	int reason;
 
 	MPLS_ENTER;
 
-	if (skb->pkt_type == PACKET_OTHERHOST)
+	if (skb->pkt_type == PACKET_OTHERHOST) {
+		reason = MPLS_DROP_OTHERHOST;
 		goto mpls_rcv_drop;
+	}
 
 	skb = skb_share_check(skb, GFP_ATOMIC);
-	if (!skb)
+	if (!skb) {
+		reason = MPLS_DROP_NOMEM;
 		goto mpls_rcv_err;
+	}
 
 	cb = MPLSCB(skb);
 
-	if (!pskb_may_pull(skb, MPLS_HDR_LEN))
+	if (!pskb_may_pull(skb, MPLS_HDR_LEN)) {
+		reason = MPLS_DROP_HDR;
 		goto mpls_rcv_err;
+	}
 
 	if (cb->recursion)
 		labelspace = cb->context_labelspace;
@@ -204,6 +303,7 @@ int mpls_skb_recv(struct sk_buff *skb,
 		MPLS_DEBUG("dev %s has no labelspace, dropped!\n", dev->name);
 		MPLS_INC_STATS_BH(dev_net(dev),
 			MPLS_MIB_IFINLABELLOOKUPFAILURES);
+		reason = MPLS_DROP_NO_LABELSPACE;
 		goto mpls_rcv_out;
 	}
 
@@ -222,18 +322,22 @@ int mpls_skb_recv(struct sk_buff *skb,
 	case ARPHRD_LOOPBACK:
 	case ARPHRD_HDLC:
 	case ARPHRD_IPGRE:
+	case ARPHRD_MPLS_TUNNEL:
 		label.ml_type  = MPLS_LABEL_GEN;
 		label.u.ml_gen = cb->label;
 		break;
 	default:
 		MPLS_DEBUG("device %s unknown IfType(%08x)\n",
 				dev->name, dev->type);
+		reason = MPLS_DROP_HDR;
 		goto mpls_rcv_err;
 	}
 
+	trace_mpls_recv(skb, dev, labelspace);
 	return mpls_input(skb, dev, &label, labelspace);
 
 mpls_rcv_out:
+	trace_mpls_drop(skb, MPLS_IN, reason);
 	kfree_skb(skb);
 	MPLS_EXIT;
 	return NET_RX_DROP;
@@ -244,3 +348,190 @@ mpls_rcv_drop:
 	MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_INERRORS);
 	goto mpls_rcv_out;
 }
+EXPORT_SYMBOL(mpls_skb_recv);
+
+/*
+ * GRO: labelled TCP that terminates on this box (ILM -> FWD to a POP,PEEK
+ * NHLFE for every label in the stack) is aggregated below the label
+ * stack, so mpls_input() runs once per super-packet.  Switched LSPs are
+ * left alone, they would hand a GSO skb to the output path.
+ */
+
+#define MPLS_GRO_MAX_DEPTH	8
+
+/**
+ *	mpls_gro_local - Check that every label of a stack is delivered locally.
+ *	@dev:   receiving device.
+ *	@stack: label stack, in network byte order.
+ *	@depth: number of entries in @stack.
+ *
+ *	Follows the lookups mpls_skb_recv()/mpls_input() would do (the popped
+ *	label is the labelspace of the next one).
+ **/
+
+static int mpls_gro_local(struct net_device *dev,
+		const __be32 *stack, unsigned int depth)
+{
+	struct mpls_interface *mip = dev->mpls_ptr;
+	struct mpls_label label;
+	struct mpls_nhlfe *nhlfe;
+	struct mpls_ilm *ilm;
+	struct mpls_instr *mi;
+	int labelspace = mip ? mip->labelspace : -1;
+	unsigned int i;
+	int local = 0;
+
+	if (labelspace < 0 || dev->type != ARPHRD_ETHER)
+		return 0;
+
+	memset(&label, 0, sizeof(label));
+	label.ml_type = MPLS_LABEL_GEN;
+
+	rcu_read_lock_bh();
+	for (i = 0; i < depth; i++) {
+		u32 shim = ntohl(stack[i]);
+
+		label.u.ml_gen = __MPLS_SHIM_LABEL(shim);
+		ilm = mpls_get_ilm_by_label(dev_net(dev), &label, labelspace,
+				__MPLS_SHIM_S_BIT(shim));
+		if (!ilm)
+			goto out;
+
+		mi = rcu_dereference_bh(ilm->ilm_instr);
+		if (!mi || mi->mi_opcode != MPLS_OP_FWD || mi->mi_next)
+			goto out;
+
+		nhlfe = mi->mi_data;
+		if (!nhlfe || !nhlfe->dst.dev ||
+		    !(nhlfe->dst.dev->flags & IFF_LOOPBACK))
+			goto out;
+
+		mi = rcu_dereference_bh(nhlfe->nhlfe_instr);
+		if (!mi || mi->mi_opcode != MPLS_OP_POP || !mi->mi_next ||
+		    mi->mi_next->mi_opcode != MPLS_OP_PEEK)
+			goto out;
+
+		labelspace = label.u.ml_gen;
+	}
+	local = 1;
+out:
+	rcu_read_unlock_bh();
+	return local;
+}
+
+/**
+ *	mpls_gro_receive - GRO callback of the MPLS unicast packet type.
+ *	@head: list of held packets.
+ *	@skb:  new packet.
+ *
+ *	Held packets only stay in the same flow if they carry the very same
+ *	label stack (TTL included), the inner IPv4/IPv6 GRO handler decides
+ *	the rest.
+ **/
+
+struct sk_buff **mpls_gro_receive(struct sk_buff **head, struct sk_buff *skb)
+{
+	struct packet_type *ptype;
+	struct sk_buff **pp = NULL;
+	struct sk_buff *p;
+	unsigned int off, hlen, depth;
+	const __be32 *stack;
+	__be16 type;
+	int flush = 1;
+
+	off = skb_gro_offset(skb);
+	for (depth = 1; ; depth++) {
+		if (depth > MPLS_GRO_MAX_DEPTH)
+			goto out;
+
+		/* one more byte for the version of the payload */
+		hlen = off + depth * MPLS_HDR_LEN + 1;
+		stack = skb_gro_header_fast(skb, off);
+		if (skb_gro_header_hard(skb, hlen)) {
+			stack = skb_gro_header_slow(skb, hlen, off);
+			if (unlikely(!stack))
+				goto out;
+		}
+
+		if (__MPLS_SHIM_S_BIT(ntohl(stack[depth - 1])))
+			break;
+	}
+
+	switch (*(const u8 *)&stack[depth] >> 4) {
+	case 4:
+		type = htons(ETH_P_IP);
+		break;
+	case 6:
+		type = htons(ETH_P_IPV6);
+		break;
+	default:
+		goto out;
+	}
+
+	if (!mpls_gro_local(skb->dev, stack, depth))
+		goto out;
+
+	for (p = *head; p; p = p->next) {
+		if (!NAPI_GRO_CB(p)->same_flow)
+			continue;
+
+		if (memcmp(stack, p->data + off, depth * MPLS_HDR_LEN))
+			NAPI_GRO_CB(p)->same_flow = 0;
+	}
+
+	/* the payload checksum must not cover the label stack */
+	if (skb->ip_summed == CHECKSUM_COMPLETE)
+		skb->csum = csum_sub(skb->csum,
+			csum_partial(stack, depth * MPLS_HDR_LEN, 0));
+
+	skb_gro_pull(skb, depth * MPLS_HDR_LEN);
+	skb_set_network_header(skb, skb_gro_offset(skb));
+
+	rcu_read_lock();
+	ptype = gro_find_receive_by_type(type);
+	if (!ptype)
+		goto out_unlock;
+
+	flush = 0;
+	pp = ptype->gro_receive(head, skb);
+
+out_unlock:
+	rcu_read_unlock();
+out:
+	NAPI_GRO_CB(skb)->flush |= flush;
+	return pp;
+}
+
+/**
+ *	mpls_gro_complete - GRO completion of the MPLS unicast packet type.
+ *	@skb: aggregated packet, its network header is the inner IP header.
+ **/
+
+int mpls_gro_complete(struct sk_buff *skb)
+{
+	struct packet_type *ptype;
+	__be16 type;
+	int err = -ENOSYS;
+
+	switch (ip_hdr(skb)->version) {
+	case 4:
+		type = htons(ETH_P_IP);
+		break;
+	case 6:
+		type = htons(ETH_P_IPV6);
+		break;
+	default:
+		return err;
+	}
+
+	rcu_read_lock();
+	ptype = gro_find_complete_by_type(type);
+	if (!ptype)
+		goto out_unlock;
+
+	err = ptype->gro_complete(skb);
+
+out_unlock:
+	rcu_read_unlock();
+	return err;
+}
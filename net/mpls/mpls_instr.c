@@ -24,12 +24,23 @@
 
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
+#include <linux/jhash.h>
+#include <linux/slab.h>
 #include <net/neighbour.h>
 #include <net/route.h>
 #include <net/mpls.h>
 
 static struct kmem_cache *instr_cachep;
 
+/*
+ * Push templates by content: the NHLFEs of the FECs reached through the
+ * same stack point to one copy. The last put may come from the dst
+ * destructor, in softirq.
+ */
+#define MPLS_TMPL_HASH_BITS	10
+static struct hlist_head mpls_tmpl_hash[1 << MPLS_TMPL_HASH_BITS];
+static DEFINE_SPINLOCK(mpls_tmpl_lock);
+
 /**
  *	mpls_instr_alloc - Allocate a mpls_instruction object
  *	@opcode: opcode num.
@@ -51,6 +62,65 @@ struct mpls_instr *mpls_instr_alloc(unsigned short opcode)
 	return mi;
 }
 
+static inline u32 mpls_push_tmpl_hash(const struct mpls_push_tmpl *pt)
+{
+	return jhash2((const u32 *)pt->pt_shim, pt->pt_count,
+			pt->pt_count ^ (pt->pt_el << 8)) &
+		((1 << MPLS_TMPL_HASH_BITS) - 1);
+}
+
+/**
+ *	mpls_push_tmpl_get - find the shared copy of a template.
+ *	@pt: template just compiled, with a reference
+ *
+ *	Returns the template with the same stack already in use, with a new
+ *	reference, in which case @pt is freed; otherwise @pt, now shared.
+ **/
+
+static struct mpls_push_tmpl *mpls_push_tmpl_get(struct mpls_push_tmpl *pt)
+{
+	struct hlist_head *head = &mpls_tmpl_hash[mpls_push_tmpl_hash(pt)];
+	struct mpls_push_tmpl *old;
+	struct hlist_node *n;
+
+	spin_lock_bh(&mpls_tmpl_lock);
+	hlist_for_each_entry(old, n, head, pt_hash) {
+		if (old->pt_count == pt->pt_count &&
+		    old->pt_el == pt->pt_el &&
+		    old->pt_exp == pt->pt_exp &&
+		    old->pt_label == pt->pt_label &&
+		    !memcmp(old->pt_shim, pt->pt_shim,
+			    pt->pt_count * sizeof(__be32))) {
+			old->pt_refcnt++;
+			spin_unlock_bh(&mpls_tmpl_lock);
+			kfree(pt);
+			return old;
+		}
+	}
+	hlist_add_head(&pt->pt_hash, head);
+	spin_unlock_bh(&mpls_tmpl_lock);
+	return pt;
+}
+
+/*
+ * The instructions are freed after a grace period: no packet uses the
+ * template anymore when its last reference goes.
+ */
+static void mpls_push_tmpl_put(struct mpls_push_tmpl *pt)
+{
+	if (!pt)
+		return;
+
+	spin_lock_bh(&mpls_tmpl_lock);
+	if (--pt->pt_refcnt) {
+		spin_unlock_bh(&mpls_tmpl_lock);
+		return;
+	}
+	hlist_del(&pt->pt_hash);
+	spin_unlock_bh(&mpls_tmpl_lock);
+	kfree(pt);
+}
+
 /**
  *	mpls_instr_release - destructor for mpls instruction.
  *	@mi: this instruction
@@ -70,6 +140,7 @@ void mpls_instr_release(struct mpls_instr *mi)
 	if (mpls_ops[op].cleanup)
 		mpls_ops[op].cleanup(data, parent, dir);
 
+	mpls_push_tmpl_put(mi->mi_tmpl);
 	kmem_cache_free(instr_cachep, mi);
 	MPLS_EXIT;
 }
@@ -96,7 +167,197 @@ void mpls_instrs_free(struct mpls_instr *list)
 }
 
 /**
- *	mpls_instrs_build - build up an instruction set.
+ *	mpls_instrs_graft - hand an instruction set over to its real parent.
+ *	@instr:  Instruction list built against @shadow
+ *	@shadow: ILM/NHLFE the list was built against
+ *	@parent: ILM/NHLFE that is going to run it
+ *
+ *	A program replacing the one of a live ILM/NHLFE is built against a
+ *	shadow object, so that the build opcodes leave alone the state the
+ *	running program uses. The caller moves that state over from the
+ *	shadow, this repoints the instructions.
+ **/
+
+void mpls_instrs_graft(struct mpls_instr *instr, void *shadow, void *parent)
+{
+	struct mpls_instr *mi;
+
+	MPLS_ENTER;
+	for_each_instr(instr, mi) {
+		mi->mi_parent = parent;
+		/* SET keeps its NHLFE as data */
+		if (mi->mi_data == shadow)
+			mi->mi_data = parent;
+	}
+	MPLS_EXIT;
+}
+
+/*
+ * A replaced program and the next hop state it was using, released once
+ * no packet can run it anymore.
+ */
+struct mpls_instr_retire {
+	struct rcu_head			rcu;
+	struct mpls_instr		*list;
+	struct neighbour		*neigh;
+	struct net_device		*dev;
+	struct mpls_prot_driver		*proto;
+};
+
+static void __mpls_instrs_retire(struct mpls_instr *list,
+		struct neighbour *neigh, struct net_device *dev,
+		struct mpls_prot_driver *proto)
+{
+	mpls_instrs_free(list);
+	if (neigh)
+		neigh_release(neigh);
+	if (dev)
+		dev_put(dev);
+	mpls_proto_release(proto);
+}
+
+static void mpls_instrs_retire_rcu(struct rcu_head *head)
+{
+	struct mpls_instr_retire *r =
+		container_of(head, struct mpls_instr_retire, rcu);
+
+	__mpls_instrs_retire(r->list, r->neigh, r->dev, r->proto);
+	kfree(r);
+}
+
+/**
+ *	mpls_instrs_retire - free an instruction set that was replaced.
+ *	@list:  Instruction list, no longer reachable by new packets
+ *	@neigh: neighbour the list was using, or NULL
+ *	@dev:   device the list was using, or NULL
+ *	@proto: protocol driver the list was using, or NULL
+ *
+ *	The parent state the opcodes had set up (device, neighbour, list
+ *	linkage) now belongs to the program that replaced this one: the
+ *	cleanups are run without a parent and only release the opcode data.
+ *	Packets may still be running the list, it is freed together with
+ *	the references passed after a RCU-bh grace period, without waiting
+ *	for it. Process context only.
+ **/
+
+void mpls_instrs_retire(struct mpls_instr *list, struct neighbour *neigh,
+		struct net_device *dev, struct mpls_prot_driver *proto)
+{
+	struct mpls_instr_retire *r;
+	struct mpls_instr *mi;
+
+	MPLS_ENTER;
+	for_each_instr(list, mi)
+		mi->mi_parent = NULL;
+
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (unlikely(!r)) {
+		synchronize_rcu_bh();
+		__mpls_instrs_retire(list, neigh, dev, proto);
+		MPLS_EXIT;
+		return;
+	}
+	r->list = list;
+	r->neigh = neigh;
+	r->dev = dev;
+	r->proto = proto;
+	call_rcu_bh(&r->rcu, mpls_instrs_retire_rcu);
+	MPLS_EXIT;
+}
+
+/**
+ *	mpls_instrs_compile - precompile the label stack pushed by a NHLFE.
+ *	@instr: Instruction list
+ *
+ *	When the program is [POP|SWAP|POLICE...] followed by a run of
+ *	PUSH/PUSH_EL/SET_EXP ending with SET, the shims of the run are
+ *	encoded once here and attached to its first instruction.
+ *	mpls_finish_output() then pushes the whole stack at once and only
+ *	patches TTL, S bit and the EXP of a packet remarked on the way in.
+ *	Any other program is left to the opcode interpreter.
+ **/
+
+static void mpls_instrs_compile(struct mpls_instr *instr)
+{
+	struct mpls_instr *mi, *first = NULL;
+	struct mpls_push_tmpl *pt;
+	struct mpls_label *ml;
+	unsigned int count = 0, i;
+	u32 exp = 0;
+
+	for_each_instr(instr, mi) {
+		switch (mi->mi_opcode) {
+		case MPLS_OP_POP:
+		case MPLS_OP_SWAP:
+			break;
+		case MPLS_OP_POLICE:
+			/* the template would skip it, or lose its remark */
+			if (first || _mpls_as_pi(mi->mi_data)->pi_conf.mp_action
+					!= MPLS_POLICE_DROP)
+				return;
+			break;
+		case MPLS_OP_PUSH_EL:
+			count++;
+			/* fall through */
+		case MPLS_OP_PUSH:
+			count++;
+			/* fall through */
+		case MPLS_OP_SET_EXP:
+			if (!first)
+				first = mi;
+			break;
+		case MPLS_OP_SET:
+			goto compile;
+		default:
+			return;
+		}
+	}
+	return;
+
+compile:
+	if (!count)
+		return;
+
+	pt = kmalloc(sizeof(*pt) + count * sizeof(__be32), GFP_KERNEL);
+	if (unlikely(!pt))
+		return;
+
+	pt->pt_refcnt = 1;
+	pt->pt_count = count;
+	pt->pt_el = -1;
+	/*
+	 * Like mpls_op_push(), the first PUSH takes the remarked EXP unless
+	 * a SET_EXP or PUSH_EL ran before it.
+	 */
+	pt->pt_exp = first->mi_opcode == MPLS_OP_PUSH ? count - 1 : -1;
+	/* the first PUSH ends up at the bottom of the stack */
+	i = count;
+	for (mi = first; mi->mi_opcode != MPLS_OP_SET; mi = mi->mi_next) {
+		if (mi->mi_opcode == MPLS_OP_SET_EXP) {
+			exp = *(unsigned char *)mi->mi_data & 0x7;
+			continue;
+		}
+		if (mi->mi_opcode == MPLS_OP_PUSH_EL) {
+			/* the EL itself is filled in per packet */
+			pt->pt_shim[--i] = 0;
+			pt->pt_el = i;
+			pt->pt_shim[--i] = htonl(MPLS_ENTROPY_LABEL_IND << 12);
+			pt->pt_label = MPLS_ENTROPY_LABEL_IND;
+			continue;
+		}
+		ml = mi->mi_data;
+		pt->pt_shim[--i] = htonl(((ml->u.ml_gen & 0xFFFFF) << 12) |
+				(exp << 9));
+		pt->pt_label = ml->u.ml_gen;
+		exp = 0;
+	}
+	first->mi_tmpl = mpls_push_tmpl_get(pt);
+	first->mi_tmpl_set = mi;
+	MPLS_DEBUG("precompiled %u shims\n", count);
+}
+
+/**
+ *	__mpls_instrs_build - build up an instruction set.
  *	@mie:	 Instruction Element array
  *	@instr:       Instruction list [OUT]
  *	@length:      Number of valid entries in the array
@@ -107,10 +368,11 @@ void mpls_instrs_free(struct mpls_instr *list)
  *	opcodes to execute with the corresponding data for a given ILM/NHLFE
  *	object.
  *
- *	Returns the number of valid entries.
+ *	Returns the number of valid entries. The layer 3 caches are not
+ *	flushed, that is left to the caller.
  **/
 
-int mpls_instrs_build(struct mpls_instr_elem *mie,
+int __mpls_instrs_build(struct mpls_instr_elem *mie,
 		struct mpls_instr **instr, int length,
 		enum mpls_dir dir, void *parent)
 {
@@ -140,18 +402,20 @@ int mpls_instrs_build(struct mpls_instr_elem *mie,
 		opcode  = mie[i].mir_opcode;
 		if (push_is_next == 1 && opcode != MPLS_OP_PUSH) {
 			printk(KERN_ERR "MPLS: set_exp or tc2exp or ds2exp"
-					" or nf2exp must be folowed by push\n");
+					" or nf2exp or push_el must be folowed"
+					" by push\n");
 			goto rollback;
 		} else
 			push_is_next = 0;
 			
-		if (opcode == MPLS_OP_PUSH)
+		if (opcode == MPLS_OP_PUSH || opcode == MPLS_OP_PUSH_EL)
 			push = 1;
 		
 		if (opcode == MPLS_OP_POP)
 			pop = 1;
 		
-		if (push && (opcode == MPLS_OP_POP || opcode == MPLS_OP_PEEK)) {
+		if (push && (opcode == MPLS_OP_POP || opcode == MPLS_OP_PEEK ||
+				opcode == MPLS_OP_SWAP)) {
 			printk(KERN_ERR "MPLS: %s isn't allowed after"
 					" push\n", mpls_ops[opcode].msg);
 			goto rollback;
@@ -169,7 +433,8 @@ int mpls_instrs_build(struct mpls_instr_elem *mie,
 		if (opcode == MPLS_OP_SET_EXP ||
 			opcode == MPLS_OP_TC2EXP ||
 			opcode == MPLS_OP_DS2EXP ||
-			opcode == MPLS_OP_NF2EXP)
+			opcode == MPLS_OP_NF2EXP ||
+			opcode == MPLS_OP_PUSH_EL)
 			push_is_next = 1;
 
 		ops_counter[opcode]++;
@@ -201,7 +466,7 @@ int mpls_instrs_build(struct mpls_instr_elem *mie,
 		if (unlikely(!mi))
 			goto rollback;
 
-		data = NULL;
+		data = &mi->mi_inline;
 		*pmi = mi;
 
 		/* Build the opcode.
@@ -226,11 +491,9 @@ int mpls_instrs_build(struct mpls_instr_elem *mie,
 
 	BUG_ON(!(*instr));
 
-	/*
-	 * it is possible that the MTU of a NHLFE may have changed.
-	 * to be paranoid, flush the layer 3 caches
-	 */
-	mpls_proto_cache_flush_all(&init_net);
+	if (dir == MPLS_OUT)
+		mpls_instrs_compile(*instr);
+
 	MPLS_EXIT;
 	return i;
 
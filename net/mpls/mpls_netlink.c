@@ -27,12 +27,14 @@
 #include <linux/netlink.h>
 #include <net/genetlink.h>
 #include <net/net_namespace.h>
+#include <linux/vmalloc.h>
 
 static struct genl_family genl_mpls = {
 	.id = GENL_ID_GENERATE,
 	.name = MPLS_NETLINK_NAME,
 	.version = 0x2,
 	.maxattr = MPLS_ATTR_MAX,
+	.netnsok = true,
 };
 
 /*Netlink multicast groups*/
@@ -52,6 +54,23 @@ static struct genl_multicast_group genl_mpls_get_mcast_grp = {
 		.name = MPLS_GRP_GET_NAME,
 };
 
+static struct nla_policy genl_mpls_policy[MPLS_ATTR_MAX+1] __read_mostly = {
+	[MPLS_ATTR_ILM] = { .len = sizeof(struct mpls_in_label_req) },
+	[MPLS_ATTR_NHLFE] = { .len = sizeof(struct mpls_out_label_req) },
+	[MPLS_ATTR_XC] = { .len = sizeof(struct mpls_xconnect_req) },
+	[MPLS_ATTR_LABELSPACE] = {.len = sizeof(struct mpls_labelspace_req)},
+	[MPLS_ATTR_INSTR] = { .len = sizeof(struct mpls_instr_req) },
+	[MPLS_ATTR_STATS] = { .len = sizeof(struct mpls_stats) },
+	[MPLS_ATTR_BULK] = { .len = sizeof(struct mpls_bulk_req) },
+	[MPLS_ATTR_BULK_NHLFE] = { .type = NLA_NESTED },
+	[MPLS_ATTR_BULK_ILM] = { .type = NLA_NESTED },
+	[MPLS_ATTR_BULK_XC] = { .type = NLA_NESTED },
+	[MPLS_ATTR_FILTER] = { .len = sizeof(struct mpls_dump_filter) },
+	[MPLS_ATTR_BACKUP] = { .type = NLA_U32 },
+	[MPLS_ATTR_BACKUP_ACTIVE] = { .type = NLA_FLAG },
+	[MPLS_ATTR_POLICE] = { .len = sizeof(struct mpls_police_stats) },
+};
+
 /* ILM netlink support */
 
 static int mpls_fill_ilm(struct sk_buff *skb, struct mpls_ilm *ilm,
@@ -59,6 +78,8 @@ static int mpls_fill_ilm(struct sk_buff *skb, struct mpls_ilm *ilm,
 {
 	struct mpls_in_label_req mil;
 	struct mpls_instr_req *instr;
+	struct mpls_stats stats;
+	struct mpls_police_stats police;
 	int no_instr = 0;
 	void *hdr;
 
@@ -86,6 +107,10 @@ static int mpls_fill_ilm(struct sk_buff *skb, struct mpls_ilm *ilm,
 	NLA_PUT(skb, MPLS_ATTR_INSTR, sizeof(*instr) +
 		instr->mir_instr_length *
 		sizeof(struct mpls_instr_elem), instr);
+	mpls_lsp_stats_fold(&stats, ilm->ilm_stats);
+	NLA_PUT(skb, MPLS_ATTR_STATS, sizeof(stats), &stats);
+	if (mpls_police_stats_fold(&police, ilm->ilm_instr))
+		NLA_PUT(skb, MPLS_ATTR_POLICE, sizeof(police), &police);
 
 	kfree(instr);
 
@@ -133,7 +158,8 @@ int mpls_ilm_event(char *grp_name, int event,
 		MPLS_EXIT;
 		return err;
 	}
-	/*err =*/genlmsg_multicast(skb, 0, group, GFP_KERNEL);
+	/*err =*/genlmsg_multicast_netns(mpls_ilm_net(ilm), skb, 0, group,
+		GFP_KERNEL);
 	err = 0;
 	MPLS_EXIT;
 	return err;
@@ -141,9 +167,10 @@ int mpls_ilm_event(char *grp_name, int event,
 
 /**
  * mpls_dump_ilm_event - Dumps ilm with all informations
+ * @net: namespace of the ILM
  * @out: request
  **/
-static int mpls_dump_ilm_event(
+static int mpls_dump_ilm_event(struct net *net,
 	const struct mpls_in_label_req *in,
 	int seq, int pid)
 {
@@ -157,7 +184,7 @@ static int mpls_dump_ilm_event(
 	/* Obtain key */
 	key = mpls_label2key(ml->ml_labelspace, ml);
 
-	ilm = mpls_get_ilm(key);
+	ilm = mpls_get_ilm(net, key);
 
 	if (unlikely(!ilm)) {
 		MPLS_DEBUG("Node %u was not in tree\n", key);
@@ -178,6 +205,7 @@ static int mpls_dump_ilm_event(
 static int genl_mpls_ilm_new(struct sk_buff *skb,
 	struct genl_info *info)
 {
+	struct net *net = genl_info_net(info);
 	struct mpls_in_label_req *mil;
 	struct mpls_instr_req *instr = NULL;
 	struct mpls_ilm *ilm;
@@ -198,7 +226,7 @@ static int genl_mpls_ilm_new(struct sk_buff *skb,
 	mil = nla_data(info->attrs[MPLS_ATTR_ILM]);
 
 	if (info->nlhdr->nlmsg_flags & NLM_F_CREATE) {
-		ilm = mpls_add_in_label(mil);
+		ilm = mpls_add_in_label(net, mil);
 		if (IS_ERR(ilm)) {
 			MPLS_EXIT;
 			return PTR_ERR(ilm);
@@ -206,12 +234,12 @@ static int genl_mpls_ilm_new(struct sk_buff *skb,
 	}
 
 	if (instr && mil->mil_change_flag&MPLS_CHANGE_INSTR)
-		retval = mpls_ilm_set_instrs(mil, instr->mir_instr,
+		retval = mpls_ilm_set_instrs(net, mil, instr->mir_instr,
 			instr->mir_instr_length);
 		/* JLEU: should revert to old instr on failure */
 
 	if (!retval)
-		mpls_dump_ilm_event(mil, info->snd_seq, info->snd_pid);
+		mpls_dump_ilm_event(net, mil, info->snd_seq, info->snd_pid);
 	else {
 		/*IMAR:
 		 *	If user can't initialy set ilm with
@@ -222,7 +250,7 @@ static int genl_mpls_ilm_new(struct sk_buff *skb,
 		 *	won't be deleted!
 		 */
 		if (info->nlhdr->nlmsg_flags & NLM_F_CREATE)
-			mpls_del_in_label(mil, 0, 0);
+			mpls_del_in_label(net, mil, 0, 0);
 	}
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
@@ -242,7 +270,8 @@ static int genl_mpls_ilm_del(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	mil = nla_data(info->attrs[MPLS_ATTR_ILM]);
-	retval = mpls_del_in_label(mil, info->snd_seq, info->snd_pid);
+	retval = mpls_del_in_label(genl_info_net(info), mil, info->snd_seq,
+		info->snd_pid);
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
 	return retval;
@@ -264,7 +293,7 @@ static int genl_mpls_ilm_get(struct sk_buff *skb, struct genl_info *info)
 	if (mil->mil_label.ml_type == MPLS_LABEL_KEY)
 		goto err;
 
-	ilm = mpls_get_ilm_label(mil);
+	ilm = mpls_get_ilm_label(genl_info_net(info), mil);
 	if (!ilm) {
 		retval = -ESRCH;
 		goto err;
@@ -280,30 +309,104 @@ err:
 	return retval;
 }
 
+/* Dumps resume from cb->args[0] (table) and cb->args[1] (key) */
+static inline void mpls_dump_pos_load(struct netlink_callback *cb,
+	struct mpls_dump_pos *pos)
+{
+	pos->table = cb->args[0];
+	pos->key = cb->args[1];
+}
+
+static inline void mpls_dump_pos_save(struct netlink_callback *cb,
+	struct mpls_dump_pos *pos)
+{
+	cb->args[0] = pos->table;
+	cb->args[1] = pos->key;
+}
+
+static void mpls_dump_filter_get(struct netlink_callback *cb,
+	struct mpls_dump_filter *f)
+{
+	struct nlattr *tb[MPLS_ATTR_MAX + 1];
+
+	f->mdf_labelspace = -1;
+	f->mdf_ifindex = 0;
+	f->mdf_owner = RTPROT_UNSPEC;
+
+	if (nlmsg_parse(cb->nlh, GENL_HDRLEN, tb, MPLS_ATTR_MAX,
+			genl_mpls_policy) < 0 || !tb[MPLS_ATTR_FILTER])
+		return;
+	memcpy(f, nla_data(tb[MPLS_ATTR_FILTER]), sizeof(*f));
+}
+
+/* NHLFE an ILM forwards to, if any */
+static struct mpls_nhlfe *mpls_ilm_fwd_nhlfe(struct mpls_ilm *ilm)
+{
+	struct mpls_instr *mi;
+
+	if (!ilm->ilm_instr)
+		return NULL;
+	/* Fetch the last instr, make sure it is FWD */
+	mi = mpls_instr_getlast(ilm->ilm_instr);
+	if (mi->mi_opcode != MPLS_OP_FWD)
+		return NULL;
+	return mi->mi_data;
+}
+
+static int mpls_nhlfe_match(struct mpls_nhlfe *nhlfe,
+	struct mpls_dump_filter *f)
+{
+	if (f->mdf_owner != RTPROT_UNSPEC && f->mdf_owner != nhlfe->nhlfe_owner)
+		return 0;
+	if (f->mdf_ifindex && (!nhlfe->dst.dev ||
+		nhlfe->dst.dev->ifindex != f->mdf_ifindex))
+		return 0;
+	return 1;
+}
+
+static int mpls_ilm_match(struct mpls_ilm *ilm, struct mpls_dump_filter *f)
+{
+	struct mpls_nhlfe *nhlfe;
+
+	if (f->mdf_owner != RTPROT_UNSPEC && f->mdf_owner != ilm->ilm_owner)
+		return 0;
+	if (f->mdf_ifindex) {
+		nhlfe = mpls_ilm_fwd_nhlfe(ilm);
+		if (!nhlfe || !nhlfe->dst.dev ||
+			nhlfe->dst.dev->ifindex != f->mdf_ifindex)
+			return 0;
+	}
+	return 1;
+}
+
 static int genl_mpls_ilm_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
+	struct net *net = sock_net(skb->sk);
+	struct mpls_dump_filter filter;
+	struct mpls_dump_pos pos, last;
 	struct mpls_ilm *ilm;
-	int entries_to_skip = cb->args[0];
-	int entry_count = 0;
 	MPLS_ENTER;
 
-	MPLS_DEBUG("Enter: entry %d\n", entries_to_skip);
-	rcu_read_lock();
-	list_for_each_entry_rcu(ilm, &mpls_ilm_list, global) {
-		MPLS_DEBUG("Dump: entry %d\n", entry_count);
-		if (entry_count >= entries_to_skip) {
-			if (mpls_fill_ilm(skb, ilm, NETLINK_CB(cb->skb).pid,
-				cb->nlh->nlmsg_seq, NLM_F_MULTI,
-				MPLS_CMD_NEWILM) < 0) {
-				break;
-			}
+	mpls_dump_filter_get(cb, &filter);
+	mpls_dump_pos_load(cb, &pos);
+	MPLS_DEBUG("Enter: table %u key %u\n", pos.table, pos.key);
+	rcu_read_lock_bh();
+	for (last = pos; (ilm = mpls_ilm_dump_next(net, &pos,
+			filter.mdf_labelspace)); last = pos) {
+		if (!mpls_ilm_match(ilm, &filter))
+			continue;
+		if (mpls_fill_ilm(skb, ilm, NETLINK_CB(cb->skb).pid,
+			cb->nlh->nlmsg_seq, NLM_F_MULTI,
+			MPLS_CMD_NEWILM) < 0) {
+			/* resume with this one */
+			pos = last;
+			break;
 		}
-		entry_count++;
 	}
-	rcu_read_unlock();
-	cb->args[0] = entry_count;
+	rcu_read_unlock_bh();
+	mpls_dump_pos_save(cb, &pos);
 
-	MPLS_DEBUG("Exit: entry %d\n", entry_count);
+	MPLS_DEBUG("Exit: table %u key %u\n", pos.table, pos.key);
 	MPLS_EXIT;
 	return skb->len;
 }
@@ -316,6 +419,9 @@ static int mpls_fill_nhlfe(struct sk_buff *skb,
 {
 	struct mpls_out_label_req mol;
 	struct mpls_instr_req *instr;
+	struct mpls_nhlfe *backup;
+	struct mpls_stats stats;
+	struct mpls_police_stats police;
 	int no_instr = 0; /*number of instructions*/
 	void *hdr;
 
@@ -346,6 +452,15 @@ static int mpls_fill_nhlfe(struct sk_buff *skb,
 	NLA_PUT(skb, MPLS_ATTR_INSTR,
 		sizeof(*instr) + instr->mir_instr_length *
 		sizeof(struct mpls_instr_elem), instr);
+	mpls_lsp_stats_fold(&stats, nhlfe->nhlfe_stats);
+	NLA_PUT(skb, MPLS_ATTR_STATS, sizeof(stats), &stats);
+	if (mpls_police_stats_fold(&police, nhlfe->nhlfe_instr))
+		NLA_PUT(skb, MPLS_ATTR_POLICE, sizeof(police), &police);
+	backup = rcu_dereference_raw(nhlfe->nhlfe_backup);
+	if (backup)
+		NLA_PUT_U32(skb, MPLS_ATTR_BACKUP, backup->nhlfe_key);
+	if (nhlfe->nhlfe_frr)
+		NLA_PUT_FLAG(skb, MPLS_ATTR_BACKUP_ACTIVE);
 
 	kfree(instr);
 
@@ -393,7 +508,8 @@ int mpls_nhlfe_event(char *grp_name, int event,
 		MPLS_EXIT;
 		return err;
 	}
-	/*err = */genlmsg_multicast(skb, 0, group, GFP_KERNEL);
+	/*err = */genlmsg_multicast_netns(mpls_nhlfe_net(nhlfe), skb, 0, group,
+		GFP_KERNEL);
 	err = 0;
 	MPLS_EXIT;
 	return err;
@@ -401,17 +517,18 @@ int mpls_nhlfe_event(char *grp_name, int event,
 
 /**
  * mpls_dump_nhlfe_event - Dumps nhlfe with all informations
+ * @net: namespace of the NHLFE
  * @out: request
  **/
-static int mpls_dump_nhlfe_event(struct mpls_out_label_req *out,
-		int seq, int pid)
+static int mpls_dump_nhlfe_event(struct net *net,
+		struct mpls_out_label_req *out, int seq, int pid)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	unsigned int key;
 	int retval = 0;
 
 	key = mpls_label2key(0, &out->mol_label);
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(net, key);
 
 	if (unlikely(!nhlfe)) {
 		MPLS_DEBUG("Node %u was not in tree\n", key);
@@ -430,6 +547,7 @@ static int mpls_dump_nhlfe_event(struct mpls_out_label_req *out,
 
 static int genl_mpls_nhlfe_new(struct sk_buff *skb, struct genl_info *info)
 {
+	struct net *net = genl_info_net(info);
 	struct mpls_out_label_req *mol;
 	struct mpls_instr_req *instr = NULL;
 	struct mpls_nhlfe *nhlfe;
@@ -455,7 +573,7 @@ static int genl_mpls_nhlfe_new(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	if (info->nlhdr->nlmsg_flags&NLM_F_CREATE) {
-		nhlfe = mpls_add_out_label(mol);
+		nhlfe = mpls_add_out_label(net, mol);
 		if (IS_ERR(nhlfe)) {
 			MPLS_EXIT;
 			return PTR_ERR(nhlfe);
@@ -463,19 +581,27 @@ static int genl_mpls_nhlfe_new(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	if (instr && mol->mol_change_flag & MPLS_CHANGE_INSTR) {
-		retval = mpls_nhlfe_set_instrs(mol,
+		retval = mpls_nhlfe_set_instrs(net, mol,
 			instr->mir_instr, instr->mir_instr_length);
 		/* JLEU: should revert to old instr on failure */
 	}
 
 	if ((!retval) &&  mol->mol_change_flag & MPLS_CHANGE_MTU)
-		retval = mpls_set_out_label_mtu(mol);
+		retval = mpls_set_out_label_mtu(net, mol);
 
 	if ((!retval) && mol->mol_change_flag & MPLS_CHANGE_PROP_TTL)
-		retval = mpls_set_out_label_propagate_ttl(mol);
+		retval = mpls_set_out_label_propagate_ttl(net, mol);
+
+	if ((!retval) && mol->mol_change_flag & MPLS_CHANGE_BACKUP) {
+		if (info->attrs[MPLS_ATTR_BACKUP])
+			retval = mpls_set_out_label_backup(net, mol,
+				nla_get_u32(info->attrs[MPLS_ATTR_BACKUP]));
+		else
+			retval = -EINVAL;
+	}
 
 	if (!retval) {
-		mpls_dump_nhlfe_event(mol,
+		mpls_dump_nhlfe_event(net, mol,
 			info->snd_seq, info->snd_pid);
 	} else {
 		/*IMAR:
@@ -488,7 +614,7 @@ static int genl_mpls_nhlfe_new(struct sk_buff *skb, struct genl_info *info)
 		 *	the nhlfe entry won't be deleted!
 		*/
 		if (info->nlhdr->nlmsg_flags&NLM_F_CREATE)
-			mpls_del_out_label(mol, 0, 0);
+			mpls_del_out_label(net, mol, 0, 0);
 	}
 
 	MPLS_DEBUG("Exit: %d\n", retval);
@@ -508,7 +634,8 @@ static int genl_mpls_nhlfe_del(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	mol = nla_data(info->attrs[MPLS_ATTR_NHLFE]);
-	retval = mpls_del_out_label(mol, info->snd_seq, info->snd_pid);
+	retval = mpls_del_out_label(genl_info_net(info), mol, info->snd_seq,
+		info->snd_pid);
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
 	return retval;
@@ -530,7 +657,7 @@ static int genl_mpls_nhlfe_get(struct sk_buff *skb, struct genl_info *info)
 	if (mol->mol_label.ml_type != MPLS_LABEL_KEY)
 		goto err;
 
-	nhlfe = mpls_get_nhlfe_label(mol);
+	nhlfe = mpls_get_nhlfe_label(genl_info_net(info), mol);
 	if (!nhlfe) {
 		retval = -ESRCH;
 	} else {
@@ -548,31 +675,32 @@ err:
 static int genl_mpls_nhlfe_dump(struct sk_buff *skb,
 		struct netlink_callback *cb)
 {
+	struct net *net = sock_net(skb->sk);
+	struct mpls_dump_filter filter;
+	struct mpls_dump_pos pos, last;
 	struct mpls_nhlfe *nhlfe;
-	int entries_to_skip;
-	int entry_count;
 	MPLS_ENTER;
 
-	entries_to_skip = cb->args[0];
-	entry_count = 0;
-
-	MPLS_DEBUG("Enter: entry %d\n", entries_to_skip);
-	rcu_read_lock();
-	list_for_each_entry_rcu(nhlfe, &mpls_nhlfe_list, global) {
-		MPLS_DEBUG("Dump: entry %d\n", entry_count);
-		if (entry_count >= entries_to_skip) {
-			if (mpls_fill_nhlfe(skb, nhlfe, NETLINK_CB(cb->skb).pid,
-				cb->nlh->nlmsg_seq, NLM_F_MULTI,
-				MPLS_CMD_NEWNHLFE) <= 0) {
-				break;
-			}
+	mpls_dump_filter_get(cb, &filter);
+	mpls_dump_pos_load(cb, &pos);
+	MPLS_DEBUG("Enter: key %u\n", pos.key);
+	rcu_read_lock_bh();
+	for (last = pos; (nhlfe = mpls_nhlfe_dump_next(net, &pos));
+			last = pos) {
+		if (!mpls_nhlfe_match(nhlfe, &filter))
+			continue;
+		if (mpls_fill_nhlfe(skb, nhlfe, NETLINK_CB(cb->skb).pid,
+			cb->nlh->nlmsg_seq, NLM_F_MULTI,
+			MPLS_CMD_NEWNHLFE) <= 0) {
+			/* resume with this one */
+			pos = last;
+			break;
 		}
-		entry_count++;
 	}
-	rcu_read_unlock();
-	cb->args[0] = entry_count;
+	rcu_read_unlock_bh();
+	mpls_dump_pos_save(cb, &pos);
 
-	MPLS_DEBUG("Exit: entry %d\n", entry_count);
+	MPLS_DEBUG("Exit: key %u\n", pos.key);
 	MPLS_EXIT;
 	return skb->len;
 }
@@ -645,7 +773,8 @@ int mpls_xc_event(char *grp_name, int event,
 		MPLS_EXIT;
 		return err;
 	}
-	/*err = */genlmsg_multicast(skb, 0, group, GFP_KERNEL);
+	/*err = */genlmsg_multicast_netns(mpls_ilm_net(ilm), skb, 0, group,
+		GFP_KERNEL);
 	err = 0;
 	MPLS_EXIT;
 	return err;
@@ -665,7 +794,7 @@ static int genl_mpls_xc_new(struct sk_buff *skb, struct genl_info *info)
 
 	xc = nla_data(info->attrs[MPLS_ATTR_XC]);
 
-	retval = mpls_attach_in2out(xc,
+	retval = mpls_attach_in2out(genl_info_net(info), xc,
 		info->snd_seq, info->snd_pid);
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
@@ -684,7 +813,7 @@ static int genl_mpls_xc_del(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	xc = nla_data(info->attrs[MPLS_ATTR_XC]);
-	retval = mpls_detach_in2out(xc,
+	retval = mpls_detach_in2out(genl_info_net(info), xc,
 		info->snd_seq, info->snd_pid);
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
@@ -709,8 +838,8 @@ static int genl_mpls_xc_get(struct sk_buff *skb, struct genl_info *info)
 	if (xc->mx_in.ml_type == MPLS_LABEL_KEY)
 		goto err;
 
-	ilm = mpls_get_ilm(mpls_label2key(xc->mx_in.ml_labelspace,
-			&xc->mx_in));
+	ilm = mpls_get_ilm(genl_info_net(info),
+		mpls_label2key(xc->mx_in.ml_labelspace, &xc->mx_in));
 	if (!ilm) {
 		retval = -ESRCH;
 	} else {
@@ -736,41 +865,36 @@ err:
 
 static int genl_mpls_xc_dump(struct sk_buff *skb, struct netlink_callback *cb)
 {
+	struct net *net = sock_net(skb->sk);
+	struct mpls_dump_filter filter;
+	struct mpls_dump_pos pos, last;
 	struct mpls_ilm *ilm;
 	struct mpls_nhlfe *nhlfe;
-	struct mpls_instr *mi;
-	int entries_to_skip;
-	int entry_count;
 	MPLS_ENTER;
 
-	entries_to_skip = cb->args[0];
-	entry_count = 0;
-
-	MPLS_DEBUG("Enter: entry %d\n", entries_to_skip);
-	rcu_read_lock();
-	list_for_each_entry_rcu(ilm, &mpls_ilm_list, global) {
-		MPLS_DEBUG("Dump: entry %d\n", entry_count);
-		if (entry_count >= entries_to_skip) {
-			/* Fetch the last instr, make sure it is FWD */
-			mi = mpls_instr_getlast(ilm->ilm_instr);
-
-			if (!mi || mi->mi_opcode != MPLS_OP_FWD)
-				continue;
-
-			nhlfe = mi->mi_data;
-
-			if (mpls_fill_xc(skb, ilm, nhlfe,
-					NETLINK_CB(cb->skb).pid,
-					cb->nlh->nlmsg_seq,
-					NLM_F_MULTI, MPLS_CMD_NEWXC) < 0)
-				break;
+	mpls_dump_filter_get(cb, &filter);
+	mpls_dump_pos_load(cb, &pos);
+	MPLS_DEBUG("Enter: table %u key %u\n", pos.table, pos.key);
+	rcu_read_lock_bh();
+	for (last = pos; (ilm = mpls_ilm_dump_next(net, &pos,
+			filter.mdf_labelspace)); last = pos) {
+		nhlfe = mpls_ilm_fwd_nhlfe(ilm);
+		if (!nhlfe || !mpls_ilm_match(ilm, &filter))
+			continue;
+
+		if (mpls_fill_xc(skb, ilm, nhlfe,
+				NETLINK_CB(cb->skb).pid,
+				cb->nlh->nlmsg_seq,
+				NLM_F_MULTI, MPLS_CMD_NEWXC) < 0) {
+			/* resume with this one */
+			pos = last;
+			break;
 		}
-		entry_count++;
 	}
-	rcu_read_unlock();
-	cb->args[0] = entry_count;
+	rcu_read_unlock_bh();
+	mpls_dump_pos_save(cb, &pos);
 
-	MPLS_DEBUG("Exit: entry %d\n", entry_count);
+	MPLS_DEBUG("Exit: table %u key %u\n", pos.table, pos.key);
 	MPLS_EXIT;
 	return skb->len;
 
@@ -844,7 +968,8 @@ int mpls_labelspace_event(char *grp_name,
 		MPLS_EXIT;
 		return err;
 	}
-	/*err = */genlmsg_multicast(skb, 0, group, GFP_KERNEL);
+	/*err = */genlmsg_multicast_netns(dev_net(dev), skb, 0, group,
+		GFP_KERNEL);
 	err = 0;
 	MPLS_EXIT;
 	return err;
@@ -861,7 +986,7 @@ static int genl_mpls_labelspace_set(struct sk_buff *skb, struct genl_info *info)
 		return -EINVAL;
 	}
 	ls = nla_data(info->attrs[MPLS_ATTR_LABELSPACE]);
-	retval = mpls_set_labelspace(ls,
+	retval = mpls_set_labelspace(genl_info_net(info), ls,
 		info->snd_seq, info->snd_pid);
 	MPLS_DEBUG("Exit: %d\n", retval);
 	MPLS_EXIT;
@@ -879,7 +1004,7 @@ static int genl_mpls_labelspace_get(struct sk_buff *skb, struct genl_info *info)
 		goto err;
 
 	ls = nla_data(info->attrs[MPLS_ATTR_LABELSPACE]);
-	dev = dev_get_by_index(&init_net, ls->mls_ifindex);
+	dev = dev_get_by_index(genl_info_net(info), ls->mls_ifindex);
 	if (!dev) {
 		retval = -ESRCH;
 	} else {
@@ -907,7 +1032,7 @@ static int genl_mpls_labelspace_dump(struct sk_buff *skb,
 
 	MPLS_DEBUG("Enter: entry %d\n", entries_to_skip);
 	read_lock(&dev_base_lock);
-	for_each_netdev(&init_net, dev) {
+	for_each_netdev(sock_net(skb->sk), dev) {
 		MPLS_DEBUG("Dump: entry %d\n", entry_count);
 		if (entry_count >= entries_to_skip) {
 			if (mpls_fill_labelspace(skb, dev,
@@ -926,13 +1051,280 @@ static int genl_mpls_labelspace_dump(struct sk_buff *skb,
 	return skb->len;
 }
 
-static struct nla_policy genl_mpls_policy[MPLS_ATTR_MAX+1] __read_mostly = {
-	[MPLS_ATTR_ILM] = { .len = sizeof(struct mpls_in_label_req) },
-	[MPLS_ATTR_NHLFE] = { .len = sizeof(struct mpls_out_label_req) },
-	[MPLS_ATTR_XC] = { .len = sizeof(struct mpls_xconnect_req) },
-	[MPLS_ATTR_LABELSPACE] = {.len = sizeof(struct mpls_labelspace_req)},
-	[MPLS_ATTR_INSTR] = { .len = sizeof(struct mpls_instr_req) },
-};
+/* BULK netlink support */
+
+static int mpls_fill_bulk(struct sk_buff *skb, struct mpls_bulk_req *mb,
+	u32 pid, u32 seq, int flag, int event)
+{
+	void *hdr;
+
+	MPLS_ENTER;
+	hdr = genlmsg_put(skb, pid, seq, &genl_mpls, flag, event);
+	if (IS_ERR(hdr)) {
+		MPLS_EXIT;
+		return PTR_ERR(hdr);
+	}
+
+	NLA_PUT(skb, MPLS_ATTR_BULK, sizeof(*mb), mb);
+
+	MPLS_EXIT;
+	return genlmsg_end(skb, hdr);
+
+nla_put_failure:
+	genlmsg_cancel(skb, hdr);
+	MPLS_DEBUG("Exit: -1\n");
+	MPLS_EXIT;
+	return -ENOMEM;
+}
+
+/**
+ * mpls_bulk_event - Notify a batch, once per table that changed
+ * @net: namespace of the tables
+ * @mb: number of objects programmed per table
+ **/
+static int mpls_bulk_event(struct net *net, struct mpls_bulk_req *mb,
+	int seq, int pid)
+{
+	unsigned int group[3];
+	struct sk_buff *skb;
+	int n = 0, i, err;
+
+	MPLS_ENTER;
+	if (mb->mb_nhlfe)
+		group[n++] = genl_mpls_nhlfe_mcast_grp.id;
+	if (mb->mb_ilm)
+		group[n++] = genl_mpls_ilm_mcast_grp.id;
+	if (mb->mb_xc)
+		group[n++] = genl_mpls_xc_mcast_grp.id;
+
+	for (i = 0; i < n; i++) {
+		skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+		if (!skb) {
+			MPLS_EXIT;
+			return -ENOMEM;
+		}
+
+		err = mpls_fill_bulk(skb, mb, pid, seq, 0, MPLS_CMD_BULK);
+		if (err < 0) {
+			nlmsg_free(skb);
+			MPLS_EXIT;
+			return err;
+		}
+		genlmsg_multicast_netns(net, skb, 0, group[i], GFP_KERNEL);
+	}
+	MPLS_EXIT;
+	return 0;
+}
+
+static int mpls_bulk_count(struct nlattr *list)
+{
+	struct nlattr *entry;
+	int rem, count = 0;
+
+	if (!list)
+		return 0;
+	nla_for_each_nested(entry, list, rem)
+		count++;
+	return count;
+}
+
+static void *mpls_bulk_alloc(int count, size_t size)
+{
+	size_t len = count * size;
+
+	if (len <= PAGE_SIZE)
+		return kzalloc(len, GFP_KERNEL);
+	return vzalloc(len);
+}
+
+static void mpls_bulk_free(void *p)
+{
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+/*
+ * Parse one element of a MPLS_ATTR_BULK_* list, the object attribute
+ * (type) is mandatory. The returned instructions are length checked.
+ */
+static int mpls_bulk_parse(struct nlattr *entry, int type, void **req,
+	struct mpls_instr_req **instr)
+{
+	struct nlattr *tb[MPLS_ATTR_MAX + 1];
+	int err;
+
+	err = nla_parse_nested(tb, MPLS_ATTR_MAX, entry, genl_mpls_policy);
+	if (err < 0)
+		return err;
+
+	if (!tb[type])
+		return -EINVAL;
+	*req = nla_data(tb[type]);
+
+	if (!instr)
+		return 0;
+
+	if (!tb[MPLS_ATTR_INSTR])
+		return -EINVAL;
+	*instr = nla_data(tb[MPLS_ATTR_INSTR]);
+	if (nla_len(tb[MPLS_ATTR_INSTR]) < sizeof(**instr) +
+		(*instr)->mir_instr_length * sizeof(struct mpls_instr_elem))
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * genl_mpls_bulk - program NHLFEs, ILMs and XCs of one message.
+ *
+ * Objects are built (and validated) before they are visible, then each
+ * table is published under one acquisition of its lock. The layer 3
+ * caches are flushed once and a single summary event is sent per table.
+ */
+static int genl_mpls_bulk(struct sk_buff *skb, struct genl_info *info)
+{
+	struct net *net = genl_info_net(info);
+	struct nlattr *nhlfe_list = info->attrs[MPLS_ATTR_BULK_NHLFE];
+	struct nlattr *ilm_list = info->attrs[MPLS_ATTR_BULK_ILM];
+	struct nlattr *xc_list = info->attrs[MPLS_ATTR_BULK_XC];
+	struct mpls_bulk_req mb = { 0 };
+	struct mpls_nhlfe **nhlfe = NULL;
+	struct mpls_ilm **ilm = NULL;
+	struct mpls_xc_undo *undo = NULL;
+	struct mpls_instr_req *instr;
+	struct nlattr *entry;
+	void *req;
+	int n_nhlfe, n_ilm, n_xc;
+	int rem, i, retval = 0;
+
+	MPLS_ENTER;
+	n_nhlfe = mpls_bulk_count(nhlfe_list);
+	n_ilm = mpls_bulk_count(ilm_list);
+	n_xc = mpls_bulk_count(xc_list);
+	if (!n_nhlfe && !n_ilm && !n_xc) {
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	if (n_nhlfe) {
+		nhlfe = mpls_bulk_alloc(n_nhlfe, sizeof(*nhlfe));
+		if (!nhlfe) {
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+	if (n_ilm) {
+		ilm = mpls_bulk_alloc(n_ilm, sizeof(*ilm));
+		if (!ilm) {
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+	if (n_xc) {
+		undo = mpls_bulk_alloc(n_xc, sizeof(*undo));
+		if (!undo) {
+			retval = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* NHLFEs first, the ILMs of the batch may FWD to them */
+	i = 0;
+	if (nhlfe_list) {
+		nla_for_each_nested(entry, nhlfe_list, rem) {
+			struct mpls_out_label_req *mol;
+
+			retval = mpls_bulk_parse(entry, MPLS_ATTR_NHLFE,
+				&req, &instr);
+			if (retval)
+				goto err_nhlfe_build;
+			mol = req;
+			if (mol->mol_label.ml_type != MPLS_LABEL_KEY) {
+				retval = -EINVAL;
+				goto err_nhlfe_build;
+			}
+			nhlfe[i] = mpls_nhlfe_build(net, mol, instr->mir_instr,
+				instr->mir_instr_length);
+			if (IS_ERR(nhlfe[i])) {
+				retval = PTR_ERR(nhlfe[i]);
+				goto err_nhlfe_build;
+			}
+			i++;
+		}
+	}
+	retval = mpls_insert_nhlfes(net, nhlfe, n_nhlfe);
+	if (retval)
+		goto err_nhlfe_build;
+
+	i = 0;
+	if (ilm_list) {
+		nla_for_each_nested(entry, ilm_list, rem) {
+			retval = mpls_bulk_parse(entry, MPLS_ATTR_ILM,
+				&req, &instr);
+			if (retval)
+				goto err_ilm_build;
+			ilm[i] = mpls_ilm_build(net, req, instr->mir_instr,
+				instr->mir_instr_length);
+			if (IS_ERR(ilm[i])) {
+				retval = PTR_ERR(ilm[i]);
+				goto err_ilm_build;
+			}
+			i++;
+		}
+	}
+	retval = mpls_insert_ilms(net, ilm, n_ilm);
+	if (retval)
+		goto err_ilm_build;
+
+	/* Crossconnects already applied are reverted on error */
+	if (xc_list) {
+		nla_for_each_nested(entry, xc_list, rem) {
+			retval = mpls_bulk_parse(entry, MPLS_ATTR_XC,
+				&req, NULL);
+			if (!retval)
+				retval = __mpls_attach_in2out(net, req,
+					info->snd_seq, info->snd_pid, 0,
+					&undo[mb.mb_xc]);
+			if (retval)
+				goto err_xc;
+			mb.mb_xc++;
+		}
+	}
+
+	mb.mb_nhlfe = n_nhlfe;
+	mb.mb_ilm = n_ilm;
+	mpls_bulk_event(net, &mb, info->snd_seq, info->snd_pid);
+	goto out;
+
+err_xc:
+	for (i = mb.mb_xc; i > 0; i--)
+		mpls_xc_revert(net, &undo[i - 1]);
+	mpls_del_ilms(net, ilm, n_ilm);
+	i = 0;
+err_ilm_build:
+	while (--i >= 0) {
+		mpls_destroy_ilm_instrs(ilm[i]);
+		mpls_ilm_release(ilm[i]);
+	}
+	mpls_del_nhlfes(net, nhlfe, n_nhlfe);
+	i = 0;
+err_nhlfe_build:
+	while (--i >= 0) {
+		mpls_destroy_nhlfe_instrs(nhlfe[i]);
+		mpls_nhlfe_drop(nhlfe[i]);
+	}
+out:
+	if (undo)
+		mpls_bulk_free(undo);
+	if (ilm)
+		mpls_bulk_free(ilm);
+	if (nhlfe)
+		mpls_bulk_free(nhlfe);
+	MPLS_DEBUG("Exit: %d\n", retval);
+	MPLS_EXIT;
+	return retval;
+}
 
 static struct genl_ops genl_mpls_ilm_new_ops = {
 	.cmd		= MPLS_CMD_NEWILM,
@@ -1004,6 +1396,13 @@ static struct genl_ops genl_mpls_labelspace_get_ops = {
 	.policy		= genl_mpls_policy,
 };
 
+static struct genl_ops genl_mpls_bulk_ops = {
+	.cmd		= MPLS_CMD_BULK,
+	.flags 		= GENL_ADMIN_PERM,
+	.doit		= genl_mpls_bulk,
+	.policy		= genl_mpls_policy,
+};
+
 int __init mpls_netlink_init(void)
 {
 	int err;
@@ -1026,6 +1425,8 @@ int __init mpls_netlink_init(void)
 	err += genl_register_ops(&genl_mpls, &genl_mpls_labelspace_set_ops);
 	err += genl_register_ops(&genl_mpls, &genl_mpls_labelspace_get_ops);
 
+	err += genl_register_ops(&genl_mpls, &genl_mpls_bulk_ops);
+
 	/*register mcast groups*/
 	err += genl_register_mc_group(&genl_mpls, &genl_mpls_ilm_mcast_grp);
 	err += genl_register_mc_group(&genl_mpls, &genl_mpls_nhlfe_mcast_grp);
@@ -1052,6 +1453,8 @@ void mpls_netlink_exit(void)
 	genl_unregister_mc_group(&genl_mpls, &genl_mpls_lspace_mcast_grp);
 	genl_unregister_mc_group(&genl_mpls, &genl_mpls_get_mcast_grp);
 
+	genl_unregister_ops(&genl_mpls, &genl_mpls_bulk_ops);
+
 	genl_unregister_ops(&genl_mpls, &genl_mpls_labelspace_get_ops);
 	genl_unregister_ops(&genl_mpls, &genl_mpls_labelspace_set_ops);
 
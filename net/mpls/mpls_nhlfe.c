@@ -36,17 +36,10 @@
 #include <linux/genetlink.h>
 #include <net/net_namespace.h>
 
-/**
- * mpls_nhlfe_tree: Radix Tree to hold NHLFE objects
- **/
-RADIX_TREE(mpls_nhlfe_tree, GFP_ATOMIC);
-
-/**
- * mpls_nhlfe_lock: lock for tree access.
- **/
-DEFINE_SPINLOCK(mpls_nhlfe_lock);
-
-LIST_HEAD(mpls_nhlfe_list);
+/*
+ * The NHLFE radix tree, list and lock of a namespace live in net->mpls
+ * (cf. mpls_nhlfe_init_net)
+ */
 
 /* forward declarations */
 static struct dst_entry *nhlfe_dst_check(struct dst_entry *dst, u32 cookie);
@@ -76,11 +69,18 @@ static struct dst_ops nhlfe_dst_ops __read_mostly = {
 	.neigh_lookup = nhlfe_dst_neigh_lookup,
 };
 
+/*
+ * A route stacked on the NHLFE (RTA_SHIM) passes the generation it was
+ * bound with: it is stale once the NHLFE changed or got deleted.
+ */
 static struct dst_entry *nhlfe_dst_check(struct dst_entry *dst, u32 cookie)
 {
-	MPLS_ENTER;
-	MPLS_EXIT;
-	return NULL;
+	struct mpls_nhlfe *nhlfe = container_of(dst, struct mpls_nhlfe, dst);
+
+	if (dst->obsolete > 0 ||
+	    cookie != (u32)atomic_read(&nhlfe->nhlfe_genid))
+		return NULL;
+	return dst;
 }
 
 static unsigned int nhlfe_dst_default_advmss(const struct dst_entry *dst)
@@ -121,6 +121,7 @@ static void nhlfe_dst_destroy(struct dst_entry *dst)
 	MPLS_ENTER;
 
 	mpls_proto_release(nhlfe->nhlfe_proto);
+	free_percpu(nhlfe->nhlfe_stats);
 	dst_destroy_metrics_generic(dst);
 	MPLS_EXIT;
 }
@@ -193,7 +194,7 @@ static int nhlfe_dst_gc(struct dst_ops *ops)
  *
  **/
 
-struct mpls_nhlfe *nhlfe_dst_alloc(unsigned int key)
+struct mpls_nhlfe *nhlfe_dst_alloc(struct net *net, unsigned int key)
 {
 	struct mpls_nhlfe *nhlfe;
 
@@ -211,23 +212,69 @@ struct mpls_nhlfe *nhlfe_dst_alloc(unsigned int key)
 	INIT_LIST_HEAD(&nhlfe->list_in);
 	INIT_LIST_HEAD(&nhlfe->dev_entry);
 	INIT_LIST_HEAD(&nhlfe->global);
+	INIT_LIST_HEAD(&nhlfe->list_protected);
+	INIT_LIST_HEAD(&nhlfe->backup_entry);
+	write_pnet(&nhlfe->nhlfe_net, net);
+	RCU_INIT_POINTER(nhlfe->nhlfe_backup, NULL);
+	nhlfe->nhlfe_frr = 0;
 
 	nhlfe->nhlfe_instr = NULL;
 	nhlfe->nhlfe_proto = NULL;
+	atomic_set(&nhlfe->nhlfe_genid, 0);
 	nhlfe->nhlfe_propagate_ttl = 1;
-	nhlfe->nhlfe_age = jiffies;
 	nhlfe->nhlfe_key = key;
 	dst_metric_set(&nhlfe->dst, RTAX_MTU, MPLS_INVALID_MTU);
 	nhlfe->nhlfe_owner = RTPROT_UNSPEC;
 
+	nhlfe->nhlfe_stats = alloc_percpu(struct mpls_lsp_stats);
+	if (unlikely(!nhlfe->nhlfe_stats)) {
+		dst_destroy(&nhlfe->dst);
+		MPLS_EXIT;
+		return NULL;
+	}
+
 	MPLS_EXIT;
 	return nhlfe;
 
 }
 
+/*
+ * Insert a NHLFE, caller holds the NHLFE lock
+ */
+static int __mpls_insert_nhlfe(struct net *net, unsigned int key,
+		struct mpls_nhlfe *nhlfe)
+{
+	int retval;
+
+	retval = radix_tree_insert(&net->mpls.nhlfe_tree, key, nhlfe);
+	if (unlikely(retval))
+		return retval;
+
+	list_add_rcu(&nhlfe->global, &net->mpls.nhlfe_list);
+	return 0;
+}
+
+/*
+ * Remove a NHLFE, caller holds the NHLFE lock
+ */
+static struct mpls_nhlfe *__mpls_remove_nhlfe(struct net *net,
+		unsigned int key)
+{
+	struct mpls_nhlfe *nhlfe;
+
+	nhlfe = radix_tree_delete(&net->mpls.nhlfe_tree, key);
+	if (!nhlfe) {
+		MPLS_DEBUG("NHLFE node with key %u not found.\n", key);
+		return NULL;
+	}
+
+	list_del_rcu(&nhlfe->global);
+	return nhlfe;
+}
+
 /**
  * mpls_insert_nhlfe - Inserts the given NHLFE object in the MPLS
- *   Output Information Radix Tree using the given key.
+ *   Output Information Radix Tree of its namespace using the given key.
  * @key : key to use
  * @nhlfe : nhlfe object.
  *
@@ -237,20 +284,54 @@ struct mpls_nhlfe *nhlfe_dst_alloc(unsigned int key)
 
 int mpls_insert_nhlfe(unsigned int key, struct mpls_nhlfe *nhlfe)
 {
+	struct net *net = mpls_nhlfe_net(nhlfe);
 	int retval = 0;
 	MPLS_ENTER;
-	spin_lock_bh(&mpls_nhlfe_lock);
+	spin_lock_bh(&net->mpls.nhlfe_lock);
+	if (unlikely(__mpls_insert_nhlfe(net, key, nhlfe)))
+		retval = -ENOMEM;
+	spin_unlock_bh(&net->mpls.nhlfe_lock);
+	MPLS_EXIT;
+	return retval;
+}
+
+/**
+ * mpls_insert_nhlfes - Publish a batch of NHLFE objects.
+ * @net:   namespace all the NHLFEs were built for
+ * @nhlfe: NHLFE objects, instructions already built
+ * @count: number of objects
+ *
+ * All the NHLFEs are inserted with a single acquisition of
+ * the NHLFE lock. On error the ones already inserted are taken out
+ * again and the caller still owns every NHLFE of the batch.
+ **/
 
-	retval = radix_tree_insert(&mpls_nhlfe_tree, key, nhlfe);
+int mpls_insert_nhlfes(struct net *net, struct mpls_nhlfe **nhlfe, int count)
+{
+	int retval = 0;
+	int i, inserted;
+
+	MPLS_ENTER;
+	spin_lock_bh(&net->mpls.nhlfe_lock);
+	for (i = 0; i < count; i++) {
+		retval = __mpls_insert_nhlfe(net, nhlfe[i]->nhlfe_key,
+				nhlfe[i]);
+		if (unlikely(retval)) {
+			MPLS_DEBUG("NHLFE key %u not inserted (%d)\n",
+				nhlfe[i]->nhlfe_key, retval);
+			break;
+		}
+	}
+	inserted = i;
 	if (unlikely(retval)) {
-		retval = -ENOMEM;
-		goto out;
+		while (--i >= 0)
+			__mpls_remove_nhlfe(net, nhlfe[i]->nhlfe_key);
 	}
+	spin_unlock_bh(&net->mpls.nhlfe_lock);
 
-	list_add_rcu(&nhlfe->global, &mpls_nhlfe_list);
-
-out:
-	spin_unlock_bh(&mpls_nhlfe_lock);
+	/* the withdrawn ones may have been seen by packets */
+	if (unlikely(retval) && inserted)
+		synchronize_rcu_bh();
 	MPLS_EXIT;
 	return retval;
 }
@@ -259,6 +340,7 @@ out:
 /**
  *	mpls_remove_nhlfe - Remove the node given the key from the MPLS
  *	Output Information Radix Tree.
+ *	@net : namespace
  *	@key : key to use
  *
  *	This function deletes the NHLFE object from the Radix Tree, but please
@@ -266,23 +348,14 @@ out:
  *	responsible for	decreasing the refcount if necessary.
  **/
 
-struct mpls_nhlfe *mpls_remove_nhlfe(unsigned int key)
+struct mpls_nhlfe *mpls_remove_nhlfe(struct net *net, unsigned int key)
 {
 	struct mpls_nhlfe *nhlfe;
 
 	MPLS_ENTER;
-	spin_lock_bh(&mpls_nhlfe_lock);
-
-	nhlfe = radix_tree_delete(&mpls_nhlfe_tree, key);
-	if (!nhlfe) {
-		MPLS_DEBUG("NHLFE node with key %u not found.\n", key);
-		goto out;
-	}
-
-	list_del_rcu(&nhlfe->global);
-
-out:
-	spin_unlock_bh(&mpls_nhlfe_lock);
+	spin_lock_bh(&net->mpls.nhlfe_lock);
+	nhlfe = __mpls_remove_nhlfe(net, key);
+	spin_unlock_bh(&net->mpls.nhlfe_lock);
 	MPLS_EXIT;
 	return nhlfe;
 }
@@ -290,6 +363,7 @@ out:
 
 /**
  *	mpls_get_nhlfe - Get a reference to a NHLFE object.
+ *	@net : namespace whose tree is searched.
  *	@key : key to look for in the NHLFE Radix Tree.
  *
  *	This function can be used to get a reference to a NHLFE object
@@ -301,12 +375,12 @@ out:
  *	the object when it is no longer needed (by using "mpls_nhlfe_release").
  **/
 
-inline struct mpls_nhlfe *mpls_get_nhlfe(unsigned int key)
+inline struct mpls_nhlfe *mpls_get_nhlfe(struct net *net, unsigned int key)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	MPLS_ENTER;
 	rcu_read_lock();
-	nhlfe = radix_tree_lookup(&mpls_nhlfe_tree, key);
+	nhlfe = radix_tree_lookup(&net->mpls.nhlfe_tree, key);
 	smp_read_barrier_depends();
 	if (likely(nhlfe))
 		mpls_nhlfe_hold(nhlfe);
@@ -318,6 +392,38 @@ inline struct mpls_nhlfe *mpls_get_nhlfe(unsigned int key)
 }
 EXPORT_SYMBOL(mpls_get_nhlfe);
 
+/**
+ *	mpls_nhlfe_dump_next - Find the next NHLFE of a dump.
+ *	@net: namespace being dumped
+ *	@pos: where to resume, moved past the returned NHLFE [IN/OUT]
+ *
+ *	The radix tree is walked in key order. Returns NULL at the end.
+ *	Caller holds rcu_read_lock_bh.
+ **/
+
+struct mpls_nhlfe *mpls_nhlfe_dump_next(struct net *net,
+		struct mpls_dump_pos *pos)
+{
+	struct mpls_nhlfe *nhlfe;
+
+	if (pos->table < MPLS_DUMP_TREE) {
+		pos->table = MPLS_DUMP_TREE;
+		pos->key = 0;
+	}
+	if (pos->table != MPLS_DUMP_TREE)
+		return NULL;
+
+	if (!radix_tree_gang_lookup(&net->mpls.nhlfe_tree, (void **)&nhlfe,
+			pos->key, 1)) {
+		pos->table = MPLS_DUMP_END;
+		return NULL;
+	}
+	pos->key = nhlfe->nhlfe_key + 1;
+	if (!pos->key)
+		pos->table = MPLS_DUMP_END;
+	return nhlfe;
+}
+
 /**
  *	mpls_destroy_nhlfe_instrs - Destroy NHLFE instruction list.
  *	@nhlfe:	NHLFE object
@@ -338,66 +444,165 @@ void mpls_destroy_nhlfe_instrs(struct mpls_nhlfe *nhlfe)
 	MPLS_EXIT;
 }
 
-int mpls_nhlfe_set_instrs(struct mpls_out_label_req *mol,
+/**
+ *	mpls_nhlfe_destroy_rcu - tear down a withdrawn NHLFE.
+ *	@head: rcu head of the NHLFE dst
+ *
+ *	Runs once no packet can be switched by the NHLFE anymore. Its
+ *	instructions release the interfaces and other NHLFE's they hold,
+ *	then the dst system is told we're done with it. ILMs withdrawn
+ *	meanwhile may still hold a reference, dst_free() copes with it.
+ **/
+
+static void mpls_nhlfe_destroy_rcu(struct rcu_head *head)
+{
+	struct mpls_nhlfe *nhlfe =
+		container_of(head, struct mpls_nhlfe, dst.rcu_head);
+
+	mpls_destroy_nhlfe_instrs(nhlfe);
+	mpls_nhlfe_drop(nhlfe);
+}
+
+/**
+ *	mpls_nhlfe_set_instrs - Replace the instruction list of a NHLFE.
+ *	@mol:    request with the NHLFE key
+ *	@mie:    Array of instruction elements set by user
+ *	@length: Number of valid entries
+ *
+ *	Make-before-break: the new program is built against a shadow NHLFE
+ *	that holds its next hop (device, neighbour, protocol driver, MTU).
+ *	A single pointer swap publishes it, packets running it send through
+ *	the shadow dst while packets still running the old program keep the
+ *	next hop of the NHLFE. Once no packet can run the old program, the
+ *	NHLFE takes over the next hop of the shadow, the program is
+ *	repointed at it and the old program and the shadow are freed after
+ *	a RCU-bh grace period. The old program is left untouched if the new
+ *	one can't be built. Called in process context only and may sleep.
+ **/
+
+int mpls_nhlfe_set_instrs(struct net *net, struct mpls_out_label_req *mol,
 			struct mpls_instr_elem *mie,
 			int length)
 {
-	struct mpls_instr_req *instr_old = NULL;
-	int no_instr_old = 0;
-	int retval = 0;
+	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe_label(net, mol);
+	struct mpls_prot_driver *proto = NULL;
 	struct mpls_instr *instr = NULL;
-	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe_label(mol);
+	struct mpls_prot_driver *old_proto;
+	struct net_device *old_dev;
+	struct neighbour *old_neigh;
+	struct mpls_nhlfe *shadow;
+	struct mpls_instr *old;
 	MPLS_ENTER;
 
 	if (!nhlfe)
 		return -EINVAL;
 
-	/* Commit the new ones */
-	if (nhlfe->nhlfe_instr) {
-		no_instr_old = mpls_no_instrs(nhlfe->nhlfe_instr);
-		instr_old = kmalloc(sizeof(*instr_old) +
-			no_instr_old * sizeof(struct mpls_instr_elem),
-			GFP_ATOMIC);
-		if (unlikely(!instr_old)) {
+	/*
+	 * Build the new program off to the side: the opcodes set up the
+	 * device, neighbour and header length of the shadow, not the ones
+	 * packets are using
+	 */
+	shadow = nhlfe_dst_alloc(net, nhlfe->nhlfe_key);
+	if (unlikely(!shadow)) {
+		mpls_nhlfe_release(nhlfe);
+		MPLS_EXIT;
+		return -ENOMEM;
+	}
+
+	if (!__mpls_instrs_build(mie, &instr, length, MPLS_OUT, shadow)) {
+		mpls_nhlfe_drop(shadow);
+		mpls_nhlfe_release(nhlfe);
+		MPLS_DEBUG("Returns -1\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	/* the NHLFE gets its own reference on the driver of the shadow */
+	if (shadow->nhlfe_proto) {
+		proto = mpls_proto_find_by_family(
+				shadow->nhlfe_proto->family);
+		if (unlikely(!proto)) {
+			mpls_instrs_free(instr);
+			mpls_nhlfe_drop(shadow);
 			mpls_nhlfe_release(nhlfe);
 			MPLS_EXIT;
-			return -EINVAL;
+			return -ENOENT;
 		}
-		mpls_instrs_unbuild(nhlfe->nhlfe_instr, instr_old);
-		mpls_instrs_free(nhlfe->nhlfe_instr);
 	}
 
-	/* Build temporary opcode set from mie */
-	if (!mpls_instrs_build(mie, &instr,
-			length, MPLS_OUT, nhlfe)) {
-		/*replace with old instructions in case there were an error*/
-		if (instr_old)
-			mpls_instrs_build(instr_old->mir_instr, &instr,
-				instr_old->mir_instr_length,
-				MPLS_OUT, nhlfe);
+	/*
+	 * The header room only grows: packets running the new program get
+	 * the room for its pushes, the old one doesn't mind the extra.
+	 */
+	if (shadow->dst.header_len > nhlfe->dst.header_len)
+		nhlfe->dst.header_len = shadow->dst.header_len;
 
-		MPLS_DEBUG("Returns -1\n");
-		retval = -EINVAL;
-	}
-	nhlfe->nhlfe_instr = instr;
+	/* Publish the program, its SET leaves the shadow dst on packets */
+	old = nhlfe->nhlfe_instr;
+	rcu_assign_pointer(nhlfe->nhlfe_instr, instr);
+
+	/*
+	 * No packet runs the old program anymore, none sends through the
+	 * next hop of the NHLFE: it can take over the one of the shadow.
+	 */
+	synchronize_rcu_bh();
+
+	old_dev = nhlfe->dst.dev;
+	old_proto = nhlfe->nhlfe_proto;
+	old_neigh = dst_get_neighbour_noref_raw(&nhlfe->dst);
+
+	if (shadow->dst.dev)
+		dev_hold(shadow->dst.dev);
+	nhlfe->dst.dev = shadow->dst.dev;
+	dst_set_neighbour(&nhlfe->dst,
+		neigh_clone(dst_get_neighbour_noref_raw(&shadow->dst)));
+	nhlfe->nhlfe_proto = proto;
+	memcpy(&nhlfe->nhlfe_nexthop, &shadow->nhlfe_nexthop,
+		sizeof(nhlfe->nhlfe_nexthop));
+	dst_metric_set(&nhlfe->dst, RTAX_MTU,
+		dst_metric_raw(&shadow->dst, RTAX_MTU));
+	nhlfe->nhlfe_mtu_limit = shadow->nhlfe_mtu_limit;
+	nhlfe->dst.flags |= shadow->dst.flags;
+	list_del_init(&nhlfe->dev_entry);
+	if (!list_empty(&shadow->dev_entry))
+		list_replace_init(&shadow->dev_entry, &nhlfe->dev_entry);
+
+	/* same next hop either way, packets may meet both meanwhile */
+	mpls_instrs_graft(instr, shadow, nhlfe);
+
+	/*
+	 * Packets being switched don't hold a reference: the old program,
+	 * the next hop it was using and the shadow go after a grace period
+	 * (the shadow dst releases its own device, neighbour and driver).
+	 */
+	mpls_instrs_retire(old, old_neigh, old_dev, old_proto);
+	mpls_nhlfe_drop(shadow);
+
+	/*
+	 * the MTU and header length of the NHLFE may have changed,
+	 * the routes stacked on it copied them: have those re-resolve
+	 * (lazily, they find it stale on their next lookup)
+	 */
+	mpls_proto_cache_flush_nhlfe(net, nhlfe);
 	mpls_nhlfe_release(nhlfe);
-	kfree(instr_old);
 	MPLS_EXIT;
-	return retval;
+	return 0;
 }
 
 /**
  *	mpls_set_out_label_propagate_ttl - set the propagate_ttl status
+ *	@net: namespace of the NHLFE
  *	@mol: request with the NHLFE key and desired propagate_ttl status
  *
  *	Update the NHLFE object (using the key in the request) with the
  *	propagate_ttl from the request
  **/
 
-int mpls_set_out_label_propagate_ttl(struct mpls_out_label_req *mol)
+int mpls_set_out_label_propagate_ttl(struct net *net,
+		struct mpls_out_label_req *mol)
 {
 	unsigned int key = mpls_label2key(0, &mol->mol_label);
-	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe(key);
+	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe(net, key);
 	MPLS_ENTER;
 	if (!nhlfe) {
 		MPLS_EXIT;
@@ -411,34 +616,194 @@ int mpls_set_out_label_propagate_ttl(struct mpls_out_label_req *mol)
 	return 0;
 }
 
+/**
+ *	mpls_nhlfe_set_backup - Install the backup of a NHLFE.
+ *	@nhlfe:  protected NHLFE
+ *	@backup: bypass/detour NHLFE, NULL to remove. Its reference is
+ *		 given to @nhlfe.
+ *
+ *	The previous backup is released. Packets being switched may still
+ *	use it until the end of the RCU-bh grace period, the callers that
+ *	free it (NHLFE deletion) wait for that anyway.
+ **/
+
+void mpls_nhlfe_set_backup(struct mpls_nhlfe *nhlfe,
+		struct mpls_nhlfe *backup)
+{
+	struct mpls_nhlfe *old;
+
+	MPLS_ENTER;
+	old = rcu_dereference_protected(nhlfe->nhlfe_backup, 1);
+	if (old)
+		list_del_init(&nhlfe->backup_entry);
+	if (backup)
+		list_add(&nhlfe->backup_entry, &backup->list_protected);
+	else
+		nhlfe->nhlfe_frr = 0;
+	rcu_assign_pointer(nhlfe->nhlfe_backup, backup);
+
+	if (old)
+		mpls_nhlfe_release(old);
+	MPLS_EXIT;
+}
+
 /*
- * mpls_get_nhlfe_label - returns existing nhlfe,
- * if there is no ilm returns NULL
+ * Before a NHLFE goes away: drop its backup and stop protecting others.
  */
-struct mpls_nhlfe *mpls_get_nhlfe_label(struct mpls_out_label_req *mol)
+static void mpls_nhlfe_unlink_backup(struct mpls_nhlfe *nhlfe)
 {
-	unsigned int key = mpls_label2key(0, &mol->mol_label);
-	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe(key);
+	struct mpls_nhlfe *holder, *tmp;
+
+	mpls_nhlfe_set_backup(nhlfe, NULL);
+	list_for_each_entry_safe(holder, tmp, &nhlfe->list_protected,
+			backup_entry)
+		mpls_nhlfe_set_backup(holder, NULL);
+}
+
+/**
+ *	mpls_set_out_label_backup - set the backup of a NHLFE
+ *	@net:        namespace of both NHLFEs
+ *	@mol:        request with the key of the protected NHLFE
+ *	@backup_key: key of the backup NHLFE, 0 to remove the backup
+ **/
+
+int mpls_set_out_label_backup(struct net *net,
+		struct mpls_out_label_req *mol, unsigned int backup_key)
+{
+	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe_label(net, mol);
+	struct mpls_nhlfe *backup = NULL;
+	int retval = 0;
+
 	MPLS_ENTER;
+	if (!nhlfe) {
+		MPLS_EXIT;
+		return -ESRCH;
+	}
+
+	if (backup_key) {
+		backup = mpls_get_nhlfe(net, backup_key);
+		if (!backup) {
+			retval = -ESRCH;
+			goto out;
+		}
+		if (backup == nhlfe ||
+		    rcu_access_pointer(backup->nhlfe_backup) == nhlfe) {
+			mpls_nhlfe_release(backup);
+			retval = -ELOOP;
+			goto out;
+		}
+	}
+
+	mpls_nhlfe_set_backup(nhlfe, backup);
+out:
+	mpls_nhlfe_release(nhlfe);
 	MPLS_EXIT;
-	return nhlfe;
+	return retval;
 }
 
 /**
- *	mpls_add_out_label - Add a new outgoing label to the database.
- *	@out:request containing the label
+ *	mpls_nhlfe_frr_activate - Switch a NHLFE over to its backup.
+ *	@nhlfe: NHLFE whose output device failed
  *
- *	Adds a new outgoing label to the outgoing tree. We first
- *  check that the entry does not exist,
- *	allocate a new NHLFE object and reset it.
+ *	Local repair: packets are sent through the backup until the output
+ *	device comes back (mpls_nhlfe_frr_revert). Userland is notified.
+ *	Returns 1 if the backup took over, 0 if there is no usable backup.
  **/
 
-struct mpls_nhlfe *mpls_add_out_label(struct mpls_out_label_req *out)
+int mpls_nhlfe_frr_activate(struct mpls_nhlfe *nhlfe)
+{
+	struct mpls_nhlfe *backup;
+	struct net_device *dev;
+
+	MPLS_ENTER;
+	backup = rcu_dereference_protected(nhlfe->nhlfe_backup, 1);
+	if (!backup) {
+		MPLS_EXIT;
+		return 0;
+	}
+	if (nhlfe->nhlfe_frr) {
+		MPLS_EXIT;
+		return 1;
+	}
+
+	dev = backup->dst.dev;
+	if (!dev || !netif_running(dev) || !netif_carrier_ok(dev)) {
+		MPLS_DEBUG("NHLFE %u: backup %u is down too\n",
+			nhlfe->nhlfe_key, backup->nhlfe_key);
+		MPLS_EXIT;
+		return 0;
+	}
+
+	nhlfe->nhlfe_frr = 1;
+	MPLS_DEBUG("NHLFE %u switched to backup %u\n",
+		nhlfe->nhlfe_key, backup->nhlfe_key);
+	mpls_nhlfe_event(MPLS_GRP_NHLFE_NAME, MPLS_CMD_NEWNHLFE,
+		nhlfe, 0, 0);
+	MPLS_EXIT;
+	return 1;
+}
+
+/**
+ *	mpls_nhlfe_frr_revert - Go back to the primary path of a NHLFE.
+ *	@nhlfe: NHLFE whose output device recovered
+ *
+ *	The neighbour of the primary path was flushed with the device, it
+ *	is resolved again before packets are sent through it.
+ **/
+
+void mpls_nhlfe_frr_revert(struct mpls_nhlfe *nhlfe)
+{
+	struct neighbour *old;
+
+	MPLS_ENTER;
+	if (!nhlfe->nhlfe_frr) {
+		MPLS_EXIT;
+		return;
+	}
+
+	if (nhlfe->nhlfe_proto && nhlfe->dst.dev) {
+		old = dst_get_neighbour_noref_raw(&nhlfe->dst);
+		if (nhlfe->nhlfe_proto->nexthop_resolve(&nhlfe->dst,
+				&nhlfe->nhlfe_nh, nhlfe->dst.dev)) {
+			MPLS_DEBUG("NHLFE %u: nexthop not resolved, "
+				"staying on backup\n", nhlfe->nhlfe_key);
+			MPLS_EXIT;
+			return;
+		}
+		if (old)
+			neigh_release(old);
+	}
+
+	nhlfe->nhlfe_frr = 0;
+	MPLS_DEBUG("NHLFE %u back on primary path\n", nhlfe->nhlfe_key);
+	mpls_nhlfe_event(MPLS_GRP_NHLFE_NAME, MPLS_CMD_NEWNHLFE,
+		nhlfe, 0, 0);
+	MPLS_EXIT;
+}
+
+/*
+ * mpls_get_nhlfe_label - returns existing nhlfe,
+ * if there is no ilm returns NULL
+ */
+struct mpls_nhlfe *mpls_get_nhlfe_label(struct net *net,
+		struct mpls_out_label_req *mol)
+{
+	unsigned int key = mpls_label2key(0, &mol->mol_label);
+	struct mpls_nhlfe *nhlfe = mpls_get_nhlfe(net, key);
+	MPLS_ENTER;
+	MPLS_EXIT;
+	return nhlfe;
+}
+
+/*
+ * Allocate a new NHLFE for a request, it is not inserted yet.
+ */
+static struct mpls_nhlfe *__mpls_alloc_out_label(struct net *net,
+		struct mpls_out_label_req *out)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	unsigned int key = 0;
 
-	MPLS_ENTER;
 	BUG_ON(!out);
 	BUG_ON(out->mol_label.ml_type != MPLS_LABEL_KEY);
 	/* Create a new key */
@@ -449,28 +814,51 @@ struct mpls_nhlfe *mpls_add_out_label(struct mpls_out_label_req *out)
 	 * Check if the NHLFE is already in the tree.
 	 * It should not exist.
 	 */
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(net, key);
 
 	if (unlikely(nhlfe)) {
 		MPLS_DEBUG("Node %u already exists in radix tree\n", key);
 
 		/* release the refcnt held by mpls_get_nhlfe */
 		mpls_nhlfe_release(nhlfe);
-		MPLS_EXIT;
 		return ERR_PTR(-EEXIST);
 	}
 
 	/*
 	 * Allocate a new Output Information/Label,
 	 */
-	nhlfe = nhlfe_dst_alloc(key);
+	nhlfe = nhlfe_dst_alloc(net, key);
 	if (unlikely(!nhlfe))
 		return ERR_PTR(-ENOMEM);
 
 	nhlfe->nhlfe_owner = out->mol_owner;
+	return nhlfe;
+}
+
+/**
+ *	mpls_add_out_label - Add a new outgoing label to the database.
+ *	@net:namespace
+ *	@out:request containing the label
+ *
+ *	Adds a new outgoing label to the outgoing tree. We first
+ *  check that the entry does not exist,
+ *	allocate a new NHLFE object and reset it.
+ **/
+
+struct mpls_nhlfe *mpls_add_out_label(struct net *net,
+		struct mpls_out_label_req *out)
+{
+	struct mpls_nhlfe *nhlfe;
+
+	MPLS_ENTER;
+	nhlfe = __mpls_alloc_out_label(net, out);
+	if (IS_ERR(nhlfe)) {
+		MPLS_EXIT;
+		return nhlfe;
+	}
 
 	/* Insert into NHLFE tree */
-	if (unlikely(mpls_insert_nhlfe(key, nhlfe))) {
+	if (unlikely(mpls_insert_nhlfe(nhlfe->nhlfe_key, nhlfe))) {
 		mpls_nhlfe_release(nhlfe);
 		MPLS_EXIT;
 		return ERR_PTR(-ENOMEM);
@@ -480,6 +868,58 @@ struct mpls_nhlfe *mpls_add_out_label(struct mpls_out_label_req *out)
 	return nhlfe;
 }
 
+/**
+ *	mpls_nhlfe_build - Build a NHLFE and its instructions, unpublished.
+ *	@net:    namespace
+ *	@out:    request containing the key, MTU and propagate_ttl
+ *	@mie:    Array of instruction elements set by user
+ *	@length: Array length
+ *
+ *	Used to program labels in batches (cf. mpls_insert_nhlfes). The
+ *	mol_change_flag of the request is honoured like for a single NHLFE.
+ *	The label cache of the layer 3 protocols is not flushed. On failure
+ *	nothing is left behind. Returns the NHLFE or an err pointer.
+ **/
+
+struct mpls_nhlfe *mpls_nhlfe_build(struct net *net,
+		struct mpls_out_label_req *out,
+		struct mpls_instr_elem *mie, int length)
+{
+	struct mpls_nhlfe *nhlfe;
+	int retval = -EINVAL;
+
+	MPLS_ENTER;
+	nhlfe = __mpls_alloc_out_label(net, out);
+	if (IS_ERR(nhlfe)) {
+		MPLS_EXIT;
+		return nhlfe;
+	}
+
+	if (!__mpls_instrs_build(mie, &nhlfe->nhlfe_instr, length,
+			MPLS_OUT, nhlfe))
+		goto err;
+
+	if (out->mol_change_flag & MPLS_CHANGE_MTU) {
+		if (nhlfe->nhlfe_mtu_limit < out->mol_mtu) {
+			MPLS_DEBUG("MTU is larger than lower layer (%d > %d)\n",
+				out->mol_mtu, nhlfe->nhlfe_mtu_limit);
+			goto err;
+		}
+		dst_metric_set(&nhlfe->dst, RTAX_MTU, out->mol_mtu);
+	}
+
+	if (out->mol_change_flag & MPLS_CHANGE_PROP_TTL)
+		nhlfe->nhlfe_propagate_ttl = out->mol_propagate_ttl;
+
+	MPLS_EXIT;
+	return nhlfe;
+err:
+	mpls_destroy_nhlfe_instrs(nhlfe);
+	mpls_nhlfe_drop(nhlfe);
+	MPLS_EXIT;
+	return ERR_PTR(retval);
+}
+
 /*
  * mpls_nhlfe_del_list_in - changes FWD to PEEK in all ilms in the list
  * @nhlfe:  nhlfe holding the list_in
@@ -545,6 +985,9 @@ del:
 /**
  *	mpls_del_nhlfe - Remove a NHLFE from the tree
  *	@nhlfe: nhlfe entry to delete
+ *
+ *	The L3 caches are not flushed: this is for the device notifiers,
+ *	which delete all the NHLFEs of a device and flush once.
  **/
 int mpls_del_nhlfe(struct mpls_nhlfe *nhlfe, int seq, int pid)
 {
@@ -564,7 +1007,7 @@ int mpls_del_nhlfe(struct mpls_nhlfe *nhlfe, int seq, int pid)
 	 */
 
 	/* remove the NHLFE from the tree */
-	mpls_remove_nhlfe(nhlfe->nhlfe_key);
+	mpls_remove_nhlfe(mpls_nhlfe_net(nhlfe), nhlfe->nhlfe_key);
 
 	/*
 	 * Clean ilms holding this nhlfe
@@ -572,21 +1015,23 @@ int mpls_del_nhlfe(struct mpls_nhlfe *nhlfe, int seq, int pid)
 	mpls_nhlfe_del_list_in(nhlfe);
 
 	/* From now on, drop packets */
-	nhlfe->dst.output = dst_discard;
+	nhlfe->dst.input = nhlfe->dst.output = dst_discard;
+	mpls_nhlfe_unlink_backup(nhlfe);
+
+	/* the routes stacked on it find it stale, the notifier flushes the
+	 * caches that can't tell once for all the NHLFEs it deletes */
+	nhlfe->dst.obsolete = 1;
+	mpls_nhlfe_invalidate(nhlfe);
 
 	retval = mpls_nhlfe_event(MPLS_GRP_NHLFE_NAME,
 		MPLS_CMD_DELNHLFE, nhlfe, seq, pid);
 
-	/* Destroy the instructions on this NHLFE, so as to no longer
-	 * hold refs to interfaces and other NHLFE's. */
-	mpls_destroy_nhlfe_instrs(nhlfe);
+	/* the device notifiers walk its NHLFE list, leave it now */
+	list_del_init(&nhlfe->dev_entry);
 
-	/* schedule all higher layer protocols to give up their references */
-	mpls_proto_cache_flush_all(&init_net);
-
-	WARN_ON(atomic_read(&nhlfe->dst.__refcnt) != 1);
-	/* Let the dst system know we're done with this NHLFE */
-	mpls_nhlfe_drop(nhlfe);
+	/* Packets being switched don't hold a reference: the instructions
+	 * and the NHLFE go after a grace period */
+	call_rcu_bh(&nhlfe->dst.rcu_head, mpls_nhlfe_destroy_rcu);
 
 	MPLS_EXIT;
 	return retval;
@@ -594,10 +1039,12 @@ int mpls_del_nhlfe(struct mpls_nhlfe *nhlfe, int seq, int pid)
 
 /**
  *	mpls_del_out_label - Remove a NHLFE from the tree
+ *	@net: namespace
  *	@out: request.
  **/
 
-int mpls_del_out_label(struct mpls_out_label_req *out, int seq, int pid)
+int mpls_del_out_label(struct net *net, struct mpls_out_label_req *out,
+		int seq, int pid)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	unsigned int key;
@@ -607,7 +1054,7 @@ int mpls_del_out_label(struct mpls_out_label_req *out, int seq, int pid)
 
 	key = mpls_label2key(0, &out->mol_label);
 
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(net, key);
 	if (unlikely(!nhlfe)) {
 		MPLS_DEBUG("Node %u was not in tree\n", key);
 		MPLS_EXIT;
@@ -629,41 +1076,89 @@ int mpls_del_out_label(struct mpls_out_label_req *out, int seq, int pid)
 	mpls_nhlfe_del_list_in(nhlfe);
 
 	/* remove the NHLFE from the tree */
-	mpls_remove_nhlfe(nhlfe->nhlfe_key);
+	mpls_remove_nhlfe(net, nhlfe->nhlfe_key);
 
 	/* Remove reference taken on mpls_get_nhlfe() */
 	mpls_nhlfe_release(nhlfe);
 
 	/* From now on, drop packets */
 	nhlfe->dst.input = nhlfe->dst.output = dst_discard;
+	mpls_nhlfe_unlink_backup(nhlfe);
+
+	/* the higher layer routes stacked on this NHLFE find it stale,
+	 * they keep a reference until they are released */
+	nhlfe->dst.obsolete = 1;
+	mpls_proto_cache_flush_nhlfe(mpls_nhlfe_net(nhlfe), nhlfe);
 
 	retval = mpls_nhlfe_event(MPLS_GRP_NHLFE_NAME,
 		MPLS_CMD_DELNHLFE, nhlfe, seq, pid);
 
-	/* Destroy the instructions on this NHLFE, so as to no longer
-	 * hold refs to interfaces and other NHLFE's. */
-	mpls_destroy_nhlfe_instrs(nhlfe);
+	/* the device notifiers walk its NHLFE list, leave it now */
+	list_del_init(&nhlfe->dev_entry);
 
-	/* schedule all higher layer protocols to give up their references */
-	mpls_proto_cache_flush_all(&init_net);
-
-	WARN_ON(atomic_read(&nhlfe->dst.__refcnt) != 1);
-	/* Let the dst system know we're done with this NHLFE */
-	mpls_nhlfe_drop(nhlfe);
+	/* Packets being switched don't hold a reference: the instructions
+	 * and the NHLFE go after a grace period */
+	call_rcu_bh(&nhlfe->dst.rcu_head, mpls_nhlfe_destroy_rcu);
 
 	MPLS_EXIT;
 	return retval;
 }
 
+/**
+ *	mpls_del_nhlfes - Withdraw and free a batch of NHLFE objects.
+ *	@net:   namespace of the NHLFEs
+ *	@nhlfe: NHLFE objects published by mpls_insert_nhlfes()
+ *	@count: number of objects
+ *
+ *	Undoes a batch without notifying userland, the NHLFEs were never
+ *	announced. ILMs of the batch must be gone already. One grace period
+ *	covers the whole batch.
+ **/
+
+void mpls_del_nhlfes(struct net *net, struct mpls_nhlfe **nhlfe, int count)
+{
+	int i;
+
+	if (!count)
+		return;
+
+	MPLS_ENTER;
+	spin_lock_bh(&net->mpls.nhlfe_lock);
+	for (i = 0; i < count; i++)
+		__mpls_remove_nhlfe(net, nhlfe[i]->nhlfe_key);
+	spin_unlock_bh(&net->mpls.nhlfe_lock);
+
+	for (i = 0; i < count; i++) {
+		mpls_nhlfe_del_list_in(nhlfe[i]);
+		nhlfe[i]->dst.input = nhlfe[i]->dst.output = dst_discard;
+		mpls_nhlfe_unlink_backup(nhlfe[i]);
+		nhlfe[i]->dst.obsolete = 1;
+		mpls_nhlfe_invalidate(nhlfe[i]);
+	}
+
+	/* once for the whole batch */
+	mpls_proto_cache_flush_all(net);
+
+	synchronize_rcu_bh();
+
+	for (i = 0; i < count; i++) {
+		/* routes stacked on it may still hold a reference */
+		mpls_destroy_nhlfe_instrs(nhlfe[i]);
+		mpls_nhlfe_drop(nhlfe[i]);
+	}
+	MPLS_EXIT;
+}
+
 /**
  * mpls_set_out_label_mtu - change the MTU for this NHLFE.
+ * @net: namespace of the NHLFE
  * @out: Request containing the new MTU.
  *
  * Update the NHLFE object (using the key in the request) with the passed
  * MTU.
  **/
 
-int mpls_set_out_label_mtu(struct mpls_out_label_req *out)
+int mpls_set_out_label_mtu(struct net *net, struct mpls_out_label_req *out)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	int retval = 0;
@@ -673,7 +1168,7 @@ int mpls_set_out_label_mtu(struct mpls_out_label_req *out)
 	MPLS_ENTER;
 
 	key = out->mol_label.u.ml_key;
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(net, key);
 
 	if (unlikely(!nhlfe)) {
 		MPLS_DEBUG("Node %u does not exists in radix tree\n", key);
@@ -693,14 +1188,14 @@ int mpls_set_out_label_mtu(struct mpls_out_label_req *out)
 		return -EINVAL;
 	}
 
+	/* force the layer 3 protocols to re-find the dsts (NHLFEs)
+	 * stacked on this one, thus picking up the new MTU
+	 */
+	mpls_proto_cache_flush_nhlfe(net, nhlfe);
+
 	/* release the refcnt held by mpls_get_nhlfe */
 	mpls_nhlfe_release(nhlfe);
 
-	/* force the layer 3 protocols to re-find and dsts (NHLFEs),
-	 * thus picking up the new MTU
-	 */
-	mpls_proto_cache_flush_all(&init_net);
-
 	MPLS_EXIT;
 	return retval;
 }
@@ -733,3 +1228,63 @@ void mpls_nhlfe_exit(void)
 	dst_entries_destroy(&nhlfe_dst_ops);
 	MPLS_EXIT;
 }
+
+/**
+ *	mpls_nhlfe_init_net - Set up the NHLFE tree of a namespace.
+ *	@net: new namespace
+ **/
+
+void __net_init mpls_nhlfe_init_net(struct net *net)
+{
+	MPLS_ENTER;
+	INIT_RADIX_TREE(&net->mpls.nhlfe_tree, GFP_ATOMIC);
+	spin_lock_init(&net->mpls.nhlfe_lock);
+	INIT_LIST_HEAD(&net->mpls.nhlfe_list);
+	MPLS_EXIT;
+}
+
+/**
+ *	mpls_nhlfe_exit_net - Flush the NHLFE tree of a namespace.
+ *	@net: namespace going away, its ILMs are gone already
+ *
+ *	Same as mpls_del_nhlfes() for every NHLFE of the namespace: a single
+ *	acquisition of the NHLFE lock and one grace period for all of them.
+ *	The devices they hold are released before the namespace unregisters
+ *	them. References still held elsewhere (tunnels, xtables) keep the
+ *	dst until they are dropped, packets are discarded meanwhile.
+ **/
+
+void __net_exit mpls_nhlfe_exit_net(struct net *net)
+{
+	struct mpls_nhlfe *nhlfe, *tmp;
+	LIST_HEAD(dead);
+
+	MPLS_ENTER;
+	/* nobody walks the NHLFE list of a dying namespace, reuse the entries */
+	spin_lock_bh(&net->mpls.nhlfe_lock);
+	while (!list_empty(&net->mpls.nhlfe_list)) {
+		nhlfe = list_first_entry(&net->mpls.nhlfe_list,
+				struct mpls_nhlfe, global);
+		__mpls_remove_nhlfe(net, nhlfe->nhlfe_key);
+		list_add(&nhlfe->global, &dead);
+	}
+	spin_unlock_bh(&net->mpls.nhlfe_lock);
+
+	list_for_each_entry(nhlfe, &dead, global) {
+		mpls_nhlfe_del_list_in(nhlfe);
+		nhlfe->dst.input = nhlfe->dst.output = dst_discard;
+		mpls_nhlfe_unlink_backup(nhlfe);
+		nhlfe->dst.obsolete = 1;
+		mpls_nhlfe_invalidate(nhlfe);
+	}
+	mpls_proto_cache_flush_all(net);
+
+	synchronize_rcu_bh();
+
+	list_for_each_entry_safe(nhlfe, tmp, &dead, global) {
+		list_del_init(&nhlfe->global);
+		mpls_destroy_nhlfe_instrs(nhlfe);
+		mpls_nhlfe_drop(nhlfe);
+	}
+	MPLS_EXIT;
+}
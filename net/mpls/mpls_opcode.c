@@ -32,6 +32,8 @@
 #include <net/ip_fib.h>
 #include <linux/inet.h>
 #include <net/net_namespace.h>
+#include <net/xfrm.h>
+#include <asm/unaligned.h>
 
 /*
  * Helper functions
@@ -67,7 +69,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_generic)
  * LAST   : true
  *********************************************************************/
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_drop)
+MPLS_OPCODE_PROTOTYPE(mpls_op_drop)
 {
 	MPLS_ENTER;
 	MPLS_EXIT;
@@ -79,7 +81,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_op_drop)
 	MPLS_ENTER;
 	if (direction == MPLS_OUT) {
 		struct mpls_nhlfe *nhlfe = _mpls_as_nhlfe(parent);
-		nhlfe->dst.dev = init_net.loopback_dev;
+		nhlfe->dst.dev = mpls_nhlfe_net(nhlfe)->loopback_dev;
 		
 		nhlfe->nhlfe_proto = mpls_proto_find_by_family(AF_INET);
 		if (unlikely(!nhlfe->nhlfe_proto)) {
@@ -97,7 +99,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_op_drop)
 MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_op_drop)
 {
 	MPLS_ENTER;
-	if (direction == MPLS_OUT) {
+	if (direction == MPLS_OUT && parent) {
 		struct mpls_nhlfe *nhlfe = _mpls_as_nhlfe(parent);
 		mpls_proto_release(nhlfe->nhlfe_proto);
 		dev_put(nhlfe->dst.dev);
@@ -120,7 +122,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_op_drop)
  * LAST   : false
  *********************************************************************/
 
-inline MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_pop)
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_pop)
 {
 	struct sk_buff *skb = *pskb;
 	struct mpls_skb_cb *cb = MPLSCB(skb);
@@ -192,7 +194,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_pop)
  * LAST   : true
  *********************************************************************/
 
-inline MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_peek)
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_peek)
 {
 	MPLS_ENTER;
 	if (MPLSCB(*pskb)->popped_bos) {
@@ -218,7 +220,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_peek)
 	}
 	
 	nhlfe = _mpls_as_nhlfe(parent);
-	nhlfe->dst.dev = init_net.loopback_dev;
+	nhlfe->dst.dev = mpls_nhlfe_net(nhlfe)->loopback_dev;
 	nhlfe->dst.header_len = 0;
 
 	nhlfe->nhlfe_proto = mpls_proto_find_by_family(AF_INET);
@@ -235,7 +237,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_peek)
 MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_op_peek)
 {
 	MPLS_ENTER;
-	if (direction == MPLS_OUT) {
+	if (direction == MPLS_OUT && parent) {
 		struct mpls_nhlfe *nhlfe = _mpls_as_nhlfe(parent);
 		mpls_proto_release(nhlfe->nhlfe_proto);
 		dev_put(nhlfe->dst.dev);
@@ -253,11 +255,11 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_op_peek)
  * CLEAN  : mpls_clean_opcode_push
  * INPUT  : ?
  * OUTPUT : true
- * DATA   : Reference to label to push (struct mpls_label*)
+ * DATA   : Label to push (struct mpls_label*), in the instruction
  * LAST   : false
  *********************************************************************/
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_push)
+MPLS_OPCODE_PROTOTYPE(mpls_op_push)
 {
 	struct sk_buff *skb = *pskb;
 	struct mpls_skb_cb *cb = MPLSCB(skb);
@@ -273,7 +275,6 @@ inline MPLS_OPCODE_PROTOTYPE(mpls_op_push)
 
 	/* Only MPLS_LABEL_GEN type rigth now */
 	label = ml->u.ml_gen;
-	printk (KERN_DEBUG "BLAAAAAAAAAAAA labela %u",label);
 
 	/*
 	 * no matter what layer 2 we are on, we need the shim! (mpls-encap RFC)
@@ -315,15 +316,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_push)
 		return -EINVAL;
 	}
 
-	*data = kzalloc(sizeof(*ml), GFP_ATOMIC);
-	if (unlikely(!(*data))) {
-		MPLS_DEBUG("error building PUSH label instruction\n");
-		MPLS_EXIT;
-		return -ENOMEM;
-	}
-
-	ml = _mpls_as_label(*data);
-	memcpy(ml, &instr->mir_push, sizeof(*ml));
+	memcpy(*data, ml, sizeof(*ml));
 	pnhlfe->dst.header_len += MPLS_HDR_LEN;
 
 	MPLS_EXIT;
@@ -346,8 +339,167 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_push)
 {
 	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
 	MPLS_ENTER;
-	pnhlfe->dst.header_len -= MPLS_HDR_LEN;
-	kfree(data);
+	if (pnhlfe)
+		pnhlfe->dst.header_len -= MPLS_HDR_LEN;
+	MPLS_EXIT;
+}
+
+
+
+/*********************************************************************
+ * MPLS_OP_PUSH_EL
+ * DESC   : "Push an entropy label and its indicator"
+ * EXEC   : mpls_op_push_el
+ * BUILD  : mpls_build_opcode_push_el
+ * UNBUILD: NULL
+ * CLEAN  : mpls_clean_opcode_push_el
+ * INPUT  : false
+ * OUTPUT : true
+ * DATA   : NULL
+ * LAST   : false
+ *
+ * Remark : RFC 6790. The EL is the flow hash of the packet before it is
+ *          labelled (the inner 5-tuple), so transit LSRs hashing on it
+ *          (cf. skb_flow_dissect()) keep flows apart without parsing
+ *          the payload. Must be followed by the PUSH of the LSP that
+ *          carries the entropy; its egress discards the ELI/EL pair
+ *          (cf. mpls_input()).
+ *********************************************************************/
+
+MPLS_OPCODE_PROTOTYPE(mpls_op_push_el)
+{
+	struct sk_buff *skb = *pskb;
+	struct mpls_skb_cb *cb = MPLSCB(skb);
+	__be32 el = mpls_entropy_label(skb);
+	__be32 *shim;
+
+	MPLS_ENTER;
+	shim = (__be32 *)skb_push(skb, 2 * MPLS_HDR_LEN);
+	skb_reset_network_header(skb);
+
+	put_unaligned(htonl((MPLS_ENTROPY_LABEL_IND << 12) |
+			(cb->ttl & 0xFF)), &shim[0]);
+	/* the TTL of an EL is 0 */
+	put_unaligned(el | htonl((cb->bos & cb->popped_bos & 0x1) << 8),
+			&shim[1]);
+	cb->label = MPLS_ENTROPY_LABEL_IND;
+	cb->bos = 0;
+	cb->set_exp = 0;
+
+	skb->protocol = htons(ETH_P_MPLS_UC);
+	MPLS_EXIT;
+	return MPLS_RESULT_SUCCESS;
+}
+
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_push_el)
+{
+	struct mpls_nhlfe *pnhlfe = parent;
+
+	MPLS_ENTER;
+	*data = NULL;
+	if (unlikely(direction != MPLS_OUT)) {
+		MPLS_DEBUG("PUSH_EL only valid for outgoing labels\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	pnhlfe->dst.header_len += 2 * MPLS_HDR_LEN;
+	MPLS_EXIT;
+	return 0;
+}
+
+
+MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_push_el)
+{
+	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
+	MPLS_ENTER;
+	if (pnhlfe)
+		pnhlfe->dst.header_len -= 2 * MPLS_HDR_LEN;
+	MPLS_EXIT;
+}
+
+
+
+/*********************************************************************
+ * MPLS_OP_SWAP
+ * DESC   : "Swap the top label entry"
+ * EXEC   : mpls_op_swap
+ * BUILD  : mpls_build_opcode_swap
+ * UNBUILD: mpls_unbuild_opcode_swap
+ * CLEAN  : NULL
+ * INPUT  : false
+ * OUTPUT : true
+ * DATA   : New label (struct mpls_label*), in the instruction
+ * LAST   : false
+ *
+ * Remark : Same stack depth, so the top shim is rewritten where it is
+ *          (label and TTL, EXP and S bit kept) instead of POP + PUSH.
+ *********************************************************************/
+
+MPLS_OPCODE_PROTOTYPE(mpls_op_swap)
+{
+	struct sk_buff *skb = *pskb;
+	struct mpls_skb_cb *cb = MPLSCB(skb);
+	struct mpls_label *ml = data;
+	__be32 *shim;
+	u32 old;
+
+	MPLS_ENTER;
+	/* Nothing to swap on packets that were not labelled */
+	if (unlikely(skb->protocol != htons(ETH_P_MPLS_UC) ||
+		     cb->popped_bos)) {
+		MPLS_EXIT;
+		return MPLS_RESULT_DROP;
+	}
+
+	/* the header was unshared by skb_cow_head() if the skb is a clone */
+	shim = (__be32 *)skb->data;
+	old = ntohl(get_unaligned(shim));
+	/* the EXP is kept, unless a POLICE on the way in remarked it */
+	if (cb->set_exp)
+		old = (old & ~__MPLS_LABEL_EXP_MASK) |
+			((cb->exp & cb->set_exp & 0x7) << 9);
+	put_unaligned(htonl(((ml->u.ml_gen & 0xFFFFF) << 12) |
+			(old & (__MPLS_LABEL_EXP_MASK | __MPLS_LABEL_S_BIT)) |
+			(cb->ttl & 0xFF)), shim);
+	cb->label = ml->u.ml_gen;
+	cb->set_exp = 0;
+
+	MPLS_EXIT;
+	return MPLS_RESULT_SUCCESS;
+}
+
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_swap)
+{
+	struct mpls_label *ml = &instr->mir_swap;
+
+	MPLS_ENTER;
+	if (unlikely(direction != MPLS_OUT)) {
+		MPLS_DEBUG("SWAP only valid for outgoing labels\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+	if (ml->ml_type != MPLS_LABEL_GEN) {
+		MPLS_DEBUG("invalid label type (%d)\n", ml->ml_type);
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	memcpy(*data, ml, sizeof(*ml));
+	MPLS_EXIT;
+	return 0;
+}
+
+
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_swap)
+{
+	struct mpls_label *ml = data;
+	MPLS_ENTER;
+
+	memcpy(&instr->mir_swap, ml, sizeof(*ml));
+
 	MPLS_EXIT;
 }
 
@@ -366,10 +518,14 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_push)
  * LAST   : true
  *********************************************************************/
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_fwd)
+MPLS_OPCODE_PROTOTYPE(mpls_op_fwd)
 {
 	MPLS_ENTER;
-	BUG_ON(!data);
+	/* the xconnect may be going away under us */
+	if (unlikely(!data)) {
+		MPLS_EXIT;
+		return MPLS_RESULT_DROP;
+	}
 	*nhlfe = (struct mpls_nhlfe *)data;
 	MPLS_EXIT;
 	return MPLS_RESULT_FWD;
@@ -394,7 +550,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_fwd)
 	 * Get NHLFE to apply given key
 	 */
 	key = mpls_label2key(0, &instr->mir_fwd);
-	nhlfe = mpls_get_nhlfe(key);
+	nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction), key);
 	if (unlikely(!nhlfe)) {
 		MPLS_DEBUG("FWD: NHLFE key %08x not found\n", key);
 		MPLS_EXIT;
@@ -431,7 +587,8 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_fwd)
 	if (!data)
 		return;
 	/* Remove parent NHLFE from this NHLFE list */
-	mpls_list_del_init(&_mpls_as_ilm(parent)->nhlfe_entry);
+	if (parent)
+		mpls_list_del_init(&_mpls_as_ilm(parent)->nhlfe_entry);
 	mpls_nhlfe_release(_mpls_as_nhlfe(data));
 	MPLS_EXIT;
 }
@@ -455,7 +612,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_fwd)
 
 #ifdef CONFIG_NETFILTER
 
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_nf_fwd)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_nf_fwd)
 {
 	struct mpls_nfmark_fwd_info *nfi = data;
 	MPLS_ENTER;
@@ -503,7 +660,8 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_nf_fwd)
 		if (!key)
 			continue;
 
-		nhlfe = mpls_get_nhlfe(key);
+		nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction),
+				key);
 		if (unlikely(!nhlfe)) {
 			MPLS_DEBUG("NF_FWD: NHLFE - key %08x not found\n", key);
 			kfree(nfi);
@@ -591,7 +749,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_nf_fwd)
  * LAST   : true
  *********************************************************************/
 
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_ds_fwd)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_ds_fwd)
 {
 	struct mpls_dsmark_fwd_info *dfi = data;
 	unsigned char ds;
@@ -643,7 +801,8 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_ds_fwd)
 		if (!key)
 			continue;
 
-		nhlfe = mpls_get_nhlfe(key);
+		nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction),
+				key);
 		if (unlikely(!nhlfe)) {
 			MPLS_DEBUG("DS_FWD: NHLFE key %08x not found\n", key);
 			kfree(dfi);
@@ -729,7 +888,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_ds_fwd)
  * LAST   : true
  *********************************************************************/
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_exp_fwd)
+MPLS_OPCODE_PROTOTYPE(mpls_op_exp_fwd)
 {
 	struct mpls_exp_fwd_info *efi = data;
 	/*
@@ -770,7 +929,8 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_exp_fwd)
 		if (!key)
 			continue;
 
-		nhlfe = mpls_get_nhlfe(key);
+		nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction),
+				key);
 		if (unlikely(!nhlfe)) {
 			MPLS_DEBUG("EXP_FWD: NHLFE key %08x not found\n", key);
 			kfree(efi);
@@ -850,7 +1010,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_exp_fwd)
  *          (cf. mpls_init.c) will change this opcode.
  *********************************************************************/
 
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_set)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_set)
 {
 	struct dst_entry *dst = &(_mpls_as_nhlfe(data))->dst;
 
@@ -858,12 +1018,15 @@ inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_set)
 	/* Don't hold the dev we place in skb->dev, the dst is already
 	   holding it for us */
 	skb_set_dev(*pskb, dst->dev);
-	mpls_nhlfe_hold(*nhlfe); /* dst_hold */
 
 	/*
-	 * Update the dst field of the skbuff in "real time"
+	 * Update the dst field of the skbuff in "real time". We run under
+	 * rcu_read_lock_bh (cf. mpls_finish_output), no reference needed.
 	 */
-	skb_dst_set(*pskb, dst);
+	if (skb_dst(*pskb) != dst) {
+		skb_dst_drop(*pskb);
+		skb_dst_set_noref(*pskb, dst);
+	}
 
 	MPLS_EXIT;
 
@@ -892,7 +1055,7 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_set)
 	}
 
 	if_index = instr->mir_set.mni_if;
-	dev = dev_get_by_index(&init_net, if_index);
+	dev = dev_get_by_index(mpls_nhlfe_net(nhlfe), if_index);
 
 	if (unlikely(!dev)) {
 		MPLS_DEBUG("SET if_index %d unknown\n", if_index);
@@ -979,7 +1142,8 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_set)
 	struct dst_entry *dst;
 
 	MPLS_ENTER;
-	if (!data)
+	/* data is the parent itself, nothing else to release */
+	if (!data || !parent)
 		return;
 
 	dst = &nhlfe->dst;
@@ -1008,7 +1172,7 @@ MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_set)
  * LAST   : false
  *********************************************************************/
 #ifdef CONFIG_NET_SCHED
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_set_tc)
+MPLS_OPCODE_PROTOTYPE(mpls_op_set_tc)
 {
 	unsigned short *tc = NULL;
 	MPLS_ENTER;
@@ -1061,7 +1225,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_set_tc)
  *********************************************************************/
 #ifdef CONFIG_NET_SCHED
 
-inline MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_set_ds)
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_set_ds)
 {
 	unsigned short *ds = data;
 	MPLS_ENTER;
@@ -1114,14 +1278,14 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_set_ds)
  * EXEC   : mpls_op_set_exp
  * BUILD  : mpls_build_opcode_set_exp
  * UNBUILD: mpls_unbuild_opcode_set_exp
- * CLEAN  : mpls_clean_opcode_generic
+ * CLEAN  : NULL
  * INPUT  : true
  * OUTPUT : true
- * DATA   : EXP value (binary 000-111) (unsigned char *)
+ * DATA   : EXP value (binary 000-111) (unsigned char *), in the instruction
  * LAST   : false
  *********************************************************************/
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_set_exp)
+MPLS_OPCODE_PROTOTYPE(mpls_op_set_exp)
 {
 
 	unsigned char *exp = data;
@@ -1144,32 +1308,249 @@ MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_set_exp)
 		return -EINVAL;
 	}
 
-	*data = NULL;
-	exp = kzalloc(sizeof(*exp), GFP_ATOMIC);
-	if (unlikely(!exp)) {
-		MPLS_DEBUG("SET_EXP error building EXP info\n");
+	if (instr->mir_set_exp >= MPLS_EXP_NUM) {
+		MPLS_DEBUG("SET_EXP EXP(%d) too big\n", instr->mir_set_exp);
 		MPLS_EXIT;
-		return -ENOMEM;
+		return -EINVAL;
 	}
+	exp = *data;
 	*exp = instr->mir_set_exp;
-	if (*exp >= MPLS_EXP_NUM) {
-		MPLS_DEBUG("SET_EXP EXP(%d) too big\n", *exp);
-		kfree(exp);
+	MPLS_EXIT;
+	return 0;
+}
+
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_set_exp)
+{
+	MPLS_ENTER;
+	instr->mir_set_exp = *(unsigned char *)data;
+	MPLS_EXIT;
+}
+
+
+
+/*********************************************************************
+ * MPLS_OP_POLICE
+ * DESC   : "Meter the LSP against a token bucket, drop or remark the"
+ *          "EXP of the packets out of profile"
+ * EXEC   : mpls_in_op_police, mpls_out_op_police
+ * BUILD  : mpls_build_opcode_police
+ * UNBUILD: mpls_unbuild_opcode_police
+ * CLEAN  : mpls_clean_opcode_police
+ * INPUT  : true
+ * OUTPUT : true
+ * DATA   : pi (struct mpls_police_info*)
+ * LAST   : false
+ * Remark : The bucket is a GCRA: a single 64 bit word advanced with
+ *          cmpxchg, no lock is taken. Each cpu takes credit from it in
+ *          batches of pi_batch_ns and pays its packets from that credit,
+ *          so a conforming packet only writes per cpu data. The credit
+ *          left on the cpus is at most half the burst.
+ *          A remark goes in the label on top of an outgoing packet,
+ *          otherwise in the next label SWAPped or PUSHed.
+ *********************************************************************/
+
+/*
+ * (a * mul) >> shift without losing the high bits of the 96 bit product,
+ * for shift < 32: a burst of 4 GB at 1 kbit/s costs more than 2^64 before
+ * the shift.
+ */
+static u64 mpls_police_mul_shr(u64 a, u32 mul, unsigned int shift)
+{
+	u32 ah = a >> 32, al = a;
+	u64 ret;
+
+	ret = ((u64)al * mul) >> shift;
+	if (ah)
+		ret += ((u64)ah * mul) << (32 - shift);
+	return ret;
+}
+
+static inline int mpls_police_conform(struct mpls_police_info *pi,
+		struct mpls_police_counters *pc, unsigned int len)
+{
+	s64 cost = (len * pi->pi_mult) >> MPLS_POLICE_SHIFT;
+	s64 now, old, tat, take;
+
+	if (likely(pc->credit >= cost)) {
+		pc->credit -= cost;
+		return 1;
+	}
+
+	/* what the packet still lacks, and the next batch */
+	take = cost - pc->credit + pi->pi_batch_ns;
+	now = ktime_to_ns(ktime_get());
+	do {
+		old = atomic64_read(&pi->pi_tat);
+		tat = max(old, now);
+		if (tat - now > pi->pi_burst_ns)
+			return 0;
+	} while (atomic64_cmpxchg(&pi->pi_tat, old, tat + take) != old);
+	pc->credit = pi->pi_batch_ns;
+	return 1;
+}
+
+static int mpls_op_police(struct sk_buff *skb, struct mpls_police_info *pi,
+		enum mpls_dir dir)
+{
+	struct mpls_police_counters *pc = this_cpu_ptr(pi->pi_stats);
+	struct mpls_skb_cb *cb = MPLSCB(skb);
+	__be32 *shim;
+
+	if (mpls_police_conform(pi, pc, skb->len)) {
+		u64_stats_update_begin(&pc->syncp);
+		pc->conform_packets++;
+		pc->conform_bytes += skb->len;
+		u64_stats_update_end(&pc->syncp);
+		return MPLS_RESULT_SUCCESS;
+	}
+
+	u64_stats_update_begin(&pc->syncp);
+	pc->exceed_packets++;
+	pc->exceed_bytes += skb->len;
+	u64_stats_update_end(&pc->syncp);
+
+	if (pi->pi_conf.mp_action == MPLS_POLICE_DROP)
+		return MPLS_RESULT_DROP;
+
+	/* the header was unshared by skb_cow_head() on the way out */
+	if (dir == MPLS_OUT && skb->protocol == htons(ETH_P_MPLS_UC)) {
+		shim = (__be32 *)skb->data;
+		put_unaligned((get_unaligned(shim) &
+				~htonl(__MPLS_LABEL_EXP_MASK)) |
+				htonl(pi->pi_conf.mp_exp << 9), shim);
+		return MPLS_RESULT_SUCCESS;
+	}
+
+	cb->exp = pi->pi_conf.mp_exp;
+	cb->set_exp = 0x7;
+	return MPLS_RESULT_SUCCESS;
+}
+
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_police)
+{
+	int ret;
+
+	MPLS_ENTER;
+	ret = mpls_op_police(*pskb, data, MPLS_IN);
+	MPLS_EXIT;
+	return ret;
+}
+
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_police)
+{
+	int ret;
+
+	MPLS_ENTER;
+	ret = mpls_op_police(*pskb, data, MPLS_OUT);
+	MPLS_EXIT;
+	return ret;
+}
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_police)
+{
+	struct mpls_police *mp = &instr->mir_police;
+	struct mpls_police_info *pi;
+
+	MPLS_ENTER;
+	*data = NULL;
+	if (!mp->mp_rate || !mp->mp_burst ||
+	    mp->mp_action >= MPLS_POLICE_ACTION_MAX ||
+	    mp->mp_exp >= MPLS_EXP_NUM) {
+		MPLS_DEBUG("POLICE invalid rate/burst/action/EXP\n");
 		MPLS_EXIT;
 		return -EINVAL;
 	}
-	*data = (void *)exp;
+
+	pi = kzalloc(sizeof(*pi), GFP_ATOMIC);
+	if (unlikely(!pi))
+		goto nomem;
+	pi->pi_stats = alloc_percpu(struct mpls_police_counters);
+	if (unlikely(!pi->pi_stats)) {
+		kfree(pi);
+		goto nomem;
+	}
+
+	/* 8 * 10^6 ns per byte at 1 kbit/s */
+	pi->pi_mult = div_u64((u64)8 * NSEC_PER_MSEC << MPLS_POLICE_SHIFT,
+			mp->mp_rate);
+	pi->pi_burst_ns = mpls_police_mul_shr(pi->pi_mult, mp->mp_burst,
+			MPLS_POLICE_SHIFT);
+	/* all the cpus together hold at most half the burst */
+	pi->pi_batch_ns = div_u64(pi->pi_burst_ns, 2 * num_possible_cpus());
+	atomic64_set(&pi->pi_tat, 0);
+	pi->pi_conf = *mp;
+	*data = pi;
 	MPLS_EXIT;
 	return 0;
+
+nomem:
+	MPLS_DEBUG("POLICE error building police info\n");
+	MPLS_EXIT;
+	return -ENOMEM;
 }
 
-MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_set_exp)
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_police)
 {
 	MPLS_ENTER;
-	instr->mir_set_exp = *(unsigned char *)data;
+	instr->mir_police = _mpls_as_pi(data)->pi_conf;
+	MPLS_EXIT;
+}
+
+MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_police)
+{
+	MPLS_ENTER;
+	free_percpu(_mpls_as_pi(data)->pi_stats);
+	kfree(data);
 	MPLS_EXIT;
 }
 
+/**
+ *	mpls_police_stats_fold - Sum up the counters of the POLICE opcode.
+ *	@ps:    netlink counters [OUT]
+ *	@instr: program of an ILM/NHLFE
+ *
+ *	Returns 0 if the program doesn't police.
+ **/
+
+int mpls_police_stats_fold(struct mpls_police_stats *ps,
+		struct mpls_instr *instr)
+{
+	struct mpls_police_info *pi;
+	struct mpls_instr *mi;
+	int cpu;
+
+	for_each_instr(instr, mi) {
+		if (mi->mi_opcode == MPLS_OP_POLICE)
+			break;
+	}
+	if (!mi)
+		return 0;
+
+	pi = mi->mi_data;
+	memset(ps, 0, sizeof(*ps));
+	for_each_possible_cpu(cpu) {
+		const struct mpls_police_counters *pc =
+			per_cpu_ptr(pi->pi_stats, cpu);
+		u64 cp, cb, ep, eb;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&pc->syncp);
+			cp = pc->conform_packets;
+			cb = pc->conform_bytes;
+			ep = pc->exceed_packets;
+			eb = pc->exceed_bytes;
+		} while (u64_stats_fetch_retry_bh(&pc->syncp, start));
+
+		ps->mps_conform_packets += cp;
+		ps->mps_conform_bytes   += cb;
+		ps->mps_exceed_packets  += ep;
+		ps->mps_exceed_bytes    += eb;
+	}
+	return 1;
+}
+EXPORT_SYMBOL(mpls_police_stats_fold);
+
 
 
 /*********************************************************************
@@ -1188,7 +1569,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_set_exp)
 
 #ifdef CONFIG_NET_SCHED
 
-inline MPLS_OPCODE_PROTOTYPE(mpls_op_exp2tc)
+MPLS_OPCODE_PROTOTYPE(mpls_op_exp2tc)
 {
 	struct mpls_exp2tcindex_info *e2ti = NULL;
 
@@ -1265,7 +1646,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_exp2tc)
  * DATA   : e2di (struct mpls_exp2dsmark_info*) - No ILM/NHLFE are held.
  * LAST   : false
  *********************************************************************/
-inline MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_exp2ds)
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_exp2ds)
 {
 	struct mpls_exp2dsmark_info *e2di = data;
 	unsigned short ds = MPLSCB(*pskb)->exp & 0x7;
@@ -1338,7 +1719,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_exp2ds)
  *********************************************************************/
 #ifdef CONFIG_NET_SCHED
 
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_tc2exp)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_tc2exp)
 {
 	struct mpls_tcindex2exp_info *t2ei = data;
 	unsigned short tc;
@@ -1429,7 +1810,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_tc2exp)
  * DATA   : d2ei (struct mpls_dsmark2exp_info*) - No ILM/NHLFE are held.
  * LAST   : false
  *********************************************************************/
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_ds2exp)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_ds2exp)
 {
 	struct mpls_dsmark2exp_info *d2ei = data;
 	unsigned char ds;
@@ -1526,7 +1907,7 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_ds2exp)
  *********************************************************************/
 
 #ifdef CONFIG_NETFILTER
-inline MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_nf2exp)
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_nf2exp)
 {
 	struct mpls_nfmark2exp_info *n2ei = NULL;
 	unsigned short nf = 0;
@@ -1613,6 +1994,442 @@ MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_nf2exp)
 
 
 
+/*********************************************************************
+ * MPLS_OP_HASH_FWD
+ * DESC   : "Forward packet, applying the NHLFE selected by the flow hash"
+ * EXEC   : mpls_out_op_hash_fwd
+ * BUILD  : mpls_build_opcode_hash_fwd
+ * UNBUILD: mpls_unbuild_opcode_hash_fwd
+ * CLEAN  : mpls_clean_opcode_hash_fwd
+ * INPUT  : false
+ * OUTPUT : true
+ * DATA   : HFI object (struct mpls_hash_fwd_info*)
+ *	o Each hfi_nhlfe element holds a ref to a NHLFE object
+ * LAST   : true
+ *
+ * Remark : Multipath NHLFE. The child is picked by skb_get_rxhash(),
+ *          which covers the label stack and the inner IP header, so the
+ *          packets of a flow keep using the same child. The weights
+ *          split the hash space between the children.
+ *********************************************************************/
+
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_hash_fwd)
+{
+	struct mpls_hash_fwd_info *hfi = data;
+	u32 w;
+	int i;
+
+	MPLS_ENTER;
+	w = ((u64)skb_get_rxhash(*pskb) * hfi->hfi_total) >> 32;
+	for (i = 0; i < hfi->hfi_count - 1; i++) {
+		if (w < hfi->hfi_weight[i])
+			break;
+		w -= hfi->hfi_weight[i];
+	}
+	*nhlfe = hfi->hfi_nhlfe[i];
+	MPLS_EXIT;
+	return MPLS_RESULT_FWD;
+}
+
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_hash_fwd)
+{
+	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
+	struct mpls_hash_fwd_info *hfi = NULL;
+	unsigned int min_mtu = MPLS_INVALID_MTU;
+	unsigned short header_len = 0;
+	struct mpls_nhlfe *nhlfe = NULL;
+	unsigned int key = 0;
+	int j = 0;
+
+	MPLS_ENTER;
+	*data = NULL;
+	if (direction != MPLS_OUT) {
+		MPLS_DEBUG("HASH_FWD only valid for outgoing labels\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	/* Allocate HFI object to store in data */
+	hfi = kzalloc(sizeof(*hfi), GFP_ATOMIC);
+	if (unlikely(!hfi)) {
+		MPLS_DEBUG("HASH_FWD error building hash info\n");
+		MPLS_EXIT;
+		return -ENOMEM;
+	}
+
+	for (j = 0; j < MPLS_HASH_NUM; j++) {
+		key = instr->mir_hash_fwd.hf_key[j];
+		if (!key)
+			continue;
+
+		nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction),
+				key);
+		if (unlikely(!nhlfe || nhlfe->nhlfe_key == pnhlfe->nhlfe_key ||
+				!nhlfe->nhlfe_proto)) {
+			MPLS_DEBUG("HASH_FWD: NHLFE - key %08x not usable\n",
+					key);
+			if (nhlfe)
+				mpls_nhlfe_release(nhlfe);
+			goto rollback;
+		}
+		if (dst_mtu(&nhlfe->dst) < min_mtu)
+			min_mtu = dst_mtu(&nhlfe->dst);
+		if (nhlfe->dst.header_len > header_len)
+			header_len = nhlfe->dst.header_len;
+
+		hfi->hfi_nhlfe[hfi->hfi_count] = nhlfe;
+		hfi->hfi_weight[hfi->hfi_count] =
+			instr->mir_hash_fwd.hf_weight[j] ? : 1;
+		hfi->hfi_total += hfi->hfi_weight[hfi->hfi_count];
+		hfi->hfi_count++;
+	}
+
+	if (!hfi->hfi_count) {
+		MPLS_DEBUG("HASH_FWD: no next hop\n");
+		goto rollback;
+	}
+
+	/*
+	 * The children decide the device; the multipath NHLFE only needs
+	 * one for headroom and statistics, like PEEK
+	 */
+	pnhlfe->nhlfe_proto = mpls_proto_find_by_family(
+			hfi->hfi_nhlfe[0]->nhlfe_proto->family);
+	if (unlikely(!pnhlfe->nhlfe_proto))
+		goto rollback;
+	pnhlfe->dst.dev = mpls_nhlfe_net(pnhlfe)->loopback_dev;
+	dev_hold(pnhlfe->dst.dev);
+	/* on top of what the PUSHes before us need */
+	hfi->hfi_header_len = header_len;
+	pnhlfe->dst.header_len += header_len;
+	dst_metric_set(&pnhlfe->dst, RTAX_MTU, min_mtu);
+	pnhlfe->nhlfe_mtu_limit = min_mtu;
+
+	*data = (void *)hfi;
+	*last_able = 1;
+	MPLS_EXIT;
+	return 0;
+
+rollback:
+	for (j = 0; j < hfi->hfi_count; j++)
+		mpls_nhlfe_release(hfi->hfi_nhlfe[j]);
+	kfree(hfi);
+	MPLS_EXIT;
+	return -ESRCH;
+}
+
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_hash_fwd)
+{
+	struct mpls_hash_fwd_info *hfi = data;
+	int j;
+
+	MPLS_ENTER;
+
+	for (j = 0; j < hfi->hfi_count; j++) {
+		instr->mir_hash_fwd.hf_key[j] = hfi->hfi_nhlfe[j]->nhlfe_key;
+		instr->mir_hash_fwd.hf_weight[j] = hfi->hfi_weight[j];
+	}
+	for (; j < MPLS_HASH_NUM; j++) {
+		instr->mir_hash_fwd.hf_key[j] = 0;
+		instr->mir_hash_fwd.hf_weight[j] = 0;
+	}
+
+	MPLS_EXIT;
+}
+
+MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_hash_fwd)
+{
+	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
+	int j;
+
+	MPLS_ENTER;
+	if (!data)
+		return;
+
+	for (j = 0; j < _mpls_as_hfi(data)->hfi_count; j++)
+		mpls_nhlfe_release(_mpls_as_hfi(data)->hfi_nhlfe[j]);
+
+	if (pnhlfe) {
+		mpls_proto_release(pnhlfe->nhlfe_proto);
+		pnhlfe->nhlfe_proto = NULL;
+		dev_put(pnhlfe->dst.dev);
+		pnhlfe->dst.dev = NULL;
+		pnhlfe->dst.header_len -= _mpls_as_hfi(data)->hfi_header_len;
+	}
+
+	kfree(data);
+	MPLS_EXIT;
+}
+
+
+
+/*********************************************************************
+ * MPLS_OP_VRF
+ * DESC   : "Pop the VPN label and deliver the payload in a VRF"
+ * EXEC   : mpls_in_op_vrf
+ * BUILD  : mpls_build_opcode_vrf
+ * UNBUILD: mpls_unbuild_opcode_vrf
+ * CLEAN  : mpls_clean_opcode_generic
+ * INPUT  : true
+ * OUTPUT : false
+ * DATA   : ifindex of the device of the VRF (unsigned int*)
+ * LAST   : true
+ *
+ * Remark : L3VPN egress straight from the ILM: no NHLFE, no POP/PEEK.
+ *          The payload is received on the VRF device, so the IPv4 route
+ *          cache, keyed on the input interface, resolves it in the VRF
+ *          table (ip rules are only walked on a cache miss). The device
+ *          is looked up per packet, no reference is held on it.
+ *********************************************************************/
+
+MPLS_IN_OPCODE_PROTOTYPE(mpls_in_op_vrf)
+{
+	struct sk_buff *skb = *pskb;
+	struct net_device *dev;
+
+	MPLS_ENTER;
+	/* the VPN label is the bottom one */
+	if (unlikely(!MPLSCB(skb)->bos ||
+		     !pskb_may_pull(skb, MPLS_HDR_LEN + 1)))
+		goto drop;
+
+	dev = dev_get_by_index_rcu(mpls_ilm_net(ilm),
+			*(unsigned int *)data);
+	if (unlikely(!dev || !(dev->flags & IFF_UP)))
+		goto drop;
+
+	skb_pull(skb, MPLS_HDR_LEN);
+	skb_reset_network_header(skb);
+	switch (ip_hdr(skb)->version) {
+	case 4:
+		skb->protocol = htons(ETH_P_IP);
+		break;
+	case 6:
+		skb->protocol = htons(ETH_P_IPV6);
+		break;
+	default:
+		goto drop;
+	}
+
+	secpath_reset(skb);
+	skb->mac_header = skb->network_header;
+	skb->pkt_type = PACKET_HOST;
+	__skb_tunnel_rx(skb, dev);
+
+	MPLS_EXIT;
+	return MPLS_RESULT_DLV;
+drop:
+	MPLS_EXIT;
+	return MPLS_RESULT_DROP;
+}
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_vrf)
+{
+	struct net_device *dev;
+
+	MPLS_ENTER;
+	*data = NULL;
+	if (direction != MPLS_IN) {
+		MPLS_DEBUG("VRF only valid for incoming labels\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	dev = dev_get_by_index(mpls_ilm_net(_mpls_as_ilm(parent)),
+			instr->mir_vrf);
+	if (unlikely(!dev)) {
+		MPLS_DEBUG("VRF if_index %u unknown\n", instr->mir_vrf);
+		MPLS_EXIT;
+		return -ESRCH;
+	}
+	dev_put(dev);
+
+	*data = kmemdup(&instr->mir_vrf, sizeof(instr->mir_vrf), GFP_ATOMIC);
+	if (unlikely(!(*data))) {
+		MPLS_EXIT;
+		return -ENOMEM;
+	}
+
+	*last_able = 1;
+	MPLS_EXIT;
+	return 0;
+}
+
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_vrf)
+{
+	MPLS_ENTER;
+	instr->mir_vrf = *(unsigned int *)data;
+	MPLS_EXIT;
+}
+
+
+
+/*********************************************************************
+ * MPLS_OP_P2MP_FWD
+ * DESC   : "Replicate packet, applying every NHLFE of the set"
+ * EXEC   : mpls_out_op_p2mp_fwd
+ * BUILD  : mpls_build_opcode_p2mp_fwd
+ * UNBUILD: mpls_unbuild_opcode_p2mp_fwd
+ * CLEAN  : mpls_clean_opcode_p2mp_fwd
+ * INPUT  : false
+ * OUTPUT : true
+ * DATA   : PFI object (struct mpls_p2mp_fwd_info*)
+ *	o Each pfi_nhlfe element holds a ref to a NHLFE object
+ * LAST   : true
+ *
+ * Remark : Point-to-multipoint NHLFE. Each branch but the last gets a
+ *          skb_clone() sent by mpls_output_branch(), the last one goes
+ *          on with the packet itself. Clones share the data, so only
+ *          the header is copied when a branch writes its label stack;
+ *          paged payload is never copied.
+ *********************************************************************/
+
+MPLS_OUT_OPCODE_PROTOTYPE(mpls_out_op_p2mp_fwd)
+{
+	struct mpls_p2mp_fwd_info *pfi = data;
+	struct sk_buff *clone;
+	int i;
+
+	MPLS_ENTER;
+	for (i = 0; i < pfi->pfi_count - 1; i++) {
+		clone = skb_clone(*pskb, GFP_ATOMIC);
+		if (likely(clone))
+			mpls_output_branch(clone, pfi->pfi_nhlfe[i]);
+		else
+			mpls_lsp_stats_drop(pfi->pfi_nhlfe[i]->nhlfe_stats);
+	}
+	*nhlfe = pfi->pfi_nhlfe[i];
+	MPLS_EXIT;
+	return MPLS_RESULT_FWD;
+}
+
+
+MPLS_BUILD_OPCODE_PROTOTYPE(mpls_build_opcode_p2mp_fwd)
+{
+	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
+	struct mpls_p2mp_fwd_info *pfi = NULL;
+	unsigned int min_mtu = MPLS_INVALID_MTU;
+	unsigned short header_len = 0;
+	struct mpls_nhlfe *nhlfe = NULL;
+	unsigned int key = 0;
+	int j = 0;
+
+	MPLS_ENTER;
+	*data = NULL;
+	if (direction != MPLS_OUT) {
+		MPLS_DEBUG("P2MP_FWD only valid for outgoing labels\n");
+		MPLS_EXIT;
+		return -EINVAL;
+	}
+
+	/* Allocate PFI object to store in data */
+	pfi = kzalloc(sizeof(*pfi), GFP_ATOMIC);
+	if (unlikely(!pfi)) {
+		MPLS_DEBUG("P2MP_FWD error building branch info\n");
+		MPLS_EXIT;
+		return -ENOMEM;
+	}
+
+	for (j = 0; j < MPLS_P2MP_NUM; j++) {
+		key = instr->mir_p2mp_fwd.pf_key[j];
+		if (!key)
+			continue;
+
+		nhlfe = mpls_get_nhlfe(mpls_parent_net(parent, direction),
+				key);
+		if (unlikely(!nhlfe || nhlfe->nhlfe_key == pnhlfe->nhlfe_key ||
+				!nhlfe->nhlfe_proto)) {
+			MPLS_DEBUG("P2MP_FWD: NHLFE - key %08x not usable\n",
+					key);
+			if (nhlfe)
+				mpls_nhlfe_release(nhlfe);
+			goto rollback;
+		}
+		if (dst_mtu(&nhlfe->dst) < min_mtu)
+			min_mtu = dst_mtu(&nhlfe->dst);
+		if (nhlfe->dst.header_len > header_len)
+			header_len = nhlfe->dst.header_len;
+
+		pfi->pfi_nhlfe[pfi->pfi_count++] = nhlfe;
+	}
+
+	if (!pfi->pfi_count) {
+		MPLS_DEBUG("P2MP_FWD: no branch\n");
+		goto rollback;
+	}
+
+	/*
+	 * The branches decide the devices; the P2MP NHLFE only needs one
+	 * for headroom and statistics, like HASH_FWD. Its MTU is the
+	 * smallest one, so that every branch can carry the packet.
+	 */
+	pnhlfe->nhlfe_proto = mpls_proto_find_by_family(
+			pfi->pfi_nhlfe[0]->nhlfe_proto->family);
+	if (unlikely(!pnhlfe->nhlfe_proto))
+		goto rollback;
+	pnhlfe->dst.dev = mpls_nhlfe_net(pnhlfe)->loopback_dev;
+	dev_hold(pnhlfe->dst.dev);
+	/* on top of what the PUSHes before us need */
+	pfi->pfi_header_len = header_len;
+	pnhlfe->dst.header_len += header_len;
+	dst_metric_set(&pnhlfe->dst, RTAX_MTU, min_mtu);
+	pnhlfe->nhlfe_mtu_limit = min_mtu;
+
+	*data = (void *)pfi;
+	*last_able = 1;
+	MPLS_EXIT;
+	return 0;
+
+rollback:
+	for (j = 0; j < pfi->pfi_count; j++)
+		mpls_nhlfe_release(pfi->pfi_nhlfe[j]);
+	kfree(pfi);
+	MPLS_EXIT;
+	return -ESRCH;
+}
+
+MPLS_UNBUILD_OPCODE_PROTOTYPE(mpls_unbuild_opcode_p2mp_fwd)
+{
+	struct mpls_p2mp_fwd_info *pfi = data;
+	int j;
+
+	MPLS_ENTER;
+
+	for (j = 0; j < pfi->pfi_count; j++)
+		instr->mir_p2mp_fwd.pf_key[j] = pfi->pfi_nhlfe[j]->nhlfe_key;
+	for (; j < MPLS_P2MP_NUM; j++)
+		instr->mir_p2mp_fwd.pf_key[j] = 0;
+
+	MPLS_EXIT;
+}
+
+MPLS_CLEAN_OPCODE_PROTOTYPE(mpls_clean_opcode_p2mp_fwd)
+{
+	struct mpls_nhlfe *pnhlfe = _mpls_as_nhlfe(parent);
+	int j;
+
+	MPLS_ENTER;
+	if (!data)
+		return;
+
+	for (j = 0; j < _mpls_as_pfi(data)->pfi_count; j++)
+		mpls_nhlfe_release(_mpls_as_pfi(data)->pfi_nhlfe[j]);
+
+	if (pnhlfe) {
+		mpls_proto_release(pnhlfe->nhlfe_proto);
+		pnhlfe->nhlfe_proto = NULL;
+		dev_put(pnhlfe->dst.dev);
+		pnhlfe->dst.dev = NULL;
+		pnhlfe->dst.header_len -= _mpls_as_pfi(data)->pfi_header_len;
+	}
+
+	kfree(data);
+	MPLS_EXIT;
+}
+
+
+
 /*********************************************************************
  * Main data type to hold metainformation on opcodes
  * IN      : Function pointer to execute in ILM object
@@ -1740,7 +2557,7 @@ struct mpls_ops mpls_ops[MPLS_OP_MAX] = {
 			.out     = mpls_op_set_exp,
 			.build   = mpls_build_opcode_set_exp,
 			.unbuild = mpls_unbuild_opcode_set_exp,
-			.cleanup = mpls_clean_opcode_generic,
+			.cleanup = NULL,
 			.extra   = 0,
 			.msg     = "SET_EXP",
 	},
@@ -1795,4 +2612,58 @@ struct mpls_ops mpls_ops[MPLS_OP_MAX] = {
 			.msg     = "NF2EXP",
 	},
 #endif
+	[MPLS_OP_HASH_FWD] = {
+			.in      = NULL,
+			.out     = mpls_out_op_hash_fwd,
+			.build   = mpls_build_opcode_hash_fwd,
+			.unbuild = mpls_unbuild_opcode_hash_fwd,
+			.cleanup = mpls_clean_opcode_hash_fwd,
+			.extra   = 0,
+			.msg     = "HASH_FWD",
+	},
+	[MPLS_OP_SWAP] = {
+			.in      = NULL,
+			.out     = mpls_op_swap,
+			.build   = mpls_build_opcode_swap,
+			.unbuild = mpls_unbuild_opcode_swap,
+			.cleanup = NULL,
+			.extra   = 0,
+			.msg     = "SWAP",
+	},
+	[MPLS_OP_VRF] = {
+			.in      = mpls_in_op_vrf,
+			.out     = NULL,
+			.build   = mpls_build_opcode_vrf,
+			.unbuild = mpls_unbuild_opcode_vrf,
+			.cleanup = mpls_clean_opcode_generic,
+			.extra   = 0,
+			.msg     = "VRF",
+	},
+	[MPLS_OP_P2MP_FWD] = {
+			.in      = NULL,
+			.out     = mpls_out_op_p2mp_fwd,
+			.build   = mpls_build_opcode_p2mp_fwd,
+			.unbuild = mpls_unbuild_opcode_p2mp_fwd,
+			.cleanup = mpls_clean_opcode_p2mp_fwd,
+			.extra   = 0,
+			.msg     = "P2MP_FWD",
+	},
+	[MPLS_OP_PUSH_EL] = {
+			.in      = NULL,
+			.out     = mpls_op_push_el,
+			.build   = mpls_build_opcode_push_el,
+			.unbuild = NULL,
+			.cleanup = mpls_clean_opcode_push_el,
+			.extra   = 0,
+			.msg     = "PUSH_EL",
+	},
+	[MPLS_OP_POLICE] = {
+			.in      = mpls_in_op_police,
+			.out     = mpls_out_op_police,
+			.build   = mpls_build_opcode_police,
+			.unbuild = mpls_unbuild_opcode_police,
+			.cleanup = mpls_clean_opcode_police,
+			.extra   = 0,
+			.msg     = "POLICE",
+	},
 };
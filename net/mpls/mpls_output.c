@@ -27,6 +27,8 @@
 #include <linux/ip.h>
 #include <net/dsfield.h>
 #include <net/xfrm.h>
+#include <asm/unaligned.h>
+#include <trace/events/mpls.h>
 
 static inline int mpls_prepare_skb(
 		struct sk_buff *skb, 
@@ -45,21 +47,25 @@ static inline int mpls_prepare_skb(
 	return NET_XMIT_SUCCESS;
 }
 
+/*
+ * Last label popped: the protocol driver hands the packet directly to
+ * layer 3 instead of running it through netif_receive_skb() again.
+ */
 static int mpls_dlv_ip(struct sk_buff *skb)
 {
+	unsigned short ethertype;
+
 	if (ip_hdr(skb)->version == 4)
-		skb->protocol = htons(ETH_P_IP);
+		ethertype = htons(ETH_P_IP);
 	else if (ip_hdr(skb)->version == 6)
-		skb->protocol = htons(ETH_P_IPV6);
+		ethertype = htons(ETH_P_IPV6);
 	else {
 		return -EINVAL;
 	}
 
-	netif_receive_skb(skb);
-
 	MPLS_DEBUG("delivering\n");
 	MPLS_EXIT;
-	return NET_XMIT_SUCCESS;
+	return mpls_proto_deliver(skb, ethertype);
 }
 
 static int mpls_dlv_recurse(struct sk_buff *skb)
@@ -124,6 +130,54 @@ static inline int mpls_send(struct sk_buff *skb)
 	return -EINVAL;
 }
 
+/**
+ *	mpls_push_tmpl - Push a precompiled label stack.
+ *	@skb: Socket buffer, with enough headroom (cf. dst.header_len).
+ *	@pt:  Shims built by mpls_instrs_compile().
+ *
+ *	Same result as running the PUSH/PUSH_EL/SET_EXP opcodes of the
+ *	template one by one: the TTL goes in every shim but the entropy
+ *	label, the S bit in the bottom one if nothing is left below, and
+ *	the EXP remarked before the push (cb->set_exp) in the shim of the
+ *	first PUSH.
+ **/
+
+static inline void mpls_push_tmpl(struct sk_buff *skb,
+		const struct mpls_push_tmpl *pt)
+{
+	struct mpls_skb_cb *cb = MPLSCB(skb);
+	__be32 ttl = htonl(cb->ttl & 0xFF);
+	__be32 el = 0;
+	__be32 *shim;
+	unsigned int i;
+
+	/* hashed before the stack hides the payload */
+	if (pt->pt_el >= 0)
+		el = mpls_entropy_label(skb);
+
+	shim = (__be32 *)skb_push(skb, pt->pt_count * MPLS_HDR_LEN);
+	skb_reset_network_header(skb);
+
+	for (i = 0; i < pt->pt_count; i++)
+		put_unaligned(pt->pt_shim[i] | ttl, &shim[i]);
+	if (pt->pt_el >= 0)
+		put_unaligned(el, &shim[pt->pt_el]);
+
+	if (cb->set_exp && pt->pt_exp >= 0)
+		put_unaligned(get_unaligned(&shim[pt->pt_exp]) |
+			htonl((cb->exp & cb->set_exp & 0x7) << 9),
+			&shim[pt->pt_exp]);
+
+	if (cb->bos & cb->popped_bos & 0x1)
+		put_unaligned(get_unaligned(&shim[i - 1]) |
+			htonl(__MPLS_LABEL_S_BIT), &shim[i - 1]);
+
+	cb->label = pt->pt_label;
+	cb->bos = 0;
+	cb->set_exp = 0;
+	skb->protocol = htons(ETH_P_MPLS_UC);
+}
+
 /**
  *	mpls_finish_output - Apply out segment to socket buffer
  *	@sbk: Socket buffer.
@@ -131,6 +185,8 @@ static inline int mpls_send(struct sk_buff *skb)
  *
  *	This function is either called by mpls_switch or mpls_output, and
  *	iterates the set of output opcodes that are configured for this NHLFE.
+ *	It runs under rcu_read_lock_bh, so the NHLFEs met on the way can be
+ *	attached to the skb without taking a reference.
  **/
 
 static int mpls_finish_output(
@@ -140,6 +196,9 @@ static int mpls_finish_output(
 	struct mpls_instr *mi;
 	int ret = -EINVAL;
 	int ready_to_tx = 0;
+	int fwd_depth = 0;
+	int relookup = 0;
+	int reason = MPLS_DROP_NOMEM;
 	unsigned int packet_length;
 	struct net_device *dev = skb_dst(skb)->dev;
 
@@ -149,14 +208,39 @@ static int mpls_finish_output(
 
 	ready_to_tx = 0;
 
+	rcu_read_lock_bh();
+
 	if (skb_cow_head(skb, skb_dst(skb)->header_len) < 0)
 		goto out_discard;
 
 	/* Iterate all the opcodes for this NHLFE */
-	for_each_instr(nhlfe->nhlfe_instr, mi) {
-		int opcode = mi->mi_opcode;
-		void *data = mi->mi_data;
-		char *msg  = mpls_ops[opcode].msg;
+next_nhlfe:
+	trace_mpls_output(skb, nhlfe);
+	if (unlikely(nhlfe->nhlfe_frr)) {
+		/* local repair, the output device of this NHLFE failed */
+		struct mpls_nhlfe *backup =
+			rcu_dereference_bh(nhlfe->nhlfe_backup);
+
+		if (likely(backup)) {
+			nhlfe = backup;
+			goto switch_nhlfe;
+		}
+	}
+	for_each_instr(rcu_dereference_bh(nhlfe->nhlfe_instr), mi) {
+		unsigned int key = nhlfe->nhlfe_key;
+		int opcode, result;
+		void *data;
+		char *msg;
+
+		if (mi->mi_tmpl) {
+			/* precompiled PUSH run, go on with its SET */
+			mpls_push_tmpl(skb, mi->mi_tmpl);
+			mi = mi->mi_tmpl_set;
+		}
+
+		opcode = mi->mi_opcode;
+		data = mi->mi_data;
+		msg  = mpls_ops[opcode].msg;
 
 		MPLS_DEBUG("opcode %s\n", msg);
 
@@ -164,7 +248,9 @@ static int mpls_finish_output(
 			ready_to_tx = 1;
 		func = mpls_ops[opcode].out;
 		if (func) {
-			switch (func(&skb, NULL, &nhlfe, data)) {
+			result = func(&skb, NULL, &nhlfe, data);
+			trace_mpls_opcode(MPLS_OUT, key, opcode, result);
+			switch (result) {
 				case MPLS_RESULT_SUCCESS:
 					/*
 					 * it's ready to tx only if the opcode is SET
@@ -173,25 +259,43 @@ static int mpls_finish_output(
 						goto send;
 					break;
 				case MPLS_RESULT_DROP:
+					reason = MPLS_DROP_OPCODE;
 					goto out_drop;
 				case MPLS_RESULT_DLV:
+					reason = MPLS_DROP_DLV;
 					if (mpls_prepare_skb(skb, 
 						sizeof(struct iphdr), dev))
 						goto out_drop;			
 					goto dlv;
 				case MPLS_RESULT_RECURSE:
+					reason = MPLS_DROP_DLV;
 					if (mpls_prepare_skb(skb, 
 						MPLS_HDR_LEN, dev))
 						goto out_drop;
 					goto recourse;
 				case MPLS_RESULT_FWD:
-					/* Invalid on OUTPUT */
-					WARN_ON_ONCE(1);
-					goto out_drop;
+					goto switch_nhlfe;
 			}
 		}
 	}
+	reason = MPLS_DROP_NO_FWD;
 	goto out_drop;
+switch_nhlfe:
+	/*
+	 * Another NHLFE takes over (a multipath child selected by the
+	 * opcode, the last branch of a P2MP set, or the backup of a failed
+	 * NHLFE): go on with its program.
+	 */
+	if (unlikely(++fwd_depth > MPLS_FWD_MAX_DEPTH)) {
+		reason = MPLS_DROP_LOOP;
+		goto out_drop;
+	}
+	skb_dst_drop(skb);
+	skb_dst_set_noref(skb, &nhlfe->dst);
+	if (skb_cow_head(skb, nhlfe->dst.header_len) < 0)
+		goto out_discard;
+	dev = nhlfe->dst.dev;
+	goto next_nhlfe;
 dlv:
 	packet_length = skb->len;
 	ret = mpls_dlv_ip(skb);
@@ -201,20 +305,40 @@ dlv:
 	goto stats;
 recourse:
 	packet_length = skb->len;
+	if (MPLSCB(skb)->relookup) {
+		/* mpls_input() goes on with the next label in its loop */
+		relookup = 1;
+		ret = NET_XMIT_SUCCESS;
+		goto stats;
+	}
 	ret = mpls_dlv_recurse(skb);
 	if (ret)
 		goto out_drop;
 
 	goto stats;
 send:
-	if (skb->len > dev->mtu) {
-		int mtu = dst_mtu(&nhlfe->dst);
+	if (skb_is_gso(skb)) {
+		/* segmented below the label stack by the device */
+		if (skb->protocol == htons(ETH_P_MPLS_UC))
+			skb_shinfo(skb)->gso_type |= SKB_GSO_MPLS;
+		else
+			skb_shinfo(skb)->gso_type &= ~SKB_GSO_MPLS;
+	} else if (skb->len > skb_dst(skb)->dev->mtu) {
+		/*
+		 * the next hop is the dst SET left on the skb, the one of
+		 * the program we ran even if it was replaced meanwhile
+		 */
+		struct mpls_nhlfe *nh = container_of(skb_dst(skb),
+			struct mpls_nhlfe, dst);
+		int mtu = dst_mtu(&nh->dst);
 		MPLS_DEBUG("packet size %d"
 			" exceeded device MTU %d (%d)\n",
-			skb->len, dev->mtu, mtu);
-		ret = nhlfe->nhlfe_proto->mtu_exceeded(&skb, mtu);
-		if (ret)
+			skb->len, nh->dst.dev->mtu, mtu);
+		ret = nh->nhlfe_proto->mtu_exceeded(&skb, mtu);
+		if (ret) {
+			reason = MPLS_DROP_MTU;
 			goto out_drop;
+		}
 		/* Otherwise prot->mtu_exceeded() has returned a
 		 * modified skb that it wants to be forwarded
 		 * down the LSP */
@@ -225,30 +349,72 @@ send:
 	ret = mpls_send(skb);
 stats:
 	if (likely(ret == NET_XMIT_SUCCESS || ret == NET_XMIT_CN)) {
-		MPLS_INC_STATS(dev_net(dev), MPLS_MIB_OUTPACKETS);
-		MPLS_ADD_STATS(dev_net(dev), MPLS_MIB_OUTOCTETS,
+		MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_OUTPACKETS);
+		MPLS_ADD_STATS_BH(dev_net(dev), MPLS_MIB_OUTOCTETS,
 			packet_length);
-	} else
-		MPLS_INC_STATS(dev_net(dev), MPLS_MIB_OUTERRORS);
+		mpls_lsp_stats_add(nhlfe->nhlfe_stats, packet_length);
+	} else {
+		MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_OUTERRORS);
+		mpls_lsp_stats_drop(nhlfe->nhlfe_stats);
+	}
 out:
-
+	rcu_read_unlock_bh();
 	MPLS_EXIT;
-	return ret;
+	return relookup ? MPLS_RX_RELOOKUP : ret;
 
 out_drop:
 	/* kfree_skb() releases nhlfe entry
 	 * No need to call mpls_nhlfe_release()
 	 */
+	trace_mpls_drop(skb, MPLS_OUT, reason);
 	kfree_skb(skb);
-	MPLS_INC_STATS(dev_net(dev), MPLS_MIB_OUTERRORS);
+	MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_OUTERRORS);
+	mpls_lsp_stats_drop(nhlfe->nhlfe_stats);
 	goto out;
 out_discard:
+	trace_mpls_drop(skb, MPLS_OUT, MPLS_DROP_NOMEM);
 	kfree_skb(skb);
-	MPLS_INC_STATS(dev_net(dev), MPLS_MIB_OUTDISCARDS);
+	MPLS_INC_STATS_BH(dev_net(dev), MPLS_MIB_OUTDISCARDS);
+	mpls_lsp_stats_drop(nhlfe->nhlfe_stats);
 	goto out;
 }
 
 
+/* nesting of mpls_output_branch(), a P2MP branch may replicate again */
+static DEFINE_PER_CPU(unsigned int, mpls_branch_depth);
+
+/**
+ *	mpls_output_branch - Send one copy of a replicated packet.
+ *	@skb: clone of the packet, with the label state of the original.
+ *	@nhlfe: NHLFE of the branch.
+ *
+ *	Called by the P2MP_FWD opcode under rcu_read_lock_bh. The copy
+ *	shares the payload of the original, mpls_finish_output() only
+ *	unshares the header to write the label stack of the branch.
+ **/
+
+int mpls_output_branch(struct sk_buff *skb, struct mpls_nhlfe *nhlfe)
+{
+	int ret;
+
+	if (unlikely(__this_cpu_read(mpls_branch_depth) >=
+			MPLS_FWD_MAX_DEPTH)) {
+		kfree_skb(skb);
+		MPLS_INC_STATS_BH(dev_net(nhlfe->dst.dev), MPLS_MIB_OUTERRORS);
+		mpls_lsp_stats_drop(nhlfe->nhlfe_stats);
+		return -ELOOP;
+	}
+
+	/* the copy is never handed back to mpls_input() */
+	MPLSCB(skb)->relookup = 0;
+	skb_dst_drop(skb);
+	skb_dst_set_noref(skb, &nhlfe->dst);
+
+	__this_cpu_inc(mpls_branch_depth);
+	ret = mpls_finish_output(skb, nhlfe);
+	__this_cpu_dec(mpls_branch_depth);
+	return ret;
+}
 
 /**
  *	mpls_output - Send a packet using MPLS forwarding.
@@ -306,6 +472,7 @@ int mpls_output(struct sk_buff *skb)
 	cb->bos = 1;
 	cb->flag = 0;
 	cb->popped_bos = 1;
+	cb->relookup = 0;
 
 	return mpls_finish_output(skb, nhlfe);
 
@@ -362,3 +529,86 @@ mpls_switch_drop:
 	MPLS_EXIT;
 	return -EINVAL;
 }
+
+/**
+ *	mpls_gso_segment - Software GSO for labelled packets.
+ *	@skb:      GSO skb, data and network header at the top label.
+ *	@features: features of the output device.
+ *
+ *	The label stack is treated as part of the link layer header: it is
+ *	copied in front of every segment built by the IPv4/IPv6 GSO handler.
+ **/
+
+struct sk_buff *mpls_gso_segment(struct sk_buff *skb,
+		netdev_features_t features)
+{
+	struct sk_buff *segs = ERR_PTR(-EINVAL);
+	unsigned int mac_len = skb->mac_len;
+	__be16 protocol = skb->protocol;
+	unsigned int stack_len = 0;
+	struct sk_buff *nskb;
+	__be16 type;
+
+	if (unlikely(skb_shinfo(skb)->gso_type &
+		     ~(SKB_GSO_TCPV4 |
+		       SKB_GSO_TCPV6 |
+		       SKB_GSO_UDP |
+		       SKB_GSO_DODGY |
+		       SKB_GSO_TCP_ECN |
+		       SKB_GSO_MPLS)))
+		goto out;
+
+	/* Walk down to the bottom of the stack */
+	do {
+		stack_len += MPLS_HDR_LEN;
+		if (unlikely(!pskb_may_pull(skb, stack_len + 1)))
+			goto out;
+	} while (!__MPLS_SHIM_S_BIT(ntohl(*(__be32 *)
+			(skb->data + stack_len - MPLS_HDR_LEN))));
+
+	switch (skb->data[stack_len] >> 4) {
+	case 4:
+		type = htons(ETH_P_IP);
+		break;
+	case 6:
+		type = htons(ETH_P_IPV6);
+		break;
+	default:
+		goto out;
+	}
+
+	__skb_push(skb, mac_len);
+	skb->mac_len = mac_len + stack_len;
+	skb_set_network_header(skb, skb->mac_len);
+	skb->protocol = type;
+	skb_shinfo(skb)->gso_type &= ~SKB_GSO_MPLS;
+
+	segs = skb_mac_gso_segment(skb, features);
+
+	skb_shinfo(skb)->gso_type |= SKB_GSO_MPLS;
+	skb->protocol = protocol;
+	skb->mac_len = mac_len;
+	skb_set_network_header(skb, mac_len);
+	__skb_pull(skb, mac_len);
+
+	if (IS_ERR_OR_NULL(segs))
+		goto out;
+
+	for (nskb = segs; nskb; nskb = nskb->next) {
+		nskb->protocol = protocol;
+		nskb->mac_len = mac_len;
+		skb_set_network_header(nskb, mac_len);
+	}
+out:
+	return segs;
+}
+
+/**
+ *	mpls_gso_send_check - Nothing to check in the label stack, the
+ *	inner protocol is checked by mpls_gso_segment().
+ **/
+
+int mpls_gso_send_check(struct sk_buff *skb)
+{
+	return 0;
+}
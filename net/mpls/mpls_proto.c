@@ -115,15 +115,88 @@ out:
 }
 EXPORT_SYMBOL(mpls_proto_find_by_ethertype);
 
-void mpls_proto_cache_flush_all(struct net *net)
+/**
+ *	mpls_proto_deliver - Hand a packet without labels to layer 3.
+ *	@skb:       packet, network header at the payload.
+ *	@ethertype: protocol of the payload.
+ *
+ *	Fast path: no reference is taken on the driver, it can't go away
+ *	while we are in the RCU read side. Returns 0 if the driver took the
+ *	skb, an error (skb left to the caller) otherwise.
+ **/
+
+int mpls_proto_deliver(struct sk_buff *skb, unsigned short ethertype)
+{
+	struct mpls_prot_driver *proto;
+	int retval = -EPROTONOSUPPORT;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(proto, &mpls_proto_list, list) {
+		if (ethertype == proto->ethertype) {
+			retval = proto->local_deliver(skb);
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return retval;
+}
+
+/*
+ * The cache hooks may sleep: they run outside the RCU read side, with a
+ * reference on the driver keeping it in the list. Drivers whose routes
+ * check their NHLFE (nhlfe_check) have nothing to flush.
+ */
+static void mpls_proto_cache_flush(struct net *net)
 {
 	struct mpls_prot_driver *proto = NULL;
-	MPLS_ENTER;
+
 	rcu_read_lock();
 	list_for_each_entry_rcu(proto, &mpls_proto_list, list) {
+		if (proto->nhlfe_check || mpls_proto_hold(proto))
+			continue;
+		rcu_read_unlock();
+
 		proto->cache_flush(net);
+
+		rcu_read_lock();
+		mpls_proto_release(proto);
 	}
 	rcu_read_unlock();
+}
+
+/**
+ *	mpls_proto_cache_flush_all - invalidate the L3 caches of a namespace
+ *	@net: namespace
+ *
+ *	For changes of many NHLFEs at once, each of them already went
+ *	through mpls_nhlfe_invalidate(): only the caches that can't tell
+ *	which routes are stacked on them are flushed. Process context only.
+ **/
+
+void mpls_proto_cache_flush_all(struct net *net)
+{
+	MPLS_ENTER;
+	mpls_proto_cache_flush(net);
 	MPLS_EXIT;
 }
 EXPORT_SYMBOL(mpls_proto_cache_flush_all);
+
+/**
+ *	mpls_proto_cache_flush_nhlfe - invalidate the L3 cache entries using a
+ *	NHLFE
+ *	@net: namespace
+ *	@nhlfe: NHLFE that changed or is going away
+ *
+ *	Only the routes stacked on @nhlfe have to re-resolve: they find it
+ *	stale in nhlfe_dst_check() on their next lookup, nothing is walked.
+ *	Drivers that can't tell them apart fall back to flushing their whole
+ *	cache. Process context only, may sleep.
+ **/
+
+void mpls_proto_cache_flush_nhlfe(struct net *net, struct mpls_nhlfe *nhlfe)
+{
+	MPLS_ENTER;
+	mpls_nhlfe_invalidate(nhlfe);
+	mpls_proto_cache_flush(net);
+	MPLS_EXIT;
+}
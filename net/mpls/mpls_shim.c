@@ -36,6 +36,8 @@ inline int mpls_set_nexthop2(struct mpls_nhlfe *nhlfe, struct dst_entry *dst)
 	dst_metric_set(dst, RTAX_MTU, dst_mtu(&nhlfe->dst));
 	dst->child = &nhlfe->dst;
 	dst->header_len = nhlfe->dst.header_len;
+	/* the label stack is replicated by skb_gso_segment() */
+	dst->flags |= DST_GSO_ENCAP;
 
 	MPLS_DEBUG("nhlfe: %p mtu: %d dst: %p\n",
 			nhlfe, dst_mtu(&nhlfe->dst), dst);
@@ -49,10 +51,13 @@ EXPORT_SYMBOL(mpls_set_nexthop2);
  *	mpls_set_nexthop
  *	@shim:holds the key to look up the NHLFE object to apply.
  *	@dst: dst_entry
+ *	@cookie: generation of the NHLFE, for nhlfe_dst_check() [OUT], or NULL
  *
- *	Called from outside the MPLS subsystem.
+ *	Called from outside the MPLS subsystem. The dst keeps the reference
+ *	on the NHLFE, dst_destroy() drops it along with the dst.
  **/
-inline int mpls_set_nexthop(struct shim_blk *sblk, struct dst_entry *dst)
+inline int mpls_set_nexthop(struct shim_blk *sblk, struct dst_entry *dst,
+		u32 *cookie)
 {
 	struct mpls_nhlfe *nhlfe = NULL;
 	unsigned int key;
@@ -61,14 +66,21 @@ inline int mpls_set_nexthop(struct shim_blk *sblk, struct dst_entry *dst)
 	MPLS_ENTER;
 
 	memcpy(&key, sblk->data, sizeof(key));
-	nhlfe = mpls_get_nhlfe(key);
+	/* the route and the NHLFE it is stacked on share the namespace */
+	nhlfe = mpls_get_nhlfe(dev_net(dst->dev), key);
 	if (unlikely(!nhlfe)) {
 		MPLS_EXIT;
 		return -ENXIO;
 	}
 
+	/* before what is copied from the NHLFE, cf. mpls_nhlfe_invalidate() */
+	if (cookie)
+		*cookie = atomic_read(&nhlfe->nhlfe_genid);
+	smp_rmb();
+
 	ret = mpls_set_nexthop2(nhlfe, dst);
-	mpls_nhlfe_release(nhlfe);
+	if (ret)
+		mpls_nhlfe_release(nhlfe);
 	MPLS_EXIT;
 	return ret;
 }
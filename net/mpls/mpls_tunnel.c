@@ -12,6 +12,11 @@
  *         Destruction : mpls_tunnel_destroy
  *         EXPORT_SYMBOL(mpls_tunnel_create);
  *         EXPORT_SYMBOL(mpls_tunnel_destroy);
+ *         A tunnel created with an encapsulation is a link instead: the
+ *         NHLFEs that SET it as output device have their labelled
+ *         packets sent in UDP (RFC 7510) or GRE (RFC 4023) to the remote
+ *         endpoint. MPLS-in-UDP received from that endpoint is handed
+ *         to mpls_skb_recv() as if it came in on the device.
  *
  * Authors:
  *   (c) 1999-2005   James Leu        <jleu@mindspring.com>
@@ -25,6 +30,7 @@
  *
   *****************************************************************************/
 
+#include <linux/hash.h>
 #include <linux/in.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
@@ -34,7 +40,13 @@
 #include <linux/if_tunnel.h>
 #include <linux/netdevice.h>
 #include <linux/rtnetlink.h>
+#include <linux/udp.h>
 #include <net/net_namespace.h>
+#include <net/ip.h>
+#include <net/ipip.h>
+#include <net/route.h>
+#include <net/udp.h>
+#include <net/xfrm.h>
 #include <net/mpls.h>
 
 /**
@@ -45,6 +57,15 @@ static struct net_device *mpls_tunnel_dev;
 static void mpls_tunnel_setup(struct net_device *dev);
 static int mpls_tunnel_key;
 
+/* Encapsulating tunnels, hashed by remote endpoint (RCU, RTNL) */
+#define MPLS_TUNNEL_HASH_BITS	8
+static struct hlist_head mpls_tunnel_encap_hash[1 << MPLS_TUNNEL_HASH_BITS];
+static struct socket *mpls_tunnel_udp_sock;
+
+/* RFC 7510: the entropy goes in the dynamic port range, 49152-65535 */
+#define MPLS_UDP_SPORT_MIN	49152
+#define MPLS_GRE_HLEN		4
+
 MODULE_AUTHOR("James R. Leu <jleu@mindspring.com>, Ramon Casellas <casellas@infres.enst.fr>");
 MODULE_DESCRIPTION("MultiProtocol Label Switching Tunnel Module");
 MODULE_LICENSE("GPL");
@@ -57,6 +78,38 @@ MODULE_LICENSE("GPL");
 #define mpls_mtp2dev(MPLSMTP) \
 	((struct net_device *)((MPLSMTP)->mtp_dev))
 
+static inline struct hlist_head *mpls_tunnel_encap_bucket(__be32 remote)
+{
+	return &mpls_tunnel_encap_hash[hash_32((__force u32)remote,
+			MPLS_TUNNEL_HASH_BITS)];
+}
+
+/*
+ * The device is NETIF_F_LLTX: these run on many cpus at once, with BH
+ * disabled, each one on its own copy of the counters.
+ */
+static inline void mpls_tunnel_tx_stats(struct net_device *dev,
+		unsigned int len)
+{
+	struct mpls_tunnel_stats *s = this_cpu_ptr(mpls_dev2mtp(dev)->mtp_stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->tx_packets++;
+	s->tx_bytes += len;
+	u64_stats_update_end(&s->syncp);
+}
+
+static inline void mpls_tunnel_rx_stats(struct net_device *dev,
+		unsigned int len)
+{
+	struct mpls_tunnel_stats *s = this_cpu_ptr(mpls_dev2mtp(dev)->mtp_stats);
+
+	u64_stats_update_begin(&s->syncp);
+	s->rx_packets++;
+	s->rx_bytes += len;
+	u64_stats_update_end(&s->syncp);
+}
+
 /**
  *	mpls_tunnel_set_nhlfe - sets the nhlfe for this virtual device.
  *	@dev: netdevice "mpls%d"
@@ -102,7 +155,7 @@ static int mpls_tunnel_set_nhlfe(
 	}
 
 	/* Get a reference for new NHLFE */
-	newnhlfe = mpls_get_nhlfe(key);
+	newnhlfe = mpls_get_nhlfe(dev_net(dev), key);
 	if (unlikely(!newnhlfe)) {
 		MPLS_DEBUG("error fetching new nhlfe with key %u\n", key);
 		MPLS_DEBUG("keeping old nhlfe %x\n", nhlfe->nhlfe_key);
@@ -142,14 +195,209 @@ static int mpls_tunnel_set_nhlfe(
  *	zero.
  **/
 
+static void mpls_tunnel_free(struct net_device *dev)
+{
+	free_percpu(mpls_dev2mtp(dev)->mtp_stats);
+	free_netdev(dev);
+}
+
 static void mpls_tunnel_destructor(struct net_device *dev)
 {
 	MPLS_ENTER;
 	mpls_tunnel_set_nhlfe(dev, 0);
-	free_netdev(dev);
+	mpls_tunnel_free(dev);
 	MPLS_EXIT;
 }
 
+static inline int mpls_tunnel_encap_hlen(struct mpls_tunnel_private *mtp)
+{
+	return sizeof(struct iphdr) +
+		(mtp->mtp_encap == MPLS_TUNNEL_ENCAP_UDP ?
+		 sizeof(struct udphdr) : MPLS_GRE_HLEN);
+}
+
+/**
+ *	mpls_tunnel_encap_xmit - send a labelled packet to the remote endpoint.
+ *	@skb: labelled packet, skb->data at the top of the label stack.
+ *	@dev: encapsulating tunnel
+ *
+ *	The UDP source port is taken from the flow hash of the packet, which
+ *	covers the label stack and the inner headers: the underlay spreads
+ *	the LSPs over its ECMP paths without looking past the UDP header.
+ *	GSO and checksum offload are not advertised by the device, so the
+ *	packet is final when it gets here.
+ **/
+
+static int mpls_tunnel_encap_xmit(struct sk_buff *skb,
+					struct net_device *dev)
+{
+	struct mpls_tunnel_private *mtp = mpls_dev2mtp(dev);
+	struct net_device *tdev;
+	struct rtable *rt;
+	struct flowi4 fl4;
+	struct iphdr *iph;
+	__be16 sport = 0, dport = 0;
+	unsigned int len;
+	u8 proto;
+
+	MPLS_ENTER;
+	if (unlikely(skb->protocol != htons(ETH_P_MPLS_UC)))
+		goto tx_error;
+
+	if (mtp->mtp_encap == MPLS_TUNNEL_ENCAP_UDP) {
+		proto = IPPROTO_UDP;
+		sport = htons(MPLS_UDP_SPORT_MIN |
+			(skb_get_rxhash(skb) >> 18));
+		dport = htons(MPLS_UDP_PORT);
+	} else
+		proto = IPPROTO_GRE;
+
+	rt = ip_route_output_ports(dev_net(dev), &fl4, NULL,
+				   mtp->mtp_remote, mtp->mtp_local,
+				   dport, sport, proto, 0, 0);
+	if (IS_ERR(rt)) {
+		dev->stats.tx_carrier_errors++;
+		goto tx_error;
+	}
+	tdev = rt->dst.dev;
+	if (tdev == dev) {
+		ip_rt_put(rt);
+		dev->stats.collisions++;
+		goto tx_error;
+	}
+
+	if (skb_cow_head(skb, LL_RESERVED_SPACE(tdev) +
+			mpls_tunnel_encap_hlen(mtp))) {
+		ip_rt_put(rt);
+		dev->stats.tx_dropped++;
+		dev_kfree_skb(skb);
+		MPLS_EXIT;
+		return NETDEV_TX_OK;
+	}
+
+	if (proto == IPPROTO_UDP) {
+		struct udphdr *uh;
+
+		uh = (struct udphdr *)__skb_push(skb, sizeof(*uh));
+		uh->source = sport;
+		uh->dest = dport;
+		uh->len = htons(skb->len);
+		/* allowed over IPv4, the label stack has no checksum either */
+		uh->check = 0;
+	} else {
+		__be16 *gre = (__be16 *)__skb_push(skb, MPLS_GRE_HLEN);
+
+		gre[0] = 0;
+		gre[1] = htons(ETH_P_MPLS_UC);
+	}
+	skb_reset_transport_header(skb);
+
+	skb_push(skb, sizeof(struct iphdr));
+	skb_reset_network_header(skb);
+	memset(&(IPCB(skb)->opt), 0, sizeof(IPCB(skb)->opt));
+	IPCB(skb)->flags = 0;
+	skb_dst_drop(skb);
+	skb_dst_set(skb, &rt->dst);
+
+	iph = ip_hdr(skb);
+	iph->version = 4;
+	iph->ihl = sizeof(struct iphdr) >> 2;
+	iph->frag_off = 0;
+	iph->protocol = proto;
+	iph->tos = 0;
+	iph->daddr = fl4.daddr;
+	iph->saddr = fl4.saddr;
+	iph->ttl = ip4_dst_hoplimit(&rt->dst);
+
+	nf_reset(skb);
+	skb->ip_summed = CHECKSUM_NONE;
+	ip_select_ident(iph, &rt->dst, NULL);
+	len = skb->len - skb_transport_offset(skb);
+	if (likely(net_xmit_eval(ip_local_out(skb)) == 0))
+		mpls_tunnel_tx_stats(dev, len);
+	else {
+		dev->stats.tx_errors++;
+		dev->stats.tx_aborted_errors++;
+	}
+	MPLS_EXIT;
+	return NETDEV_TX_OK;
+
+tx_error:
+	dev->stats.tx_errors++;
+	dev_kfree_skb(skb);
+	MPLS_EXIT;
+	return NETDEV_TX_OK;
+}
+
+/**
+ *	mpls_tunnel_encap_lookup - find the tunnel of received encapsulation.
+ *	@remote: source address of the packet.
+ *	@local: destination address of the packet.
+ *	@encap: MPLS_TUNNEL_ENCAP_*
+ *
+ *	Called under rcu_read_lock. A tunnel with no local address accepts
+ *	the packets sent to any address of the box.
+ **/
+
+static struct net_device *mpls_tunnel_encap_lookup(__be32 remote,
+		__be32 local, unsigned int encap)
+{
+	struct mpls_tunnel_private *mtp;
+	struct hlist_node *n;
+
+	hlist_for_each_entry_rcu(mtp, n, mpls_tunnel_encap_bucket(remote),
+			mtp_encap_node) {
+		if (mtp->mtp_encap == encap && mtp->mtp_remote == remote &&
+		    (!mtp->mtp_local || mtp->mtp_local == local) &&
+		    (mtp->mtp_dev->flags & IFF_UP))
+			return mtp->mtp_dev;
+	}
+	return NULL;
+}
+
+/**
+ *	mpls_tunnel_udp_rcv - UDP encapsulation handler of port 6635.
+ *	@sk: kernel socket of the module
+ *	@skb: datagram, skb->data at the UDP header
+ *
+ *	The label stack is handed to mpls_skb_recv() right away, on behalf of
+ *	the tunnel of the sender: the labelspace is the one of that device
+ *	and the packet doesn't go through netif_rx()/netif_receive_skb()
+ *	again. Datagrams from unknown endpoints are dropped.
+ **/
+
+static int mpls_tunnel_udp_rcv(struct sock *sk, struct sk_buff *skb)
+{
+	const struct iphdr *iph = ip_hdr(skb);
+	struct net_device *dev;
+
+	if (udp_lib_checksum_complete(skb))
+		goto drop;
+
+	dev = mpls_tunnel_encap_lookup(iph->saddr, iph->daddr,
+			MPLS_TUNNEL_ENCAP_UDP);
+	if (unlikely(!dev))
+		goto drop;
+
+	__skb_pull(skb, sizeof(struct udphdr));
+	skb_reset_network_header(skb);
+	skb->protocol = htons(ETH_P_MPLS_UC);
+	skb->mac_header = skb->network_header;
+	skb->pkt_type = PACKET_HOST;
+	secpath_reset(skb);
+	__skb_tunnel_rx(skb, dev);
+	/* IPCB, not a MPLS one */
+	memset(MPLSCB(skb), 0, sizeof(struct mpls_skb_cb));
+
+	mpls_tunnel_rx_stats(dev, skb->len);
+
+	mpls_skb_recv(skb, dev, NULL, dev);
+	return 0;
+drop:
+	kfree_skb(skb);
+	return 0;
+}
+
 /**
  *	mpls_tunnel_xmit - transmit a socket buffer via the device.
  *	@skb: data
@@ -168,6 +416,11 @@ static int mpls_tunnel_xmit(struct sk_buff *skb,
 
 	MPLS_ENTER;
 
+	if (mpls_dev2mtp(dev)->mtp_encap) {
+		MPLS_EXIT;
+		return mpls_tunnel_encap_xmit(skb, dev);
+	}
+
 	if (nhlfe) {
 		MPLS_DEBUG(
 				"Skb to Send\n"
@@ -180,8 +433,7 @@ static int mpls_tunnel_xmit(struct sk_buff *skb,
 		);
 
 		MPLS_DEBUG("Using NHLFE %08x\n", nhlfe->nhlfe_key);
-		mpls_dev2mtp(dev)->stat.tx_packets++;
-		mpls_dev2mtp(dev)->stat.tx_bytes += skb->len;
+		mpls_tunnel_tx_stats(dev, skb->len);
 
 		skb_dst_drop(skb);
 		mpls_nhlfe_hold(nhlfe);
@@ -193,21 +445,52 @@ static int mpls_tunnel_xmit(struct sk_buff *skb,
 	}
 
 	dev_kfree_skb(skb);
-	mpls_dev2mtp(dev)->stat.tx_errors++;
+	dev->stats.tx_errors++;
 	MPLS_DEBUG("exit - NHLFE was invalid\n");
 	MPLS_EXIT;
 	return 0;
 }
 
 /**
- *	mpls_tunnel_get_stats - get sender statistics for this tunnel
+ *	mpls_tunnel_get_stats64 - get statistics for this tunnel
  *	@dev: virtual "mpls%d" device.
+ *	@tot: filled with the sum of the per cpu counters.
+ *
+ *	The error counters are rare and stay in dev->stats.
  **/
 
-static struct net_device_stats *mpls_tunnel_get_stats(
-		struct net_device *dev)
+static struct rtnl_link_stats64 *mpls_tunnel_get_stats64(
+		struct net_device *dev, struct rtnl_link_stats64 *tot)
 {
-	return &((mpls_dev2mtp(dev))->stat);
+	struct mpls_tunnel_private *mtp = mpls_dev2mtp(dev);
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		const struct mpls_tunnel_stats *s =
+			per_cpu_ptr(mtp->mtp_stats, cpu);
+		u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&s->syncp);
+			rx_packets = s->rx_packets;
+			rx_bytes = s->rx_bytes;
+			tx_packets = s->tx_packets;
+			tx_bytes = s->tx_bytes;
+		} while (u64_stats_fetch_retry_bh(&s->syncp, start));
+
+		tot->rx_packets += rx_packets;
+		tot->rx_bytes += rx_bytes;
+		tot->tx_packets += tx_packets;
+		tot->tx_bytes += tx_bytes;
+	}
+
+	tot->tx_errors = dev->stats.tx_errors;
+	tot->tx_dropped = dev->stats.tx_dropped;
+	tot->tx_carrier_errors = dev->stats.tx_carrier_errors;
+	tot->tx_aborted_errors = dev->stats.tx_aborted_errors;
+	tot->collisions = dev->stats.collisions;
+	return tot;
 }
 
 /**
@@ -224,9 +507,14 @@ static struct net_device_stats *mpls_tunnel_get_stats(
 
 static int mpls_tunnel_change_mtu(struct net_device *dev, int new_mtu)
 {
-	struct dst_entry *dst = &mpls_dev2mtp(dev)->mtp_nhlfe->dst;
+	struct mpls_tunnel_private *mtp = mpls_dev2mtp(dev);
+	int max_mtu;
 	MPLS_ENTER;
-	if ((new_mtu < MPLS_HDR_LEN) || (new_mtu > dst_mtu(dst))) {
+	if (mtp->mtp_encap)
+		max_mtu = 0xFFF8 - mpls_tunnel_encap_hlen(mtp);
+	else
+		max_mtu = dst_mtu(&mtp->mtp_nhlfe->dst);
+	if ((new_mtu < MPLS_HDR_LEN) || (new_mtu > max_mtu)) {
 			MPLS_EXIT;
 			return -EINVAL;
 	}
@@ -236,37 +524,81 @@ static int mpls_tunnel_change_mtu(struct net_device *dev, int new_mtu)
 	return 0;
 }
 
-static int mpls_tunnel_alloc(struct mpls_tunnel_req *mtr)
+/**
+ *	mpls_tunnel_encap_init - set up an encapsulating tunnel.
+ *	@dev: new tunnel, not registered yet.
+ *	@mter: request holding the encapsulation and the endpoints.
+ *
+ *	The MTU follows the route to the remote endpoint at creation time.
+ *	The device doesn't offer GSO nor checksum offload: the stack
+ *	resolves both before the packet is encapsulated.
+ **/
+
+static void mpls_tunnel_encap_init(struct net_device *dev,
+		struct mpls_tunnel_encap_req *mter)
+{
+	struct mpls_tunnel_private *mtp = mpls_dev2mtp(dev);
+	struct flowi4 fl4;
+	struct rtable *rt;
+	int mtu = ETH_DATA_LEN;
+
+	mtp->mtp_encap = mter->mte_encap;
+	mtp->mtp_local = mter->mte_local;
+	mtp->mtp_remote = mter->mte_remote;
+
+	rt = ip_route_output_ports(dev_net(dev), &fl4, NULL, mtp->mtp_remote,
+			mtp->mtp_local, 0, 0, IPPROTO_UDP, 0, 0);
+	if (!IS_ERR(rt)) {
+		mtu = dst_mtu(&rt->dst);
+		ip_rt_put(rt);
+	}
+	dev->mtu = mtu - mpls_tunnel_encap_hlen(mtp);
+	dev->needed_headroom = LL_MAX_HEADER + mpls_tunnel_encap_hlen(mtp);
+	dev->features &= ~(NETIF_F_HW_CSUM | NETIF_F_GSO_SOFTWARE);
+	dev->hw_features &= ~(NETIF_F_HW_CSUM | NETIF_F_GSO_SOFTWARE);
+}
+
+static int mpls_tunnel_alloc(struct mpls_tunnel_encap_req *mter)
 {
+	struct mpls_tunnel_req *mtr = &mter->mte_req;
 	struct mpls_nhlfe *nhlfe = NULL;
 	struct net_device *dev;
 	int retval;
 
 	MPLS_ENTER;
 	retval = -ESRCH;
-	nhlfe = mpls_get_nhlfe(mtr->mt_nhlfe_key);
+	/* tunnels are created next to mpls0, in the initial namespace */
+	nhlfe = mpls_get_nhlfe(&init_net, mtr->mt_nhlfe_key);
 	if (mtr->mt_nhlfe_key && !nhlfe)
 		goto error;
 
 	retval = -ENOMEM;
 	snprintf(mtr->mt_ifname, IFNAMSIZ, "mpls%d", mpls_tunnel_key++);
-	dev = alloc_netdev(sizeof(struct mpls_tunnel_private),
-			mtr->mt_ifname, mpls_tunnel_setup);
+	dev = alloc_netdev_mqs(sizeof(struct mpls_tunnel_private),
+			mtr->mt_ifname, mpls_tunnel_setup,
+			num_possible_cpus(), 1);
 	if (!dev) {
 		mpls_nhlfe_release(nhlfe);
 		goto error;
 	}
 
+	if (mter->mte_encap)
+		mpls_tunnel_encap_init(dev, mter);
+
 	retval = -ENOBUFS;
 	if (register_netdevice(dev)) {
 		mpls_nhlfe_release(nhlfe);
-		free_netdev(dev);
+		mpls_tunnel_free(dev);
 		goto error;
 	}
 
 	mpls_dev2mtp(dev)->mtp_nhlfe = nhlfe;
 	/* Set new MTU for the tunnel device */
-	dev_set_mtu(dev, dst_mtu(&nhlfe->dst));
+	if (nhlfe)
+		dev_set_mtu(dev, dst_mtu(&nhlfe->dst));
+	if (mter->mte_encap)
+		hlist_add_head_rcu(&mpls_dev2mtp(dev)->mtp_encap_node,
+				mpls_tunnel_encap_bucket(mter->mte_remote));
 	dev_hold(dev);
 	retval = 0;
 error:
@@ -275,12 +607,18 @@ error:
 	return retval;
 }
 
+/*
+ * Tunnels are found through the hashed name list of the netdevices, other
+ * devices of the same name aren't ours.
+ */
 static struct net_device *mpls_tunnel_lookup(
 	struct mpls_tunnel_req *mtr)
 {
 	struct net_device *dev;
 	MPLS_ENTER;
 	dev = __dev_get_by_name(&init_net, mtr->mt_ifname);
+	if (dev && dev->type != ARPHRD_MPLS_TUNNEL)
+		dev = NULL;
 	MPLS_EXIT;
 	return dev;
 }
@@ -300,30 +638,39 @@ static int
 mpls_tunnel_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 {
 	struct mpls_tunnel_private *mtp = NULL;
-	struct mpls_tunnel_req mtr;
+	struct mpls_tunnel_encap_req mter;
+	struct mpls_tunnel_req *mtr = &mter.mte_req;
+	size_t len = sizeof(*mtr);
 	int retval = 0;
 
 	MPLS_ENTER;
+	memset(&mter, 0, sizeof(mter));
 	switch (cmd) {
+	case SIOCGETMPLSENCAP:
+		len = sizeof(mter);
+		/* fall through */
 	case SIOCGETTUNNEL:
 		if (dev == mpls_tunnel_dev) {
 			retval = -EFAULT;
-			if (copy_from_user(&mtr, ifr->ifr_data, sizeof(mtr)))
+			if (copy_from_user(&mter, ifr->ifr_data, len))
 				break;
 
 			retval = -ENOENT;
-			dev = mpls_tunnel_lookup(&mtr);
+			dev = mpls_tunnel_lookup(mtr);
 			if (!dev)
 				break;
 
 			retval = -EINVAL;
-			if (strncmp(mtr.mt_ifname, "mpls0", 5) == 0)
+			if (strncmp(mtr->mt_ifname, "mpls0", 5) == 0)
 				break;
 		}
 
 		mtp = mpls_dev2mtp(dev);
-		mtr.mt_nhlfe_key =
+		mtr->mt_nhlfe_key =
 				mtp->mtp_nhlfe ? mtp->mtp_nhlfe->nhlfe_key : 0;
+		mter.mte_encap = mtp->mtp_encap;
+		mter.mte_local = mtp->mtp_local;
+		mter.mte_remote = mtp->mtp_remote;
 		retval = 0;
 		break;
 
@@ -332,47 +679,62 @@ mpls_tunnel_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 		if (!capable(CAP_NET_ADMIN))
 			break;
 
-		if (mtr.mt_nhlfe_key == 0)
+		retval = -EFAULT;
+		if (copy_from_user(&mter, ifr->ifr_data, len))
 			break;
 
-		if (dev == mpls_tunnel_dev) {
-			retval = -EFAULT;
-			if (copy_from_user(&mtr, ifr->ifr_data, sizeof(mtr)))
-				break;
+		retval = -EINVAL;
+		if (mtr->mt_nhlfe_key == 0)
+			break;
 
+		if (dev == mpls_tunnel_dev) {
 			retval = -ENOENT;
-			dev = mpls_tunnel_lookup(&mtr);
+			dev = mpls_tunnel_lookup(mtr);
 			if (!dev)
 				break;
 
 			retval = -EINVAL;
-			if (strncmp(mtr.mt_ifname, "mpls0", 5) == 0)
+			if (strncmp(mtr->mt_ifname, "mpls0", 5) == 0)
 				break;
 		}
 
-		retval = mpls_tunnel_set_nhlfe(dev, mtr.mt_nhlfe_key);
+		/* an encapsulating tunnel is a link, it has no NHLFE */
+		retval = -EINVAL;
+		if (mpls_dev2mtp(dev)->mtp_encap)
+			break;
+
+		retval = mpls_tunnel_set_nhlfe(dev, mtr->mt_nhlfe_key);
 		break;
 
+	case SIOCADDMPLSENCAP:
+		len = sizeof(mter);
+		/* fall through */
 	case SIOCADDTUNNEL:
 		retval = -EPERM;
 		if (!capable(CAP_NET_ADMIN))
 			break;
 
 		retval = -EFAULT;
-		if (copy_from_user(&mtr, ifr->ifr_data, sizeof(mtr)))
+		if (copy_from_user(&mter, ifr->ifr_data, len))
 			break;
 
 		retval = -EINVAL;
-		if (mtr.mt_nhlfe_key == 0)
+		if (mter.mte_encap) {
+			/* only mpls0 creates them, with a remote endpoint */
+			if (dev != mpls_tunnel_dev || mtr->mt_nhlfe_key ||
+			    mter.mte_encap >= MPLS_TUNNEL_ENCAP_MAX ||
+			    !mter.mte_remote)
+				break;
+		} else if (mtr->mt_nhlfe_key == 0)
 			break;
 
 		if (dev == mpls_tunnel_dev) {
-			retval = mpls_tunnel_alloc(&mtr);
+			retval = mpls_tunnel_alloc(&mter);
 			break;
 		}
 
 		retval = mpls_tunnel_set_nhlfe(mpls_mtp2dev(mtp),
-				mtr.mt_nhlfe_key);
+				mtr->mt_nhlfe_key);
 		break;
 
 	case SIOCDELTUNNEL:
@@ -382,16 +744,16 @@ mpls_tunnel_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 
 		if (dev == mpls_tunnel_dev) {
 			retval = -EFAULT;
-			if (copy_from_user(&mtr, ifr->ifr_data, sizeof(mtr)))
+			if (copy_from_user(&mter, ifr->ifr_data, len))
 				break;
 
 			retval = -ENOENT;
-			dev = mpls_tunnel_lookup(&mtr);
+			dev = mpls_tunnel_lookup(mtr);
 			if (!dev)
 				break;
 
 			retval = -EINVAL;
-			if (strncmp(mtr.mt_ifname, "mpls0", 5) == 0)
+			if (strncmp(mtr->mt_ifname, "mpls0", 5) == 0)
 				break;
 		}
 
@@ -403,7 +765,7 @@ mpls_tunnel_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 		retval = -EINVAL;
 	}
 
-	if (copy_to_user(ifr->ifr_data, &mtr, sizeof(mtr)))
+	if (copy_to_user(ifr->ifr_data, &mter, len))
 		retval = -EFAULT;
 
 	MPLS_EXIT;
@@ -415,13 +777,21 @@ static int mpls_tunnel_init(struct net_device *dev)
 	struct mpls_tunnel_private *mtp =  mpls_dev2mtp(dev);
 	MPLS_ENTER;
 	mtp->mtp_dev = dev;
+	INIT_HLIST_NODE(&mtp->mtp_encap_node);
+	mtp->mtp_stats = alloc_percpu(struct mpls_tunnel_stats);
 	MPLS_EXIT;
-	return 0;
+	return mtp->mtp_stats ? 0 : -ENOMEM;
 }
 
 static void mpls_tunnel_uninit(struct net_device *dev)
 {
+	struct mpls_tunnel_private *mtp =  mpls_dev2mtp(dev);
 	MPLS_ENTER;
+	if (mtp->mtp_encap) {
+		/* receivers look the device up without a reference */
+		hlist_del_rcu(&mtp->mtp_encap_node);
+		synchronize_net();
+	}
 	dev_put(dev);
 	MPLS_EXIT;
 }
@@ -431,7 +801,7 @@ static const struct net_device_ops mpls_tunnel_ndo = {
 	.ndo_uninit = mpls_tunnel_uninit,
 	.ndo_do_ioctl = mpls_tunnel_ioctl,
 	.ndo_start_xmit = mpls_tunnel_xmit,
-	.ndo_get_stats = mpls_tunnel_get_stats,
+	.ndo_get_stats64 = mpls_tunnel_get_stats64,
 	.ndo_change_mtu = mpls_tunnel_change_mtu,
 };
 
@@ -461,7 +831,51 @@ static void mpls_tunnel_setup(struct net_device *dev)
 	dev->flags = IFF_NOARP|IFF_POINTOPOINT;
 	dev->iflink = 0;
 	dev->addr_len = MPLS_HDR_LEN;
+
+	/* GSO skbs get their labels as they are, the real device segments */
+	dev->features = NETIF_F_SG | NETIF_F_HW_CSUM | NETIF_F_HIGHDMA |
+			NETIF_F_GSO_SOFTWARE;
+	dev->hw_features = dev->features;
+	/* no TX lock: the counters are per cpu, the NHLFE is held */
+	dev->features |= NETIF_F_LLTX;
+	MPLS_EXIT;
+}
+
+/**
+ *	mpls_tunnel_udp_init - open the MPLS-in-UDP port.
+ *
+ *	A kernel socket bound to port 6635 whose datagrams go to
+ *	mpls_tunnel_udp_rcv() instead of its receive queue.
+ **/
+
+static int __init mpls_tunnel_udp_init(void)
+{
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+		.sin_port = htons(MPLS_UDP_PORT),
+	};
+	int retval;
+
+	MPLS_ENTER;
+	retval = sock_create_kern(AF_INET, SOCK_DGRAM, IPPROTO_UDP,
+			&mpls_tunnel_udp_sock);
+	if (retval < 0)
+		goto err;
+
+	retval = kernel_bind(mpls_tunnel_udp_sock, (struct sockaddr *)&sin,
+			sizeof(sin));
+	if (retval < 0) {
+		sock_release(mpls_tunnel_udp_sock);
+		mpls_tunnel_udp_sock = NULL;
+		goto err;
+	}
+
+	udp_sk(mpls_tunnel_udp_sock->sk)->encap_type = UDP_ENCAP_MPLSINUDP;
+	udp_sk(mpls_tunnel_udp_sock->sk)->encap_rcv = mpls_tunnel_udp_rcv;
+err:
 	MPLS_EXIT;
+	return retval;
 }
 
 /**
@@ -479,15 +893,23 @@ static int __init mpls_tunnel_init_module(void)
 	int retval = -EINVAL;
 	MPLS_ENTER;
 	mpls_tunnel_dev =
-		alloc_netdev(sizeof(struct mpls_tunnel_private),
-			"mpls0", mpls_tunnel_setup);
+		alloc_netdev_mqs(sizeof(struct mpls_tunnel_private),
+			"mpls0", mpls_tunnel_setup, num_possible_cpus(), 1);
 	if (unlikely(!mpls_tunnel_dev)) {
 		retval = -ENOMEM;
 		goto err;
 	}
 	retval = register_netdev(mpls_tunnel_dev);
 	if (unlikely(retval)) {
-		free_netdev(mpls_tunnel_dev);
+		mpls_tunnel_free(mpls_tunnel_dev);
+		goto err;
+	}
+
+	retval = mpls_tunnel_udp_init();
+	if (unlikely(retval)) {
+		printk(KERN_ERR "MPLS: unable to open UDP port %d\n",
+				MPLS_UDP_PORT);
+		unregister_netdev(mpls_tunnel_dev);
 		goto err;
 	}
 
@@ -522,6 +944,7 @@ static void __exit mpls_destroy_tunnels(void)
 static void __exit mpls_tunnel_exit_module(void)
 {
 	MPLS_ENTER;
+	sock_release(mpls_tunnel_udp_sock);
 	mpls_destroy_tunnels();
 	MPLS_EXIT;
 	return;
@@ -25,6 +25,8 @@
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
 #include <linux/kobject.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
 #include <net/neighbour.h>
 #include <net/route.h>
 #include <net/mpls.h>
@@ -138,6 +140,120 @@ unsigned int mpls_label2key(const int index, const struct mpls_label *label)
 }
 EXPORT_SYMBOL(mpls_label2key);
 
+/**
+ *	mpls_key2gen - Decode a key built from a generic label.
+ *	@key:   key obtained from mpls_label2key.
+ *	@index: labelspace stored in the key [OUT]
+ *	@gen:   generic label value stored in the key [OUT]
+ *
+ *	Returns 1 if the key was built from a generic label, 0 otherwise
+ *	(ATM/FR keys), in which case @index and @gen are left untouched.
+ **/
+
+int mpls_key2gen(unsigned int key, unsigned int *index, unsigned int *gen)
+{
+	struct mpls_key temp;
+
+	temp.u.mark = key;
+	if (temp.u.gen.type != MPLS_LABEL_GEN)
+		return 0;
+
+	*index = temp.u.gen.index;
+	*gen   = temp.u.gen.gen;
+	return 1;
+}
+EXPORT_SYMBOL(mpls_key2gen);
+
+/**
+ *	mpls_lsp_stats_fold - Sum up the per cpu counters of an ILM/NHLFE.
+ *	@ms:    netlink counters [OUT]
+ *	@stats: per cpu counters
+ **/
+
+void mpls_lsp_stats_fold(struct mpls_stats *ms,
+		struct mpls_lsp_stats __percpu *stats)
+{
+	int cpu;
+
+	memset(ms, 0, sizeof(*ms));
+	for_each_possible_cpu(cpu) {
+		const struct mpls_lsp_stats *s = per_cpu_ptr(stats, cpu);
+		u64 packets, bytes, drops;
+		unsigned int start;
+
+		do {
+			start = u64_stats_fetch_begin_bh(&s->syncp);
+			packets = s->packets;
+			bytes   = s->bytes;
+			drops   = s->drops;
+		} while (u64_stats_fetch_retry_bh(&s->syncp, start));
+
+		ms->ms_packets += packets;
+		ms->ms_bytes   += bytes;
+		ms->ms_drops   += drops;
+	}
+}
+EXPORT_SYMBOL(mpls_lsp_stats_fold);
+
+/*
+ * Token buckets of the ICMP errors, one table shared by all the cpus so
+ * that the limit is the configured one whatever the number of cpus. Keys
+ * that collide share a bucket: they are limited together, nothing is ever
+ * allocated.
+ *
+ * A bucket is a single word, the time at which it would be full again
+ * (the "theoretical arrival time" of a GCRA). It is updated with
+ * cmpxchg(), no lock is taken, and a denied error writes nothing.
+ */
+#define MPLS_ICMP_BUCKETS	256
+#define MPLS_ICMP_BURST		6
+
+static unsigned long mpls_icmp_buckets[MPLS_ICMP_BUCKETS];
+
+/**
+ *	mpls_icmp_xrlim_allow - may an ICMP error be sent for this packet?
+ *	@skb: offending packet, on the device it came in or goes out by.
+ *	@key: hash of the source of the offending packet.
+ *
+ *	Same token bucket as inet_peer_xrlim_allow(): one token every
+ *	net.mpls.icmp_ratelimit, up to a burst of MPLS_ICMP_BURST, per
+ *	(source, labelspace of skb->dev). To be called before anything is
+ *	built so that a TTL loop or a traceroute storm costs a hash.
+ **/
+
+bool mpls_icmp_xrlim_allow(const struct sk_buff *skb, u32 key)
+{
+	struct mpls_interface *mip = skb->dev->mpls_ptr;
+	unsigned long timeout = sysctl_mpls_icmp_ratelimit;
+	unsigned long now = jiffies;
+	unsigned long *b;
+	unsigned long old, tat;
+
+	if (!timeout)
+		return true;
+
+	key = jhash_2words(key, mip ? mip->labelspace : 0, 0);
+	b = &mpls_icmp_buckets[key % MPLS_ICMP_BUCKETS];
+
+	do {
+		old = ACCESS_ONCE(*b);
+		/*
+		 * A full bucket, or one left over from an older rate or
+		 * from before a jiffies wrap, starts again from now.
+		 */
+		tat = old;
+		if (time_before(tat, now) ||
+		    time_after(tat, now + MPLS_ICMP_BURST * timeout))
+			tat = now;
+		tat += timeout;
+		if (time_after(tat, now + MPLS_ICMP_BURST * timeout))
+			return false;
+	} while (cmpxchg(b, old, tat) != old);
+
+	return true;
+}
+EXPORT_SYMBOL(mpls_icmp_xrlim_allow);
+
 /**
  *	mpls_find_payload - find the beinging of the data under the
  *	mpls shim
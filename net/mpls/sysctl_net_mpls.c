@@ -15,15 +15,39 @@
 
 #include <linux/mm.h>
 #include <linux/sysctl.h>
+#include <linux/mutex.h>
 #include <net/mpls.h>
 
+/*
+ * Flip mpls_debug_key when the debug level goes from zero to non-zero
+ * and back, so the MPLS_DEBUG() checks cost nothing while it is off.
+ */
+static int proc_mpls_debug(ctl_table *table, int write,
+		void __user *buffer, size_t *lenp, loff_t *ppos)
+{
+	static DEFINE_MUTEX(mpls_debug_mutex);
+	int old, ret;
+
+	mutex_lock(&mpls_debug_mutex);
+	old = sysctl_mpls_debug;
+	ret = proc_dointvec(table, write, buffer, lenp, ppos);
+	if (!ret && write && !old != !sysctl_mpls_debug) {
+		if (sysctl_mpls_debug)
+			jump_label_inc(&mpls_debug_key);
+		else
+			jump_label_dec(&mpls_debug_key);
+	}
+	mutex_unlock(&mpls_debug_mutex);
+	return ret;
+}
+
 static ctl_table mpls_table[] = {
 	{
 			.procname	= "debug",
 			.data		= &sysctl_mpls_debug,
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
-			.proc_handler	= &proc_dointvec
+			.proc_handler	= &proc_mpls_debug
 	},
 	{
 			.procname	= "default_ttl",
@@ -32,6 +56,13 @@ static ctl_table mpls_table[] = {
 			.mode		= 0644,
 			.proc_handler	= &proc_dointvec
 	},
+	{
+			.procname	= "icmp_ratelimit",
+			.data		= &sysctl_mpls_icmp_ratelimit,
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &proc_dointvec_ms_jiffies
+	},
 	{ }
 };
 
@@ -48,7 +79,7 @@ int __init mpls_sysctl_init(void)
 	MPLS_ENTER;
 	mpls_table_header = register_sysctl_paths(mpls_path, mpls_table);
 	if (!mpls_table_header) {
-		MPLS_EXIT
+		MPLS_EXIT;
 		return -ENOMEM;
 	}
 	MPLS_EXIT;